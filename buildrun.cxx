@@ -280,6 +280,7 @@ compile_pass (systemtap_session& s)
   output_exportconf(s, o, "cpu_khz", "STAPCONF_CPU_KHZ");
   output_exportconf(s, o, "__module_text_address", "STAPCONF_MODULE_TEXT_ADDRESS");
   output_exportconf(s, o, "add_timer_on", "STAPCONF_ADD_TIMER_ON");
+  output_dual_exportconf(s, o, "irq_work_queue", "irq_work_sync", "STAPCONF_IRQ_WORK");
 
   output_dual_exportconf(s, o, "probe_kernel_read", "probe_kernel_write", "STAPCONF_PROBE_KERNEL");
   output_autoconf(s, o, "autoconf-hw_breakpoint_context.c",
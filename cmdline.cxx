@@ -55,5 +55,11 @@ struct option stap_long_options[] = {
   { "rlimit-fsize", 1, NULL, LONG_OPT_RLIMIT_FSIZE },
   { "sysroot", 1, NULL, LONG_OPT_SYSROOT },
   { "sysenv", 1, NULL, LONG_OPT_SYSENV },
+  { "defer-symbols", 0, NULL, LONG_OPT_DEFER_SYMBOLS },
+  { "striped-locks", 0, NULL, LONG_OPT_STRIPED_LOCKS },
+  { "seqlock-reads", 0, NULL, LONG_OPT_SEQLOCK_READS },
+  { "fold-globals", 0, NULL, LONG_OPT_FOLD_GLOBALS },
+  { "percpu-arrays", 0, NULL, LONG_OPT_PERCPU_ARRAYS },
+  { "amortize-actions", 0, NULL, LONG_OPT_AMORTIZE_ACTIONS },
   { NULL, 0, NULL, 0 }
 };
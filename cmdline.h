@@ -54,6 +54,12 @@ enum {
   LONG_OPT_RLIMIT_FSIZE,
   LONG_OPT_SYSROOT,
   LONG_OPT_SYSENV,
+  LONG_OPT_DEFER_SYMBOLS,
+  LONG_OPT_STRIPED_LOCKS,
+  LONG_OPT_SEQLOCK_READS,
+  LONG_OPT_FOLD_GLOBALS,
+  LONG_OPT_PERCPU_ARRAYS,
+  LONG_OPT_AMORTIZE_ACTIONS,
 };
 
 // NB: when adding new options, consider very carefully whether they
@@ -1125,6 +1125,309 @@ semantic_pass_stats (systemtap_session & sess)
 
 // ------------------------------------------------------------------------
 
+// Find the numeric globals that are only ever added to, as in
+// "count++" or "bytes[execname()] += $length" statements, and
+// otherwise only read.  The translator keeps scalars as per-cpu
+// counters, summed up on reads, and with --percpu-arrays, arrays as
+// per-cpu pmaps, aggregated on reads, so the probes counting don't
+// have to write lock them.  Plain scalar assignments are only allowed in probes
+// that don't take global locks (begin/end/error).  Arrays may only
+// be read, or cleared as a whole, in those and in periodic timer
+// probes; the exclusive lock an aggregation takes would cost more
+// than it saves anywhere hotter.  Anything else disqualifies the
+// variable.
+struct percpu_counter_collector: public traversing_visitor
+{
+  set<vardecl *> candidates;
+  bool locked; // in code that can run concurrently with other probes
+  bool reporting; // in code that may read per-cpu arrays
+  vardecl *adding_to; // counter being added to in the current statement
+
+  percpu_counter_collector(): locked(true), reporting(false), adding_to(0) {}
+
+  vardecl *candidate (expression *e)
+  {
+    arrayindex *ai = dynamic_cast<arrayindex *>(e);
+    symbol *sym = ai ? dynamic_cast<symbol *>(ai->base) : dynamic_cast<symbol *>(e);
+    if (sym && candidates.find(sym->referent) != candidates.end())
+      return sym->referent;
+    return 0;
+  }
+
+  // Visit what an adding statement reads besides the counter itself:
+  // the added expression, and the indexes of an array element.
+  void visit_adding (vardecl *v, expression *lvalue, expression *rvalue)
+  {
+    adding_to = v;
+    arrayindex *ai = dynamic_cast<arrayindex *>(lvalue);
+    if (ai)
+      for (unsigned i = 0; i < ai->indexes.size(); ++i)
+        ai->indexes[i]->visit (this);
+    if (rvalue)
+      rvalue->visit (this);
+    adding_to = 0;
+  }
+
+  void visit_expr_statement (expr_statement *s)
+  {
+    unary_expression *ue = dynamic_cast<unary_expression *>(s->value);
+    vardecl *v = ue ? candidate (ue->operand) : 0;
+    if (v && (dynamic_cast<pre_crement *>(ue) || dynamic_cast<post_crement *>(ue)))
+      {
+        // counter++, or counter--
+        visit_adding (v, ue->operand, 0);
+        return;
+      }
+
+    assignment *a = dynamic_cast<assignment *>(s->value);
+    v = a ? candidate (a->left) : 0;
+    if (v && (a->op == "+=" || a->op == "-="
+              || (a->op == "=" && !locked && v->arity == 0)))
+      {
+        // counter += expr, as long as expr doesn't read counter itself
+        visit_adding (v, a->left, a->right);
+        return;
+      }
+
+    traversing_visitor::visit_expr_statement (s);
+  }
+
+  void visit_symbol (symbol *e)
+  {
+    if (e->referent == adding_to
+        || (e->referent->arity > 0 && !reporting))
+      candidates.erase (e->referent);
+  }
+
+  // Anything else writing the variable disqualifies it.
+  void visit_assignment (assignment *e)
+  {
+    vardecl *v = candidate (e->left);
+    if (v) candidates.erase (v);
+    traversing_visitor::visit_assignment (e);
+  }
+
+  void visit_pre_crement (pre_crement *e)
+  {
+    vardecl *v = candidate (e->operand);
+    if (v) candidates.erase (v);
+    traversing_visitor::visit_pre_crement (e);
+  }
+
+  void visit_post_crement (post_crement *e)
+  {
+    vardecl *v = candidate (e->operand);
+    if (v) candidates.erase (v);
+    traversing_visitor::visit_post_crement (e);
+  }
+
+  void visit_delete_statement (delete_statement *s)
+  {
+    // Clearing a whole array is fine where it may be read, but the
+    // runtime only deletes a pmap element from the current cpu's map.
+    vardecl *v = candidate (s->value);
+    if (v && (v->arity == 0 || dynamic_cast<arrayindex *>(s->value)))
+      candidates.erase (v);
+    traversing_visitor::visit_delete_statement (s);
+  }
+
+  void visit_foreach_loop (foreach_loop *s)
+  {
+    for (unsigned i = 0; i < s->indexes.size(); ++i)
+      candidates.erase (s->indexes[i]->referent);
+    if (s->value)
+      candidates.erase (s->value->referent);
+    traversing_visitor::visit_foreach_loop (s);
+  }
+};
+
+// Probes that run rarely enough to aggregate per-cpu arrays in.
+static bool
+reporting_probe (derived_probe *p)
+{
+  if (!p->needs_global_locks ())
+    return true;
+
+  probe_point *pp = p->sole_location ();
+  return (pp->components.size() > 1
+          && pp->components[0]->functor == "timer"
+          && pp->components[1]->functor != "profile");
+}
+
+// Probes that run before any others start.
+static bool
+begin_probe (derived_probe *p)
+{
+  probe_point *pp = p->sole_location ();
+  return (!p->needs_global_locks ()
+          && pp->components.size() == 1
+          && pp->components[0]->functor == "begin");
+}
+
+static int
+semantic_pass_counters (systemtap_session & sess)
+{
+  if (sess.unoptimized)
+    return 0;
+
+  percpu_counter_collector pcc;
+
+  for (unsigned i = 0; i < sess.globals.size(); ++i)
+    {
+      vardecl *v = sess.globals[i];
+      // A pmap takes a map per cpu, so arrays are only kept per-cpu
+      // on request.  Per-cpu copies of wrapping or sized arrays would
+      // each wrap or fill up on their own, so those stay shared.
+      if (v->type != pe_long || (v->arity > 0 && !sess.percpu_arrays))
+        continue;
+      if (v->arity >= 0 && !v->wrap && v->maxsize <= 0)
+        pcc.candidates.insert (v);
+    }
+  if (pcc.candidates.empty())
+    return 0;
+
+  for (map<string,functiondecl*>::iterator it = sess.functions.begin(); it != sess.functions.end(); it++)
+    if (it->second->body)
+      it->second->body->visit (&pcc);
+
+  for (unsigned i = 0; i < sess.probes.size(); ++i)
+    {
+      pcc.locked = sess.probes[i]->needs_global_locks ();
+      pcc.reporting = reporting_probe (sess.probes[i]);
+      sess.probes[i]->body->visit (&pcc);
+    }
+
+  for (set<vardecl *>::iterator it = pcc.candidates.begin();
+       it != pcc.candidates.end(); it++)
+    {
+      (*it)->percpu_counter = true;
+      if (sess.verbose > 2)
+        clog << ((*it)->arity > 0
+                 ? _F("keeping global array %s in per-cpu maps", (*it)->name.c_str())
+                 : _F("keeping global %s in per-cpu counters", (*it)->name.c_str()))
+             << endl;
+    }
+
+  return sess.num_errors();
+}
+
+// ------------------------------------------------------------------------
+
+// With --fold-globals, the global scalars that only begin probes write,
+// or only -G sets, no longer change once other probes can run.  They
+// are emitted as __read_mostly module parameters outside the globals
+// struct, see translate.cxx, and like everything begin probes write,
+// other probes read them without locking.
+static int
+semantic_pass_read_mostly (systemtap_session & sess)
+{
+  if (!sess.fold_globals || sess.unoptimized)
+    return 0;
+
+  set<vardecl *> candidates;
+  for (unsigned i = 0; i < sess.globals.size(); ++i)
+    {
+      vardecl *v = sess.globals[i];
+      if (v->arity == 0 && (v->type == pe_long || v->type == pe_string)
+          && !v->percpu_counter)
+        candidates.insert (v);
+    }
+  if (candidates.empty())
+    return 0;
+
+  for (unsigned i = 0; i < sess.probes.size(); ++i)
+    {
+      derived_probe *p = sess.probes[i];
+      if (begin_probe (p))
+        continue;
+
+      varuse_collecting_visitor vut (sess);
+      p->body->visit (&vut);
+      for (set<vardecl *>::iterator it = vut.written.begin();
+           it != vut.written.end(); it++)
+        candidates.erase (*it);
+    }
+
+  for (set<vardecl *>::iterator it = candidates.begin();
+       it != candidates.end(); it++)
+    {
+      (*it)->read_mostly = true;
+      if (sess.verbose > 2)
+        clog << _F("keeping global %s read-mostly", (*it)->name.c_str()) << endl;
+    }
+
+  return sess.num_errors();
+}
+
+// ------------------------------------------------------------------------
+
+// With --seqlock-reads, numeric global scalars that only rarely running
+// probes write are read through a seqlock, see translate.cxx.  Writes
+// take the seqlock around the store, so "/=" and "%=", which can jump
+// out with a division by zero in between, disqualify the variable.
+struct seqlock_division_visitor: public traversing_visitor
+{
+  set<vardecl *>& candidates;
+  seqlock_division_visitor(set<vardecl *>& c): candidates(c) {}
+
+  void visit_assignment (assignment *e)
+  {
+    symbol *sym = dynamic_cast<symbol *>(e->left);
+    if (sym && (e->op == "/=" || e->op == "%="))
+      candidates.erase (sym->referent);
+    traversing_visitor::visit_assignment (e);
+  }
+};
+
+static int
+semantic_pass_seqlocks (systemtap_session & sess)
+{
+  if (!sess.seqlock_reads)
+    return 0;
+
+  set<vardecl *> candidates;
+  for (unsigned i = 0; i < sess.globals.size(); ++i)
+    {
+      vardecl *v = sess.globals[i];
+      if (v->arity == 0 && v->type == pe_long && !v->percpu_counter
+          && !v->read_mostly)
+        candidates.insert (v);
+    }
+  if (candidates.empty())
+    return 0;
+
+  seqlock_division_visitor sdv (candidates);
+  for (map<string,functiondecl*>::iterator it = sess.functions.begin(); it != sess.functions.end(); it++)
+    if (it->second->body)
+      it->second->body->visit (&sdv);
+
+  for (unsigned i = 0; i < sess.probes.size(); ++i)
+    {
+      derived_probe *p = sess.probes[i];
+      p->body->visit (&sdv);
+      if (reporting_probe (p))
+        continue;
+
+      varuse_collecting_visitor vut (sess);
+      p->body->visit (&vut);
+      for (set<vardecl *>::iterator it = vut.written.begin();
+           it != vut.written.end(); it++)
+        candidates.erase (*it);
+    }
+
+  for (set<vardecl *>::iterator it = candidates.begin();
+       it != candidates.end(); it++)
+    {
+      (*it)->seqlock = true;
+      if (sess.verbose > 2)
+        clog << _F("reading global %s through a seqlock", (*it)->name.c_str()) << endl;
+    }
+
+  return sess.num_errors();
+}
+
+// ------------------------------------------------------------------------
+
 // Enforce variable-related invariants: no modification of
 // a foreach()-iterated array.
 static int
@@ -1294,6 +1597,9 @@ static int semantic_pass_optimize2 (systemtap_session&);
 static int semantic_pass_types (systemtap_session&);
 static int semantic_pass_vars (systemtap_session&);
 static int semantic_pass_stats (systemtap_session&);
+static int semantic_pass_counters (systemtap_session&);
+static int semantic_pass_read_mostly (systemtap_session&);
+static int semantic_pass_seqlocks (systemtap_session&);
 static int semantic_pass_conditions (systemtap_session&);
 
 
@@ -1726,6 +2032,9 @@ semantic_pass (systemtap_session& s)
       if (rc == 0) rc = semantic_pass_optimize2 (s);
       if (rc == 0) rc = semantic_pass_vars (s);
       if (rc == 0) rc = semantic_pass_stats (s);
+      if (rc == 0) rc = semantic_pass_counters (s);
+      if (rc == 0) rc = semantic_pass_read_mostly (s);
+      if (rc == 0) rc = semantic_pass_seqlocks (s);
       if (rc == 0) embeddedcode_info_pass (s);
 
       if (s.num_errors() == 0 && s.probes.size() == 0 && !s.listing_mode)
@@ -3715,6 +4024,1045 @@ void semantic_pass_opt6 (systemtap_session& s, bool& relaxed_p)
 }
 
 
+// ------------------------------------------------------------------------
+
+// Inline calls to small functions.  Only functions whose body is a
+// single "return EXPR" qualify, so each call can be replaced by a copy
+// of EXPR with the actual arguments in place of the formal ones, and
+// embedded-C functions that only set STAP_RETVALUE to a numeric C
+// expression, which becomes an embedded_expr.  This runs after type
+// resolution, so the copies keep their types and referents.
+
+struct inline_expr_checker: public traversing_visitor
+{
+  functiondecl* fd;
+  bool ok;         // EXPR can be copied to a call site at all
+  bool simple;     // no calls, embedded code, globals, errors or
+                   // conditional parts, so when exactly an argument
+                   // is evaluated can't matter
+  unsigned nodes;
+  map<vardecl*, unsigned> uses; // of each formal argument
+
+  inline_expr_checker (functiondecl* f): fd(f), ok(true), simple(true), nodes(0) {}
+
+  void visit_literal_string (literal_string*) { nodes++; }
+  void visit_literal_number (literal_number*) { nodes++; }
+  void visit_embedded_expr (embedded_expr*) { nodes++; simple = false; }
+  void visit_binary_expression (binary_expression* e)
+  {
+    nodes++;
+    if (e->op == "/" || e->op == "%")
+      simple = false;
+    traversing_visitor::visit_binary_expression (e);
+  }
+  void visit_unary_expression (unary_expression* e)
+    { nodes++; traversing_visitor::visit_unary_expression (e); }
+  void visit_logical_or_expr (logical_or_expr* e)
+    { nodes++; simple = false; traversing_visitor::visit_logical_or_expr (e); }
+  void visit_logical_and_expr (logical_and_expr* e)
+    { nodes++; simple = false; traversing_visitor::visit_logical_and_expr (e); }
+  void visit_comparison (comparison* e)
+    { nodes++; traversing_visitor::visit_comparison (e); }
+  void visit_concatenation (concatenation* e)
+    { nodes++; traversing_visitor::visit_concatenation (e); }
+  void visit_ternary_expression (ternary_expression* e)
+    { nodes++; simple = false; traversing_visitor::visit_ternary_expression (e); }
+  void visit_array_in (array_in* e)
+    { nodes++; simple = false; traversing_visitor::visit_array_in (e); }
+
+  void visit_arrayindex (arrayindex* e)
+  {
+    symbol* array = NULL;
+    hist_op* hist = NULL;
+    classify_indexable (e->base, array, hist);
+    if (hist)
+      ok = false;
+    nodes++;
+    simple = false;
+    for (unsigned i=0; i<e->indexes.size(); i++)
+      e->indexes[i]->visit (this);
+  }
+
+  void visit_symbol (symbol* e)
+  {
+    nodes++;
+    vardecl* v = e->referent;
+    if (! v)
+      ok = false;
+    else if (find (fd->formal_args.begin(), fd->formal_args.end(), v)
+        != fd->formal_args.end())
+      uses[v]++;
+    else if (v->arity != 0 || find (fd->locals.begin(), fd->locals.end(), v)
+                              != fd->locals.end())
+      ok = false;   // an array, or a local of fd that's never set
+    else
+      simple = false; // a global
+  }
+
+  void visit_functioncall (functioncall* e)
+  {
+    nodes++;
+    simple = false;
+    if (e->referent == fd)
+      ok = false;
+    traversing_visitor::visit_functioncall (e);
+  }
+
+  void visit_print_format (print_format* e)
+  {
+    nodes++;
+    if (e->print_to_stream || e->hist)
+      ok = false;
+    traversing_visitor::visit_print_format (e);
+  }
+
+  // Anything with side effects, or that needs more than a copy.
+  void visit_pre_crement (pre_crement*) { ok = false; }
+  void visit_post_crement (post_crement*) { ok = false; }
+  void visit_assignment (assignment*) { ok = false; }
+  void visit_target_symbol (target_symbol*) { ok = false; }
+  void visit_stat_op (stat_op*) { ok = false; }
+  void visit_hist_op (hist_op*) { ok = false; }
+  void visit_cast_op (cast_op*) { ok = false; }
+  void visit_defined_op (defined_op*) { ok = false; }
+  void visit_entry_op (entry_op*) { ok = false; }
+};
+
+
+// Copies EXPR for one call site, putting the actual arguments in place
+// of the formal ones.  Unlike deep_copy_visitor, this keeps referents.
+struct inline_expr_copier: public deep_copy_visitor
+{
+  map<vardecl*, expression*> actuals;
+
+  void visit_symbol (symbol* e)
+  {
+    map<vardecl*, expression*>::iterator it = actuals.find (e->referent);
+    if (it != actuals.end())
+      {
+        inline_expr_copier c;
+        provide (c.require (it->second));
+      }
+    else
+      update_visitor::visit_symbol (new symbol (*e));
+  }
+
+  void visit_functioncall (functioncall* e)
+  {
+    update_visitor::visit_functioncall (new functioncall (*e));
+  }
+};
+
+
+struct function_inliner: public update_visitor
+{
+  systemtap_session& session;
+  bool& relaxed_p;
+  map<functiondecl*, expression*> inlinable;
+
+  function_inliner (systemtap_session& s, bool& r): session(s), relaxed_p(r) {}
+
+  void visit_functioncall (functioncall* e);
+};
+
+
+// Turn "STAP_RETVALUE = EXPR;" into EXPR, keeping the tags that matter
+// to later passes, or return an empty string if CODE is anything else.
+static string
+inline_embedded_code (const string& code)
+{
+  // Other tags need the function around the code.
+  if (code.find ("/* myproc-unprivileged */") != string::npos
+      || code.find ("pragma:") != string::npos)
+    return "";
+
+  string stripped;
+  for (size_t i = 0; i < code.size(); )
+    {
+      if (code.compare (i, 2, "/*") == 0)
+        {
+          size_t end = code.find ("*/", i + 2);
+          if (end == string::npos)
+            return "";
+          i = end + 2;
+          stripped += ' ';
+        }
+      else if (code.compare (i, 2, "//") == 0)
+        {
+          i = code.find ('\n', i);
+          if (i == string::npos)
+            i = code.size();
+        }
+      else
+        stripped += code[i++];
+    }
+
+  const string lhs = "STAP_RETVALUE";
+  size_t start = stripped.find_first_not_of (" \t\n");
+  if (start == string::npos || stripped.compare (start, lhs.size(), lhs) != 0)
+    return "";
+  size_t eq = stripped.find_first_not_of (" \t\n", start + lhs.size());
+  if (eq == string::npos || stripped[eq] != '='
+      || (eq + 1 < stripped.size() && stripped[eq + 1] == '='))
+    return "";
+  size_t semi = stripped.find (';', eq);
+  if (semi == string::npos
+      || stripped.find_first_not_of (" \t\n", semi + 1) != string::npos)
+    return "";
+  string expr = stripped.substr (eq + 1, semi - eq - 1);
+  if (expr.find_first_not_of (" \t\n") == string::npos
+      || expr.find_first_of ("{}#\"'") != string::npos
+      || expr.find ("STAP_") != string::npos
+      || expr.find ("CONTEXT") != string::npos
+      || expr.find ("THIS") != string::npos
+      || expr.find ("return") != string::npos
+      || expr.find ("goto") != string::npos)
+    return "";
+
+  string tags;
+  const char* keep[] = { "/* pure */", "/* stable */", "/* unprivileged */",
+                        "/* guru */" };
+  for (unsigned i = 0; i < sizeof(keep) / sizeof(keep[0]); i++)
+    if (code.find (keep[i]) != string::npos)
+      tags += string (keep[i]) + " ";
+  return tags + expr;
+}
+
+
+// Only literals and locals of the caller can be passed any number of
+// times, or not at all, without changing what is evaluated when.
+static bool
+trivial_actual (systemtap_session& s, expression* e)
+{
+  if (dynamic_cast<literal*> (e))
+    return true;
+  symbol* sym = dynamic_cast<symbol*> (e);
+  return sym && sym->referent
+    && find (s.globals.begin(), s.globals.end(), sym->referent) == s.globals.end();
+}
+
+
+void
+function_inliner::visit_functioncall (functioncall* e)
+{
+  for (unsigned i = 0; i < e->args.size(); ++i)
+    replace (e->args[i]);
+
+  map<functiondecl*, expression*>::iterator it = inlinable.find (e->referent);
+  if (it == inlinable.end())
+    {
+      provide (e);
+      return;
+    }
+
+  functiondecl* fd = it->first;
+  embedded_expr* ee = dynamic_cast<embedded_expr*> (it->second);
+  if (ee)
+    {
+      embedded_expr* n = new embedded_expr (*ee);
+      n->tok = e->tok;
+      if (session.verbose > 2)
+        clog << _F("Inlining embedded-C function '%s'", fd->name.c_str()) << endl;
+      relaxed_p = false;
+      provide (n);
+      return;
+    }
+
+  inline_expr_checker chk (fd);
+  it->second->visit (& chk);
+  unsigned nontrivial = 0;
+  for (unsigned i = 0; i < e->args.size(); ++i)
+    if (! trivial_actual (session, e->args[i]))
+      {
+        // Such an argument has to be evaluated exactly once, and
+        // without anything else around it that could notice when.
+        if (chk.uses[fd->formal_args[i]] != 1 || ! chk.simple || ++nontrivial > 1)
+          {
+            provide (e);
+            return;
+          }
+      }
+
+  inline_expr_copier c;
+  for (unsigned i = 0; i < e->args.size(); ++i)
+    c.actuals[fd->formal_args[i]] = e->args[i];
+  if (session.verbose > 2)
+    clog << _F("Inlining function '%s'", fd->name.c_str()) << endl;
+  relaxed_p = false;
+  provide (c.require (it->second));
+}
+
+
+void semantic_pass_opt7 (systemtap_session& s, bool& relaxed_p)
+{
+  const unsigned max_inline_nodes = 12;
+  function_inliner fi (s, relaxed_p);
+
+  for (map<string,functiondecl*>::iterator it = s.functions.begin(); it != s.functions.end(); it++)
+    {
+      functiondecl* fd = it->second;
+
+      // Don't inline (possibly) recursive functions, or else we'd never
+      // stop.
+      functioncall_traversing_visitor ftv;
+      fd->body->visit (& ftv);
+      if (ftv.traversed.count (fd))
+        continue;
+
+      embeddedcode* ec = dynamic_cast<embeddedcode*> (fd->body);
+      if (ec)
+        {
+          if (! fd->formal_args.empty() || fd->type != pe_long)
+            continue;
+          string code = inline_embedded_code (ec->code);
+          if (code.empty())
+            continue;
+          embedded_expr* ee = new embedded_expr;
+          ee->tok = fd->tok;
+          ee->code = code;
+          ee->type = pe_long;
+          fi.inlinable[fd] = ee;
+          continue;
+        }
+
+      block* b = dynamic_cast<block*> (fd->body);
+      if (! b || b->statements.size() != 1)
+        continue;
+      return_statement* rs = dynamic_cast<return_statement*> (b->statements[0]);
+      if (! rs || ! rs->value)
+        continue;
+      inline_expr_checker chk (fd);
+      rs->value->visit (& chk);
+      if (chk.ok && chk.nodes <= max_inline_nodes)
+        fi.inlinable[fd] = rs->value;
+    }
+
+  if (fi.inlinable.empty())
+    return;
+
+  for (unsigned i=0; i<s.probes.size(); i++)
+    fi.replace (s.probes[i]->body);
+  for (map<string,functiondecl*>::iterator it = s.functions.begin(); it != s.functions.end(); it++)
+    fi.replace (it->second->body);
+
+  // Drop the functions that are no longer called at all, like
+  // semantic_pass_opt1 does, but quietly since they weren't unused.
+  functioncall_traversing_visitor ftv;
+  for (unsigned i=0; i<s.probes.size(); i++)
+    {
+      s.probes[i]->body->visit (& ftv);
+      if (s.probes[i]->sole_location()->condition)
+        s.probes[i]->sole_location()->condition->visit (& ftv);
+    }
+  vector<functiondecl*> inlined_functions;
+  for (map<string,functiondecl*>::iterator it = s.functions.begin(); it != s.functions.end(); it++)
+    if (ftv.traversed.find (it->second) == ftv.traversed.end())
+      inlined_functions.push_back (it->second);
+  for (unsigned i=0; i<inlined_functions.size(); i++)
+    s.functions.erase (inlined_functions[i]->name);
+}
+
+
+// ------------------------------------------------------------------------
+
+// Reuse the value of expensive expressions that are evaluated more
+// than once in a probe or function body, or on every iteration of a
+// loop, while nothing they depend on can change.  Only calls to
+// embedded-C functions tagged both /* pure */ and /* stable */, global
+// and local array reads, and sprintf-style formatting qualify; plain
+// arithmetic and the numeric embedded expressions opt7 leaves behind
+// are cheaper to redo than to cache.  /* pure */ alone is not enough,
+// since it also covers things like get_cycles().
+//
+// Each such expression E becomes "(__cse_N_set++ ? __cse_N : (__cse_N = E))"
+// at every site, so it is still only evaluated where, and if, the
+// original code would first have evaluated it.  The flag is set before
+// E runs, so nothing is cached in a region with a try block, where
+// code may go on after E failed.
+
+struct cse_expr_checker: public traversing_visitor
+{
+  bool ok;
+  bool embedded;   // calls stable code, which may read target memory
+
+  cse_expr_checker (): ok(true), embedded(false) {}
+
+  static bool stable_code (const string& code)
+  {
+    return code.find ("/* pure */") != string::npos
+      && code.find ("/* stable */") != string::npos;
+  }
+
+  void visit_embedded_expr (embedded_expr* e)
+  {
+    if (! stable_code (e->code))
+      ok = false;
+    embedded = true;
+  }
+
+  void visit_symbol (symbol* e)
+  {
+    if (! e->referent || e->referent->arity != 0)
+      ok = false;
+  }
+
+  void visit_arrayindex (arrayindex* e)
+  {
+    symbol* array = NULL;
+    hist_op* hist = NULL;
+    classify_indexable (e->base, array, hist);
+    if (! array || ! array->referent || array->referent->type == pe_stats)
+      ok = false;
+    for (unsigned i=0; i<e->indexes.size(); i++)
+      e->indexes[i]->visit (this);
+  }
+
+  void visit_array_in (array_in* e)
+    { visit_arrayindex (e->operand); }
+
+  void visit_functioncall (functioncall* e)
+  {
+    embeddedcode* ec = e->referent ? dynamic_cast<embeddedcode*> (e->referent->body) : 0;
+    if (! ec || ! stable_code (ec->code))
+      ok = false;
+    embedded = true;
+    traversing_visitor::visit_functioncall (e);
+  }
+
+  void visit_print_format (print_format* e)
+  {
+    if (e->print_to_stream || e->hist)
+      ok = false;
+    traversing_visitor::visit_print_format (e);
+  }
+
+  void visit_pre_crement (pre_crement*) { ok = false; }
+  void visit_post_crement (post_crement*) { ok = false; }
+  void visit_assignment (assignment*) { ok = false; }
+  void visit_target_symbol (target_symbol*) { ok = false; }
+  void visit_stat_op (stat_op*) { ok = false; }
+  void visit_hist_op (hist_op*) { ok = false; }
+  void visit_cast_op (cast_op*) { ok = false; }
+  void visit_defined_op (defined_op*) { ok = false; }
+  void visit_entry_op (entry_op*) { ok = false; }
+};
+
+
+// Finds embedded-C that might write what stable functions read.
+struct cse_impure_finder: public functioncall_traversing_visitor
+{
+  bool found;
+
+  cse_impure_finder (): found(false) {}
+
+  void visit_embeddedcode (embeddedcode* s)
+    { if (s->code.find ("/* pure */") == string::npos) found = true; }
+  void visit_embedded_expr (embedded_expr* e)
+    { if (e->code.find ("/* pure */") == string::npos) found = true; }
+};
+
+
+// Finds try blocks, after which an error doesn't end the body.
+struct cse_try_finder: public traversing_visitor
+{
+  bool found;
+
+  cse_try_finder (): found(false) {}
+
+  void visit_try_block (try_block*) { found = true; }
+};
+
+
+// What the code a cached value is reused across may change.
+struct cse_region
+{
+  set<vardecl*> written;
+  bool memory_clean;
+  bool has_try;
+
+  cse_region (systemtap_session& s, statement* body): memory_clean(true)
+  {
+    varuse_collecting_visitor vut (s);
+    body->visit (& vut);
+    written = vut.written;
+
+    cse_try_finder ctf;
+    body->visit (& ctf);
+    has_try = ctf.found;
+
+    // Only guru mode code can write target memory.
+    if (s.guru_mode)
+      {
+        cse_impure_finder cif;
+        body->visit (& cif);
+        memory_clean = ! cif.found;
+      }
+  }
+
+  void add (systemtap_session& s, expression* e)
+  {
+    if (! e)
+      return;
+    varuse_collecting_visitor vut (s);
+    e->visit (& vut);
+    written.insert (vut.written.begin(), vut.written.end());
+    if (s.guru_mode && memory_clean)
+      {
+        cse_impure_finder cif;
+        e->visit (& cif);
+        memory_clean = ! cif.found;
+      }
+  }
+};
+
+
+struct cse_info
+{
+  systemtap_session& session;
+  set<expression*> cached;       // replacements already made
+  unsigned counter;
+
+  cse_info (systemtap_session& s): session(s), counter(0) {}
+
+  // Return the key under which E can be cached across REGION, or an
+  // empty string if it can't be.
+  string key (expression* e, const cse_region& region);
+};
+
+
+string
+cse_info::key (expression* e, const cse_region& region)
+{
+  if ((e->type != pe_long && e->type != pe_string) || region.has_try)
+    return "";
+
+  cse_expr_checker chk;
+  e->visit (& chk);
+  if (! chk.ok || (chk.embedded && ! region.memory_clean))
+    return "";
+
+  varuse_collecting_visitor vut (session);
+  e->visit (& vut);
+  for (set<vardecl*>::const_iterator it = vut.read.begin(); it != vut.read.end(); ++it)
+    if (region.written.count (*it))
+      return "";
+
+  ostringstream o;
+  o << e->type << ":" << *e;
+  return o.str();
+}
+
+
+// Counts how often each cacheable expression is evaluated in a region,
+// counting ones inside loops twice.
+struct cse_counter: public traversing_visitor
+{
+  cse_info& info;
+  const cse_region& region;
+  unsigned loop_depth;
+  map<string, unsigned> weight;
+  map<string, exp_type> types;
+
+  cse_counter (cse_info& i, const cse_region& r, unsigned depth = 0):
+    info(i), region(r), loop_depth(depth) {}
+
+  bool count (expression* e)
+  {
+    string k = info.key (e, region);
+    if (k.empty())
+      return false;
+    weight[k] += loop_depth ? 2 : 1;
+    types[k] = e->type;
+    return true;
+  }
+
+  void visit_functioncall (functioncall* e)
+    { if (! count (e)) traversing_visitor::visit_functioncall (e); }
+  void visit_arrayindex (arrayindex* e)
+    { if (! count (e)) traversing_visitor::visit_arrayindex (e); }
+
+  // The arrayindex of an "in" test isn't a read of the element.
+  void visit_array_in (array_in* e)
+  {
+    if (! count (e))
+      for (unsigned i=0; i<e->operand->indexes.size(); i++)
+        e->operand->indexes[i]->visit (this);
+  }
+  void visit_print_format (print_format* e)
+    { if (! count (e)) traversing_visitor::visit_print_format (e); }
+  void visit_embedded_expr (embedded_expr* e)
+    { if (e->type == pe_string) count (e); }
+
+  void visit_ternary_expression (ternary_expression* e)
+  {
+    if (! info.cached.count (e))
+      traversing_visitor::visit_ternary_expression (e);
+  }
+
+  void visit_for_loop (for_loop* s)
+  {
+    loop_depth++;
+    traversing_visitor::visit_for_loop (s);
+    loop_depth--;
+  }
+
+  void visit_foreach_loop (foreach_loop* s)
+  {
+    loop_depth++;
+    traversing_visitor::visit_foreach_loop (s);
+    loop_depth--;
+  }
+};
+
+
+// Replaces the chosen expressions by their cached value.
+struct cse_replacer: public update_visitor
+{
+  cse_info& info;
+  const cse_region& region;
+  map<string, pair<vardecl*, vardecl*> > slots; // key -> value, flag
+
+  cse_replacer (cse_info& i, const cse_region& r): info(i), region(r) {}
+
+  bool cache (expression* e);
+
+  void visit_functioncall (functioncall* e)
+    { if (! cache (e)) update_visitor::visit_functioncall (e); }
+  void visit_arrayindex (arrayindex* e)
+    { if (! cache (e)) update_visitor::visit_arrayindex (e); }
+
+  void visit_array_in (array_in* e)
+  {
+    if (cache (e))
+      return;
+    for (unsigned i=0; i<e->operand->indexes.size(); i++)
+      replace (e->operand->indexes[i]);
+    provide (e);
+  }
+  void visit_print_format (print_format* e)
+    { if (! cache (e)) update_visitor::visit_print_format (e); }
+  void visit_embedded_expr (embedded_expr* e)
+    { if (e->type != pe_string || ! cache (e)) update_visitor::visit_embedded_expr (e); }
+
+  void visit_ternary_expression (ternary_expression* e)
+  {
+    if (info.cached.count (e))
+      provide (e);
+    else
+      update_visitor::visit_ternary_expression (e);
+  }
+};
+
+
+bool
+cse_replacer::cache (expression* e)
+{
+  if (slots.empty())
+    return false;
+  map<string, pair<vardecl*, vardecl*> >::iterator it = slots.find (info.key (e, region));
+  if (it == slots.end())
+    return false;
+
+  symbol* flag = new symbol;
+  flag->tok = e->tok;
+  flag->name = it->second.second->name;
+  flag->referent = it->second.second;
+  flag->type = pe_long;
+
+  post_crement* test = new post_crement;
+  test->tok = e->tok;
+  test->op = "++";
+  test->operand = flag;
+  test->type = pe_long;
+
+  symbol* value = new symbol;
+  value->tok = e->tok;
+  value->name = it->second.first->name;
+  value->referent = it->second.first;
+  value->type = e->type;
+
+  symbol* lvalue = new symbol (*value);
+
+  assignment* fill = new assignment;
+  fill->tok = e->tok;
+  fill->left = lvalue;
+  fill->op = "=";
+  fill->right = e;
+  fill->type = e->type;
+
+  ternary_expression* t = new ternary_expression;
+  t->tok = e->tok;
+  t->cond = test;
+  t->truevalue = value;
+  t->falsevalue = fill;
+  t->type = e->type;
+
+  info.cached.insert (t);
+  provide (t);
+  return true;
+}
+
+
+// Picks the expressions counted often enough in COUNTER, and gives each
+// a value and a flag local in LOCALS.
+static void
+cse_choose (cse_info& info, cse_counter& counter, unsigned min_weight,
+            vector<vardecl*>& locals, const token* tok,
+            cse_replacer& replacer, vector<vardecl*>& flags)
+{
+  for (map<string, unsigned>::iterator it = counter.weight.begin();
+       it != counter.weight.end(); ++it)
+    {
+      if (it->second < min_weight)
+        continue;
+
+      string name = "__cse_" + lex_cast (++info.counter);
+
+      vardecl* value = new vardecl;
+      value->name = name;
+      value->tok = tok;
+      value->set_arity (0, tok);
+      value->type = counter.types[it->first];
+
+      vardecl* flag = new vardecl;
+      flag->name = name + "_set";
+      flag->tok = tok;
+      flag->set_arity (0, tok);
+      flag->type = pe_long;
+
+      locals.push_back (value);
+      locals.push_back (flag);
+      flags.push_back (flag);
+      replacer.slots[it->first] = make_pair (value, flag);
+
+      if (info.session.verbose > 2)
+        clog << _F("Caching repeated expression %s", it->first.c_str()) << endl;
+    }
+}
+
+
+// Walks a body, outermost loops first, caching what each loop
+// recomputes on every iteration although nothing it reads changes.
+struct cse_loop_hoister: public update_visitor
+{
+  cse_info& info;
+  vector<vardecl*>& locals;
+  const token* tok;
+
+  cse_loop_hoister (cse_info& i, vector<vardecl*>& l, const token* t):
+    info(i), locals(l), tok(t) {}
+
+  statement* reset (statement* loop, const vector<vardecl*>& flags);
+
+  void visit_for_loop (for_loop* s);
+  void visit_foreach_loop (foreach_loop* s);
+};
+
+
+// Clear the flags each time LOOP is entered, since the values may be
+// different by then.
+statement*
+cse_loop_hoister::reset (statement* loop, const vector<vardecl*>& flags)
+{
+  if (flags.empty())
+    return loop;
+
+  block* b = new block;
+  b->tok = loop->tok;
+  for (unsigned i=0; i<flags.size(); i++)
+    {
+      symbol* flag = new symbol;
+      flag->tok = loop->tok;
+      flag->name = flags[i]->name;
+      flag->referent = flags[i];
+      flag->type = pe_long;
+
+      literal_number* zero = new literal_number (0);
+      zero->tok = loop->tok;
+      zero->type = pe_long;
+
+      assignment* a = new assignment;
+      a->tok = loop->tok;
+      a->left = flag;
+      a->op = "=";
+      a->right = zero;
+      a->type = pe_long;
+
+      expr_statement* es = new expr_statement;
+      es->tok = loop->tok;
+      es->value = a;
+      b->statements.push_back (es);
+    }
+  b->statements.push_back (loop);
+  return b;
+}
+
+
+void
+cse_loop_hoister::visit_for_loop (for_loop* s)
+{
+  // The init part only runs once.
+  cse_region region (info.session, s->block);
+  region.add (info.session, s->cond);
+  if (s->incr)
+    region.add (info.session, s->incr->value);
+
+  cse_counter counter (info, region, 1);
+  s->cond->visit (& counter);
+  if (s->incr)
+    s->incr->visit (& counter);
+  s->block->visit (& counter);
+
+  cse_replacer replacer (info, region);
+  vector<vardecl*> flags;
+  cse_choose (info, counter, 1, locals, tok, replacer, flags);
+  replacer.replace (s->cond);
+  replacer.replace (s->incr);
+  replacer.replace (s->block);
+
+  replace (s->init);
+  replace (s->cond);
+  replace (s->incr);
+  replace (s->block);
+  provide (reset (s, flags));
+}
+
+
+void
+cse_loop_hoister::visit_foreach_loop (foreach_loop* s)
+{
+  // Treat the loop as a whole, so the iteration variables and a sorted
+  // array count as written.
+  cse_region region (info.session, s);
+
+  cse_counter counter (info, region, 1);
+  s->block->visit (& counter);
+
+  cse_replacer replacer (info, region);
+  vector<vardecl*> flags;
+  cse_choose (info, counter, 1, locals, tok, replacer, flags);
+  replacer.replace (s->block);
+
+  replace (s->block);
+  provide (reset (s, flags));
+}
+
+
+static void
+semantic_pass_cse_body (cse_info& info, statement*& body,
+                        vector<vardecl*>& locals, const token* tok)
+{
+  if (! body || dynamic_cast<embeddedcode*> (body))
+    return;
+
+  // First what is the same throughout the whole body, where the
+  // locals start out cleared on entry ...
+  cse_region region (info.session, body);
+  cse_counter counter (info, region);
+  body->visit (& counter);
+  cse_replacer replacer (info, region);
+  vector<vardecl*> flags;
+  cse_choose (info, counter, 2, locals, tok, replacer, flags);
+  replacer.replace (body);
+
+  // ... then what is only the same throughout a loop.
+  cse_loop_hoister hoister (info, locals, tok);
+  hoister.replace (body);
+}
+
+
+static void
+semantic_pass_cse (systemtap_session& s)
+{
+  cse_info info (s);
+  for (unsigned i=0; i<s.probes.size(); i++)
+    semantic_pass_cse_body (info, s.probes[i]->body, s.probes[i]->locals,
+                            s.probes[i]->tok);
+  for (map<string,functiondecl*>::iterator it = s.functions.begin(); it != s.functions.end(); it++)
+    semantic_pass_cse_body (info, it->second->body, it->second->locals,
+                            it->second->tok);
+}
+
+
+// ------------------------------------------------------------------------
+
+// With --fold-globals, global scalars whose value is already known when
+// translating become literals, so the const folder can do the rest,
+// e.g. for "if (pid() == target_pid)".  These are the ones never written
+// at all, and the ones only ever set to the same literal at the top of
+// begin probes, ahead of anything that could skip the assignment by
+// "next", exit() or an error, and that no begin, end or error probe
+// reads.  Folded globals are dropped from the session altogether.  Globals that -G names stay
+// variables, since their value only comes at load time.
+
+static bool
+global_set_by_option (systemtap_session& s, vardecl* v)
+{
+  for (unsigned i = 0; i < s.globalopts.size(); i++)
+    if (s.globalopts[i].compare (0, v->name.size() + 1, v->name + "=") == 0)
+      return true;
+  return false;
+}
+
+struct global_folder: public update_visitor
+{
+  map<vardecl*, literal*> values;
+  unsigned folded;
+
+  global_folder (): folded(0) {}
+
+  void visit_symbol (symbol* e)
+  {
+    map<vardecl*, literal*>::iterator it = values.find (e->referent);
+    if (it == values.end())
+      {
+        provide (e);
+        return;
+      }
+
+    literal* l;
+    literal_number* n = dynamic_cast<literal_number*> (it->second);
+    if (n)
+      l = new literal_number (*n);
+    else
+      l = new literal_string (*static_cast<literal_string*> (it->second));
+    l->tok = e->tok;
+    folded++;
+    provide (l);
+  }
+
+  // Only scalars are folded.
+  void visit_arrayindex (arrayindex* e)
+  {
+    for (unsigned i = 0; i < e->indexes.size(); i++)
+      replace (e->indexes[i]);
+    provide (e);
+  }
+};
+
+// The global a begin probe statement sets to a literal, if that's
+// all it does.
+static vardecl*
+literal_setter (statement* s, literal*& value)
+{
+  expr_statement* es = dynamic_cast<expr_statement*> (s);
+  assignment* a = es ? dynamic_cast<assignment*> (es->value) : 0;
+  if (! a || a->op != "=")
+    return 0;
+  symbol* sym = dynamic_cast<symbol*> (a->left);
+  value = dynamic_cast<literal*> (a->right);
+  return (sym && value) ? sym->referent : 0;
+}
+
+static void
+semantic_pass_fold_globals (systemtap_session& s, bool& relaxed_p)
+{
+  set<vardecl*> written;        // other than by a literal setter
+  set<vardecl*> read;
+  set<vardecl*> read_early;     // by begin, end or error probes
+  map<vardecl*, vector<pair<block*, statement*> > > setters;
+  map<vardecl*, literal*> set_to;
+
+  for (unsigned i = 0; i < s.probes.size(); i++)
+    {
+      derived_probe* p = s.probes[i];
+      block* b = dynamic_cast<block*> (p->body);
+      varuse_collecting_visitor vut (s);
+
+      if (b && begin_probe (p) && ! p->sole_location()->condition)
+        {
+          // Only the leading literal setters count; any other statement
+          // might call next or exit(), or fail, before the rest run.
+          bool skippable = false;
+          for (unsigned j = 0; j < b->statements.size(); j++)
+            {
+              statement* stmt = b->statements[j];
+              literal* value = 0;
+              vardecl* v = skippable ? 0 : literal_setter (stmt, value);
+              if (v)
+                {
+                  setters[v].push_back (make_pair (b, stmt));
+                  literal*& other = set_to[v];
+                  if (! other)
+                    other = value;
+                  else if (lex_cast (*other) != lex_cast (*value))
+                    written.insert (v);
+                  continue;
+                }
+              stmt->visit (& vut);
+              skippable = true;
+            }
+        }
+      else
+        {
+          p->body->visit (& vut);
+          if (p->sole_location()->condition)
+            p->sole_location()->condition->visit (& vut);
+        }
+
+      written.insert (vut.written.begin(), vut.written.end());
+      read.insert (vut.read.begin(), vut.read.end());
+      if (! p->needs_global_locks ())
+        read_early.insert (vut.read.begin(), vut.read.end());
+    }
+
+  global_folder gf;
+  vector<pair<block*, statement*> > dropped;
+  for (unsigned i = 0; i < s.globals.size(); /* see below */)
+    {
+      vardecl* v = s.globals[i];
+      // A global that is set but never read is left for the end of
+      // run display of add_global_var_display, or the unused variable
+      // warning.
+      if (v->arity > 0 || written.count (v) || ! read.count (v)
+          || global_set_by_option (s, v))
+        {
+          i++;
+          continue;
+        }
+
+      if (setters.count (v) && ! read_early.count (v))
+        {
+          gf.values[v] = set_to[v];
+          dropped.insert (dropped.end(), setters[v].begin(), setters[v].end());
+        }
+      else if (! setters.count (v) && v->init)
+        gf.values[v] = v->init;
+      else
+        {
+          i++;
+          continue;
+        }
+
+      if (s.verbose > 2)
+        clog << _F("Folding global %s into its value", v->name.c_str()) << endl;
+      // No "Eliding unused variable" warning for these; they're all
+      // replaced below.
+      s.globals.erase (s.globals.begin() + i);
+    }
+  if (gf.values.empty())
+    return;
+
+  for (unsigned i = 0; i < dropped.size(); i++)
+    {
+      vector<statement*>& stmts = dropped[i].first->statements;
+      stmts.erase (find (stmts.begin(), stmts.end(), dropped[i].second));
+    }
+
+  for (unsigned i = 0; i < s.probes.size(); i++)
+    {
+      gf.replace (s.probes[i]->body);
+      if (s.probes[i]->sole_location()->condition)
+        gf.replace (s.probes[i]->sole_location()->condition);
+    }
+  for (map<string,functiondecl*>::iterator it = s.functions.begin(); it != s.functions.end(); it++)
+    gf.replace (it->second->body);
+
+  if (gf.folded || ! dropped.empty())
+    relaxed_p = false;
+}
+
+
 static int
 semantic_pass_optimize1 (systemtap_session& s)
 {
@@ -3752,6 +5100,8 @@ semantic_pass_optimize1 (systemtap_session& s)
           semantic_pass_opt3 (s, relaxed_p);
           semantic_pass_opt4 (s, relaxed_p);
           semantic_pass_opt5 (s, relaxed_p);
+          if (s.fold_globals)
+            semantic_pass_fold_globals (s, relaxed_p);
         }
 
       // For listing mode, we need const-folding regardless of optimization so
@@ -3795,11 +5145,19 @@ semantic_pass_optimize2 (systemtap_session& s)
         s.suppress_warnings = true;
 
       if (!s.unoptimized)
-        semantic_pass_opt6 (s, relaxed_p);
+        {
+          semantic_pass_opt6 (s, relaxed_p);
+          semantic_pass_opt7 (s, relaxed_p);
+        }
 
       iterations++;
     }
 
+  // This isn't part of the loop above, since it would keep finding the
+  // expressions it has already cached.
+  if (!s.unoptimized)
+    semantic_pass_cse (s);
+
   return rc;
 }
 
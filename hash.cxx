@@ -230,6 +230,12 @@ find_script_hash (systemtap_session& s, const string& script)
   h.add("Omit Werror (undocumented): ", s.omit_werror);
   h.add("Prologue Searching (-P): ", s.prologue_searching);
   h.add("Error suppression (--suppress-handler-errors): ", s.suppress_handler_errors);
+  h.add("Deferred symbols (--defer-symbols): ", s.defer_symbols);
+  h.add("Striped array locks (--striped-locks): ", s.striped_locks);
+  h.add("Seqlock global reads (--seqlock-reads): ", s.seqlock_reads);
+  h.add("Folded globals (--fold-globals): ", s.fold_globals);
+  h.add("Per-cpu arrays (--percpu-arrays): ", s.percpu_arrays);
+  h.add("Amortized actions (--amortize-actions): ", s.amortize_actions);
   if (!s.kernel_symtab_path.empty())	// --kmap
     {
       h.add("Kernel Symtab Path: ", s.kernel_symtab_path);
@@ -253,6 +259,12 @@ find_script_hash (systemtap_session& s, const string& script)
   for (unsigned i = 0; i < s.modinfos.size(); i++)
     h.add("MODULE_INFO: ", s.modinfos[i]);
 
+  // With --fold-globals, globals named by -G stay module parameters,
+  // whatever value they are given.
+  if (s.fold_globals)
+    for (unsigned i = 0; i < s.globalopts.size(); i++)
+      h.add("Global option: ", s.globalopts[i].substr(0, s.globalopts[i].find('=')));
+
   // -d MODULE
   for (set<string>::iterator it = s.unwindsym_modules.begin();
        it != s.unwindsym_modules.end();
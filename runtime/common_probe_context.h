@@ -41,10 +41,18 @@ int actionremaining;
 
 /* The current nesting of a function. Needed to determine which "level" of
    locals to use. See the recursion_info traversing_visitor for how the
-   maximum is calculated.  Locals of a function are stored at
-   c->locals[c->nesting], see c_unparser::emit_function ().  */
+   maximum is calculated.  Locals of a (possibly) recursive function are
+   stored at c->locals[c->nesting], those of other functions in their
+   fixed spot of c->frames, see c_unparser::emit_common_header ().  */
 int nesting;
 
+/* With --striped-locks, the stripe lock of the global array element being
+   accessed, see _stp_map_lock_stripe ().  Also released at the out labels
+   of probes and try blocks, in case an error jumped out of the access.  */
+#ifdef STP_STRIPED_LOCKS
+spinlock_t *map_stripe;
+#endif
+
 /* A place to format error messages into if some error occurs, last_error
    will then be pointed here.  */
 string_t error_buffer;
@@ -762,6 +762,15 @@ static int KEYSYM(_stp_map_del) (MAP map, ALLKEYSD(key))
 	return 0;
 }
 
+/* The lock of the hash stripe a key falls in, if the map is striped. */
+static spinlock_t *KEYSYM(_stp_map_stripe) (MAP map, ALLKEYSD(key))
+{
+	if (map == NULL || map->stripes == NULL)
+		return NULL;
+
+	return &map->stripes[KEYSYM(hash) (ALLKEYS(key)) % MAP_STRIPES];
+}
+
 static int KEYSYM(_stp_map_exists) (MAP map, ALLKEYSD(key))
 {
 	unsigned int hv;
@@ -240,6 +240,29 @@ static MAP _stp_map_new(unsigned max_entries, int type, int key_size, int data_s
 	return m;
 }
 
+/** Give a map a lock per stripe of its hash table.
+ * The translator does this for global arrays with --striped-locks.
+ * Probes then only share the array's global lock when they access
+ * single elements, and lock the stripe of the element's key around
+ * each access.  Node allocation and removal take the list lock too.
+ * @param map
+ * @returns 0 on success, -1 if out of memory
+ */
+
+static int _stp_map_init_stripes(MAP map)
+{
+	int i;
+
+	/* Called from module_init, so user context, may sleep alloc. */
+	map->stripes = (spinlock_t *) _stp_kmalloc_gfp(MAP_STRIPES * sizeof(spinlock_t), STP_ALLOC_SLEEP_FLAGS);
+	if (map->stripes == NULL)
+		return -1;
+	for (i = 0; i < MAP_STRIPES; i++)
+		spin_lock_init(&map->stripes[i]);
+	spin_lock_init(&map->list_lock);
+	return 0;
+}
+
 static PMAP _stp_pmap_new(unsigned max_entries, int type, int key_size, int data_size)
 {
 	int i;
@@ -394,6 +417,9 @@ static void __stp_map_del(MAP map)
 	}
 	/* free used hash */
 	_stp_kfree(map->hashes);
+
+	if (map->stripes)
+		_stp_kfree(map->stripes);
 }
 
 /** Deletes a map.
@@ -822,12 +848,18 @@ static void _new_map_clear_node (struct map_node *m)
 	}
 }
 
+/* Striped maps are never wrapped, so the hash list is only ever */
+/* that of the caller's stripe, but the entry lists are shared. */
 static struct map_node *_new_map_create (MAP map, struct hlist_head *head)
 {
 	struct map_node *m;
+	if (map->stripes)
+		spin_lock(&map->list_lock);
 	if (list_empty(&map->pool)) {
 		if (!map->wrap) {
 			/* ERROR. no space left */
+			if (map->stripes)
+				spin_unlock(&map->list_lock);
 			return NULL;
 		}
 		m = (struct map_node *)map->head.next;
@@ -837,6 +869,8 @@ static struct map_node *_new_map_create (MAP map, struct hlist_head *head)
 		map->num++;
 	}
 	list_move_tail(&m->lnode, &map->head);
+	if (map->stripes)
+		spin_unlock(&map->list_lock);
 	
 	/* add node to new hash list */
 	hlist_add_head(&m->hnode, head);
@@ -848,6 +882,9 @@ static void _new_map_del_node (MAP map, struct map_node *n)
 	/* remove node from old hash list */
 	hlist_del_init(&n->hnode);
 	
+	if (map->stripes)
+		spin_lock(&map->list_lock);
+
 	/* remove from entry list */
 	list_del(&n->lnode);
 	
@@ -855,6 +892,9 @@ static void _new_map_del_node (MAP map, struct map_node *n)
 	list_add(&n->lnode, &map->pool);
 	
 	map->num--;
+
+	if (map->stripes)
+		spin_unlock(&map->list_lock);
 }
 
 static int _new_map_set_int64 (MAP map, struct map_node *n, int64_t val, int add)
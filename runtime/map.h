@@ -45,6 +45,12 @@
 #define HASH_TABLE_SIZE (1<<HASH_TABLE_BITS)
 #endif
 
+/* The number of locks the hash table of a striped map is spread over,
+   see _stp_map_init_stripes(). */
+#ifndef MAP_STRIPES
+#define MAP_STRIPES 64
+#endif
+
 /* The maximum number of keys allowed. Reducing this can save a small
 amount of memory. Do not increase above 5. */
 #ifndef MAX_KEY_ARITY
@@ -130,6 +136,11 @@ struct map_root {
 	/* the hash table for this array, allocated in _stp_map_init() */
 	struct hlist_head *hashes;
 
+	/* locks for stripes of the hash table, if the map is striped, */
+	/* and one for the entry lists and num, which all stripes share */
+	spinlock_t *stripes;
+	spinlock_t list_lock;
+
 	/* used if this map's nodes contain stats */
 	struct _Hist hist;
 };
@@ -189,6 +200,7 @@ static char * _stp_get_str(struct map_node *m);
 static stat *_stp_get_stat(struct map_node *m);
 static unsigned int str_hash(const char *key1);
 static MAP _stp_map_new(unsigned max_entries, int type, int key_size, int data_size);
+static int _stp_map_init_stripes(MAP map);
 static PMAP _stp_pmap_new(unsigned max_entries, int type, int key_size, int data_size);
 static int msb64(int64_t x);
 static MAP _stp_map_new_hstat_log(unsigned max_entries, int key_size);
@@ -999,6 +999,71 @@ static VALTYPE KEYSYM(_stp_pmap_get) (PMAP pmap, ALLKEYSD(key))
 	return NULLRET;
 }
 
+static int KEYSYM(_stp_pmap_exists) (PMAP pmap, ALLKEYSD(key))
+{
+	unsigned int hv;
+	int cpu, found = 0;
+	struct hlist_head *head;
+	struct hlist_node *e;
+	struct KEYSYM(pmap_node) *n;
+	MAP map;
+
+	if (pmap == NULL)
+		return 0;
+
+	hv = KEYSYM(phash) (ALLKEYS(key));
+
+	/* the key exists if any cpu has it */
+	for_each_possible_cpu(cpu) {
+		map = per_cpu_ptr (pmap->map, cpu);
+		head = &map->hashes[hv];
+
+#if NEED_MAP_LOCKS
+		if (!spin_trylock(&map->lock))
+			return 0;
+#endif
+
+		hlist_for_each(e, head) {
+			n = (struct KEYSYM(pmap_node) *)((long)e - sizeof(struct list_head));
+			if (KEY1_EQ_P(n->key1, key1)
+#if KEY_ARITY > 1
+			    && KEY2_EQ_P(n->key2, key2)
+#if KEY_ARITY > 2
+			    && KEY3_EQ_P(n->key3, key3)
+#if KEY_ARITY > 3
+			    && KEY4_EQ_P(n->key4, key4)
+#if KEY_ARITY > 4
+			    && KEY5_EQ_P(n->key5, key5)
+#if KEY_ARITY > 5
+			    && KEY6_EQ_P(n->key6, key6)
+#if KEY_ARITY > 6
+			    && KEY7_EQ_P(n->key7, key7)
+#if KEY_ARITY > 7
+			    && KEY8_EQ_P(n->key8, key8)
+#if KEY_ARITY > 8
+			    && KEY9_EQ_P(n->key9, key9)
+#endif
+#endif
+#endif
+#endif
+#endif
+#endif
+#endif
+#endif
+				) {
+				found = 1;
+				break;
+			}
+		}
+#if NEED_MAP_LOCKS
+		spin_unlock(&map->lock);
+#endif
+		if (found)
+			break;
+	}
+	return found;
+}
+
 static int KEYSYM(__stp_pmap_del) (MAP map, ALLKEYSD(key))
 {
 	unsigned int hv;
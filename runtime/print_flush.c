@@ -16,6 +16,7 @@
  * @note Preemption must be disabled to use this.
  */
 
+/* Only needed when all cpus write the same buffer. */
 static DEFINE_SPINLOCK(_stp_print_lock);
 
 void EXPORT_FN(stp_print_flush)(_stp_pbuf *pb)
@@ -33,8 +34,10 @@ void EXPORT_FN(stp_print_flush)(_stp_pbuf *pb)
 	if (unlikely(_stp_transport_get_state() != STP_TRANSPORT_RUNNING))
 		return;
 
-#ifdef STP_BULKMODE
-#ifdef NO_PERCPU_HEADERS
+#if defined(STP_BULKMODE) || defined(STP_RELAY_PERCPU_STREAM)
+/* Each cpu has its own buffer, so no locking is needed.  Stream mode
+ * always gets the headers, since stapio needs them to merge. */
+#if defined(STP_BULKMODE) && defined(NO_PERCPU_HEADERS)
 	{
 		char *bufp = pb->buf;
 
@@ -59,40 +62,37 @@ void EXPORT_FN(stp_print_flush)(_stp_pbuf *pb)
 #else  /* !NO_PERCPU_HEADERS */
 
 	{
-		char *bufp = pb->buf;
-		struct _stp_trace t = {	.sequence = _stp_seq_inc(),
-					.pdu_len = len};
+		struct _stp_trace t = {	.pdu_len = len };
 		size_t bytes_reserved;
-
-		bytes_reserved = _stp_data_write_reserve(sizeof(struct _stp_trace), &entry);
-		if (likely(entry && bytes_reserved > 0)) {
-			/* prevent unaligned access by using memcpy() */
-			memcpy(_stp_data_entry_data(entry), &t, sizeof(t));
-			_stp_data_write_commit(entry);
-		}
-		else {
+		char *data;
+
+		/* The header and its data go out as one record, so stapio
+		 * never sees a header whose data doesn't follow in full.
+		 * The relay reserve is all or nothing; the ring buffer may
+		 * cut a record short, in which case the header says so.
+		 * The sequence number is only taken once the record has
+		 * room, so a dropped flush leaves no gap for stapio to wait
+		 * on. */
+		bytes_reserved = _stp_data_write_reserve(sizeof(t) + len, &entry);
+		if (unlikely(!entry || bytes_reserved < sizeof(t))) {
 			atomic_inc(&_stp_transport_failures);
 			return;
 		}
-
-		while (len > 0) {
-			bytes_reserved = _stp_data_write_reserve(len, &entry);
-			if (likely(entry && bytes_reserved > 0)) {
-				memcpy(_stp_data_entry_data(entry), bufp,
-				       bytes_reserved);
-				_stp_data_write_commit(entry);
-				bufp += bytes_reserved;
-				len -= bytes_reserved;
-			}
-			else {
-				atomic_inc(&_stp_transport_failures);
-				break;
-			}
+		t.sequence = _stp_seq_inc();
+		if (unlikely(bytes_reserved < sizeof(t) + len)) {
+			t.pdu_len = bytes_reserved - sizeof(t);
+			atomic_inc(&_stp_transport_failures);
 		}
+
+		data = _stp_data_entry_data(entry);
+		/* prevent unaligned access by using memcpy() */
+		memcpy(data, &t, sizeof(t));
+		memcpy(data + sizeof(t), pb->buf, t.pdu_len);
+		_stp_data_write_commit(entry);
 	}
 #endif /* !NO_PERCPU_HEADERS */
 
-#else  /* !STP_BULKMODE */
+#else  /* !STP_BULKMODE && !STP_RELAY_PERCPU_STREAM */
 
 #if STP_TRANSPORT_VERSION == 1
 	/** STP_TRANSPORT_VERSION == 1 is special, _stp_ctl_send will
@@ -130,5 +130,5 @@ void EXPORT_FN(stp_print_flush)(_stp_pbuf *pb)
 		spin_unlock_irqrestore(&_stp_print_lock, flags);
 	}
 #endif /* STP_TRANSPORT_VERSION != 1 */
-#endif /* !STP_BULKMODE */
+#endif /* !STP_BULKMODE && !STP_RELAY_PERCPU_STREAM */
 }
@@ -11,6 +11,7 @@
 #define _PROBE_LOCK_H
 
 #include <linux/spinlock.h>
+#include <linux/seqlock.h>
 
 // XXX: old 2.6 kernel hack
 #ifndef read_trylock
@@ -20,6 +21,7 @@
 struct stp_probe_lock {
 	#ifdef STP_TIMING
 	atomic_t *skipped;
+	atomic_t *contention;
 	#endif
 	rwlock_t *lock;
 	unsigned write_p;
@@ -46,12 +48,18 @@ stp_lock_probe(const struct stp_probe_lock *locks, unsigned num_locks)
 	for (i = 0; i < num_locks; ++i) {
 		if (locks[i].write_p)
 			while (!write_trylock(locks[i].lock)) {
+#ifdef STP_TIMING
+				atomic_inc(locks[i].contention);
+#endif
 				if (++retries > MAXTRYLOCK)
 					goto skip;
 				udelay (TRYLOCKDELAY);
 			}
 		else
 			while (!read_trylock(locks[i].lock)) {
+#ifdef STP_TIMING
+				atomic_inc(locks[i].contention);
+#endif
 				if (++retries > MAXTRYLOCK)
 					goto skip;
 				udelay (TRYLOCKDELAY);
@@ -69,4 +77,83 @@ skip:
 }
 
 
+#ifdef STP_STRIPED_LOCKS
+/* With --striped-locks, probes only share the lock of a global array
+ * while accessing single elements, and lock the hash stripe of the key
+ * around each access.  Only one stripe is held at a time, and only
+ * briefly, so unlike the global locks this needs no trylock loop. */
+
+static inline void
+_stp_map_lock_stripe(struct context *c, spinlock_t *stripe)
+{
+	if (stripe) {
+		spin_lock(stripe);
+		c->map_stripe = stripe;
+	}
+}
+
+
+static inline void
+_stp_map_unlock_stripe(struct context *c)
+{
+	if (c->map_stripe) {
+		spin_unlock(c->map_stripe);
+		c->map_stripe = NULL;
+	}
+}
+#endif
+
+
+/* Global scalars that are only ever added to (see
+ * elaborate.cxx:percpu_counter_collector) aren't locked at all.  They
+ * are kept as a base value, which is what they are initialized or
+ * assigned to, plus what has been added to them on each cpu. */
+
+static inline void
+_stp_counter_add(int64_t *pcpu, int64_t val)
+{
+	*per_cpu_ptr(pcpu, smp_processor_id()) += val;
+}
+
+
+static int64_t
+_stp_counter_read(const int64_t *base, int64_t *pcpu)
+{
+	int64_t sum = *base;
+	int cpu;
+	for_each_possible_cpu(cpu)
+		sum += *per_cpu_ptr(pcpu, cpu);
+	return sum;
+}
+
+
+/* Only called from begin/end/error probes. */
+static void
+_stp_counter_set(int64_t *base, int64_t *pcpu, int64_t val)
+{
+	int cpu;
+	for_each_possible_cpu(cpu)
+		*per_cpu_ptr(pcpu, cpu) = 0;
+	*base = val;
+}
+
+
+/* With --seqlock-reads, numeric global scalars that only rarely running
+ * probes write (see elaborate.cxx:semantic_pass_seqlocks) are read
+ * without locking, retrying if a store happened meanwhile.  This keeps
+ * 64-bit values from tearing on 32-bit kernels. */
+
+static inline int64_t
+_stp_seqlock_read(const int64_t *val, seqlock_t *seq)
+{
+	int64_t res;
+	unsigned start;
+	do {
+		start = read_seqbegin(seq);
+		res = *val;
+	} while (read_seqretry(seq, start));
+	return res;
+}
+
+
 #endif /* _PROBE_LOCK_H */
@@ -0,0 +1,149 @@
+/* -*- linux-c -*-
+ * Stack id functions
+ * Copyright (C) 2012 Red Hat Inc.
+ *
+ * This file is part of systemtap, and is free software.  You can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License (GPL); either version 2, or (at your option) any
+ * later version.
+ */
+
+/*
+  Included from stack.c when the script uses the stack id functions
+  (context-stackid.stp defines STP_NEED_STACK_IDS).  Backtraces are
+  interned as raw address arrays in a fixed size table, and a stack
+  id is simply the (1-based) slot number.  That makes aggregating by
+  stack as cheap as aggregating by a number; symbols are only looked
+  up when a stack id gets printed.
+*/
+
+#ifndef _STACK_ID_C_
+#define _STACK_ID_C_
+
+#include <linux/jhash.h>
+
+/* Number of distinct stacks that can be interned, a power of two. */
+#ifndef STP_STACK_ID_TABLE_SIZE
+#define STP_STACK_ID_TABLE_SIZE 1024
+#endif
+
+#if STP_STACK_ID_TABLE_SIZE & (STP_STACK_ID_TABLE_SIZE - 1)
+#error "STP_STACK_ID_TABLE_SIZE must be a power of two"
+#endif
+
+/* Slots tried before giving up on a stack, keeps interning bounded. */
+#define _STP_STACK_ID_PROBES 32
+
+/* The current address plus MAXBACKTRACE levels. */
+#define _STP_STACK_ID_DEPTH (MAXBACKTRACE + 1)
+
+struct _stp_stack_id_ent {
+	u32 hash;		/* 0 while the slot is free */
+	int depth;		/* 0 until the addresses are filled in */
+	unsigned long pcs[_STP_STACK_ID_DEPTH];
+};
+
+static struct _stp_stack_id_ent _stp_stack_ids[STP_STACK_ID_TABLE_SIZE];
+
+/* Number of stacks that didn't fit in the table. */
+static atomic_t _stp_stack_ids_dropped = ATOMIC_INIT(0);
+
+/** Returns the stack id for the given addresses, interning them in
+ * the table if they are new.  Returns 0 if the table is full.
+ * Can be called concurrently from all cpus.
+ */
+static int64_t _stp_stack_id_intern(const unsigned long *pcs, int depth)
+{
+	u32 hash;
+	unsigned i, n;
+
+	if (depth <= 0)
+		return 0;
+
+	hash = jhash(pcs, depth * sizeof(unsigned long), depth);
+	if (hash == 0)
+		hash = 1;
+
+	for (n = 0; n < _STP_STACK_ID_PROBES; n++) {
+		struct _stp_stack_id_ent *e;
+		u32 h;
+		int spins;
+
+		i = (hash + n) & (STP_STACK_ID_TABLE_SIZE - 1);
+		e = &_stp_stack_ids[i];
+		h = ACCESS_ONCE(e->hash);
+		if (h == 0) {
+			h = cmpxchg(&e->hash, 0, hash);
+			if (h == 0) {
+				/* Claimed it, publish the addresses. */
+				memcpy(e->pcs, pcs, depth * sizeof(unsigned long));
+				smp_wmb();
+				e->depth = depth;
+				return i + 1;
+			}
+		}
+		if (h != hash)
+			continue;
+
+		/* Another cpu may still be filling in this slot; that
+		   doesn't take long, it can't be interrupted by probes. */
+		for (spins = 0; !ACCESS_ONCE(e->depth) && spins < 1000; spins++)
+			cpu_relax();
+		smp_rmb();
+		if (e->depth == depth
+		    && memcmp(e->pcs, pcs, depth * sizeof(unsigned long)) == 0)
+			return i + 1;
+	}
+
+	atomic_inc(&_stp_stack_ids_dropped);
+	return 0;
+}
+
+static struct _stp_stack_id_ent *_stp_stack_id_lookup(int64_t id)
+{
+	struct _stp_stack_id_ent *e;
+
+	if (id < 1 || id > STP_STACK_ID_TABLE_SIZE)
+		return NULL;
+	e = &_stp_stack_ids[id - 1];
+	if (!ACCESS_ONCE(e->depth))
+		return NULL;
+	smp_rmb();
+	return e;
+}
+
+/** Returns the stack id of the current kernel backtrace. */
+static int64_t _stp_stack_kernel_id(struct context *c)
+{
+	unsigned long pcs[_STP_STACK_ID_DEPTH];
+	int depth = _stp_stack_kernel_get(c, pcs, _STP_STACK_ID_DEPTH);
+	return _stp_stack_id_intern(pcs, depth);
+}
+
+/** Prints the stack with the given id, like _stp_stack_kernel_print. */
+static void _stp_stack_id_print(int64_t id, int sym_flags)
+{
+	struct _stp_stack_id_ent *e = _stp_stack_id_lookup(id);
+	int i;
+
+	if (e == NULL)
+		return;
+	for (i = 0; i < e->depth; i++)
+		_stp_print_addr(e->pcs[i], sym_flags, NULL);
+}
+
+/** Writes the stack with the given id to a string. */
+static void _stp_stack_id_sprint(char *str, int size, int64_t id,
+				 int sym_flags)
+{
+	/* Same trick as _stp_stack_kernel_sprint. */
+	_stp_pbuf *pb = per_cpu_ptr(Stp_pbuf, smp_processor_id());
+	_stp_print_flush();
+
+	_stp_stack_id_print(id, sym_flags);
+
+	strlcpy(str, pb->buf, size < (int)pb->len ? size : (int)pb->len);
+	pb->len = 0;
+}
+
+#endif /* _STACK_ID_C_ */
@@ -23,7 +23,8 @@ __stp_show_stack (unsigned long sp, unsigned long low,
 			return sp;
 		sf = (struct stack_frame *) sp;
 		ip = sf->gprs[8] & PSW_ADDR_INSN;
-		if (verbose)
+		/* Raw captures (for stack ids) want only the addresses. */
+		if (verbose && !(verbose & _STP_SYM_RAW))
 			_stp_printf("[%p] [%p] ", (int64_t)sp, (int64_t)ip);
 		_stp_print_addr((int64_t)ip, verbose, NULL);
 		/* Follow the back_chain */
@@ -36,7 +37,7 @@ __stp_show_stack (unsigned long sp, unsigned long low,
 				return sp;
 			sf = (struct stack_frame *) sp;
 			ip = sf->gprs[8] & PSW_ADDR_INSN;
-			if (verbose)
+			if (verbose && !(verbose & _STP_SYM_RAW))
 				_stp_printf("[%p] [%p] ", (int64_t)sp, (int64_t)ip);
 			_stp_print_addr((int64_t)ip, verbose, NULL);
 		}
@@ -45,7 +46,7 @@ __stp_show_stack (unsigned long sp, unsigned long low,
 		if (sp <= low || sp > high - sizeof(*regs))
 			return sp;
 		regs = (struct pt_regs *) sp;
-		if (verbose)
+		if (verbose && !(verbose & _STP_SYM_RAW))
 			_stp_printf("[%p] [%p] ", (int64_t)sp, (int64_t)ip);
 		_stp_print_addr((int64_t)ip, verbose, NULL);
 		low = sp;
@@ -382,6 +382,37 @@ static void _stp_stack_user_sprint(char *str, int size, struct context* c,
 	pb->len = 0;
 }
 
+/** Collects the kernel backtrace addresses
+ *
+ * @param pcs array to store the addresses in
+ * @param max size of pcs
+ * @returns number of addresses stored
+ */
+static int _stp_stack_kernel_get(struct context *c, unsigned long *pcs,
+				 int max)
+{
+	/* Same trick as above, but printing the raw addresses. */
+	_stp_pbuf *pb = per_cpu_ptr(Stp_pbuf, smp_processor_id());
+	int n;
+	_stp_print_flush();
+
+	_stp_stack_kernel_print(c, _STP_SYM_RAW);
+
+	/* Anything else, like a lone "\n" when there is no backtrace,
+	   is shorter than an address. */
+	n = pb->len / sizeof(unsigned long);
+	if (n > max)
+		n = max;
+	memcpy(pcs, pb->buf, n * sizeof(unsigned long));
+	pb->len = 0;
+	return n;
+}
+
+/* Only for scripts using the stack id functions, see stack-id.c. */
+#ifdef STP_NEED_STACK_IDS
+#include "stack-id.c"
+#endif
+
 #endif /* CONFIG_KPROBES */
 
 #endif /* _STACK_C_ */
@@ -35,6 +35,8 @@ const char *uprobes_path = NULL;
 int daemon_mode;
 off_t fsize_max;
 int fnum_max;
+int compress_level;
+int merge_bulk;
 int remote_id;
 const char *remote_uri;
 
@@ -96,12 +98,13 @@ int make_outfile_name(char *buf, int max, int fnum, int cpu, time_t t, int bulk)
 		strcpy(buf, "/dev/null");
 	} else {
 		if (bulk) {
-			if (snprintf_chk(&buf[len], max - len, "_cpu%d.%d",
-					 cpu, fnum))
+			if (snprintf_chk(&buf[len], max - len, "_cpu%d.%d%s",
+					 cpu, fnum, compress_level ? ".gz" : ""))
 				return -1;
 		} else {
 			/* stream mode */
-			if (snprintf_chk(&buf[len], max - len, ".%d", fnum))
+			if (snprintf_chk(&buf[len], max - len, ".%d%s", fnum,
+					 compress_level ? ".gz" : ""))
 				return -1;
 		}
 	}
@@ -129,10 +132,12 @@ void parse_args(int argc, char **argv)
 	daemon_mode = 0;
 	fsize_max = 0;
 	fnum_max = 0;
+	compress_level = 0;
+	merge_bulk = 0;
         remote_id = -1;
         remote_uri = NULL;
 
-	while ((c = getopt(argc, argv, "ALu::vb:t:dc:o:x:S:DwRr:VT:")) != EOF) {
+	while ((c = getopt(argc, argv, "ALu::vb:t:dc:o:x:S:DwRr:VT:z::M")) != EOF) {
 		switch (c) {
 		case 'u':
 			need_uprobes = 1;
@@ -213,6 +218,21 @@ void parse_args(int argc, char **argv)
                                 usage(argv[0]);
                         }
                         break;
+		case 'z':
+#ifdef HAVE_LIBZ
+			compress_level = optarg ? atoi(optarg) : Z_BEST_SPEED;
+			if (compress_level < 1 || compress_level > 9) {
+				err(_("Invalid compression level '%s' (should be 1-9).\n"), optarg);
+				usage(argv[0]);
+			}
+#else
+			err(_("Output compression is not available in this configuration.\n"));
+			usage(argv[0]);
+#endif
+			break;
+		case 'M':
+			merge_bulk = 1;
+			break;
 		default:
 			usage(argv[0]);
 		}
@@ -225,7 +245,7 @@ void parse_args(int argc, char **argv)
 			err(_("File name is too long.\n"));
 			usage(argv[0]);
 		}
-		ret = stap_strfloctime(tmp, PATH_MAX - 18, /* = _cpuNNN.SSSSSSSSSS */
+		ret = stap_strfloctime(tmp, PATH_MAX - 21, /* = _cpuNNN.SSSSSSSSSS.gz */
 				       outfile_name, time(NULL));
 		if (ret < 0) {
 			err(_("Filename format is invalid or too long.\n"));
@@ -281,12 +301,16 @@ void parse_args(int argc, char **argv)
 		err(_("You have to specify output FILE with '-S' option.\n"));
 		usage(argv[0]);
 	}
+	if (outfile_name == NULL && compress_level != 0) {
+		err(_("You have to specify output FILE with '-z' option.\n"));
+		usage(argv[0]);
+	}
 }
 
 void usage(char *prog)
 {
 	err(_("\n%s [-v] [-w] [-V] [-u] [-c cmd ] [-x pid] [-u user] [-A|-L|-d]\n"
-                "\t[-b bufsize] [-R] [-r N:URI] [-o FILE [-D] [-S size[,N]]] MODULE [module-options]\n"), prog);
+                "\t[-b bufsize] [-R] [-r N:URI] [-M] [-o FILE [-D] [-S size[,N]] [-z[level]]] MODULE [module-options]\n"), prog);
 	err(_("-v              Increase verbosity.\n"
 	"-V              Print version number and exit.\n"
 	"-w              Suppress warnings.\n"
@@ -316,6 +340,8 @@ void usage(char *prog)
 #endif
         "-r N:URI        Pass N:URI data to tapset functions remote_id()/remote_uri().\n"
 	"-D              Run in background. This requires '-o' option.\n"
+	"-M              In bulk mode, merge the per-cpu data in sequence\n"
+	"                order into a single output, like stap-merge.\n"
 	"-S size[,N]     Switches output file to next file when the size\n"
 	"                of file reaches the specified size. The value\n"
 	"                should be an integer greater than 1 which is\n"
@@ -325,7 +351,14 @@ void usage(char *prog)
 	"                the second argument.\n"
         "-T timeout      Specifies upper limit on amount of time reader thread\n"
         "                will wait for new full trace buffer. Value should be an\n"
-        "                integer >= 1, which is timeout value in ms. Default 200ms.\n\n"
+        "                integer >= 1, which is timeout value in ms. Default 200ms.\n"
+#ifdef HAVE_LIBZ
+	"-z[level]       Compress output files with gzip at the given level\n"
+	"                (1-9, default 1) and add a '.gz' suffix to their names.\n"
+	"                This requires '-o' option.\n\n"
+#else
+	"-z[level]       (Output compression is not available in this configuration.)\n\n"
+#endif
 	"MODULE can be either a module name or a module path.  If a\n"
 	"module name is used, it is searched in the following directory:\n"));
         {
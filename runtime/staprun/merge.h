@@ -0,0 +1,100 @@
+/* -*- linux-c -*-
+ *
+ * merge.h - ordering of per-cpu bulk mode records
+ *
+ * This file is part of systemtap, and is free software.  You can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License (GPL); either version 2, or (at your option) any
+ * later version.
+ *
+ * Copyright (C) 2012 Red Hat Inc.
+ */
+
+#ifndef _STAPRUN_MERGE_H_
+#define _STAPRUN_MERGE_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* In bulk mode every print flush is preceded by this header (struct
+ * _stp_trace in the runtime), with a sequence number that is global
+ * across cpus.  Each per-cpu stream is ordered by it. */
+struct merge_rec_hdr {
+	uint32_t sequence;
+	uint32_t pdu_len;
+};
+
+#define MERGE_HDR_SIZE (sizeof(struct merge_rec_hdr))
+
+/* Decode a header that may not be aligned. */
+static inline void merge_get_hdr(struct merge_rec_hdr *hdr, const void *p)
+{
+	memcpy(hdr, p, sizeof(*hdr));
+}
+
+/* A binary min-heap of input streams keyed by the sequence number of
+ * their next record, for a k-way merge in O(log k) per record. */
+struct merge_heap_ent {
+	uint32_t seq;
+	int src;
+};
+
+struct merge_heap {
+	struct merge_heap_ent *ent;
+	int n;
+};
+
+static inline int merge_heap_init(struct merge_heap *h, int max)
+{
+	h->n = 0;
+	h->ent = calloc(max > 0 ? max : 1, sizeof(*h->ent));
+	return h->ent ? 0 : -1;
+}
+
+static inline void merge_heap_free(struct merge_heap *h)
+{
+	free(h->ent);
+	h->ent = NULL;
+	h->n = 0;
+}
+
+static inline void merge_heap_push(struct merge_heap *h, uint32_t seq, int src)
+{
+	int i = h->n++;
+
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+		if (h->ent[parent].seq <= seq)
+			break;
+		h->ent[i] = h->ent[parent];
+		i = parent;
+	}
+	h->ent[i].seq = seq;
+	h->ent[i].src = src;
+}
+
+/* Remove the top entry.  The caller reads it first with h->ent[0]. */
+static inline void merge_heap_pop(struct merge_heap *h)
+{
+	struct merge_heap_ent last;
+	int i = 0;
+
+	if (h->n == 0)
+		return;
+	last = h->ent[--h->n];
+	for (;;) {
+		int child = 2 * i + 1;
+		if (child >= h->n)
+			break;
+		if (child + 1 < h->n && h->ent[child + 1].seq < h->ent[child].seq)
+			child++;
+		if (last.seq <= h->ent[child].seq)
+			break;
+		h->ent[i] = h->ent[child];
+		i = child;
+	}
+	h->ent[i] = last;
+}
+
+#endif /* _STAPRUN_MERGE_H_ */
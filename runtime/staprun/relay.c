@@ -11,6 +11,8 @@
  */
 
 #include "staprun.h"
+#include "merge.h"
+#include <sys/time.h>
 
 int out_fd[NR_CPUS];
 static pthread_t reader[NR_CPUS];
@@ -21,6 +23,34 @@ static volatile int stop_threads = 0;
 static time_t *time_backlog[NR_CPUS];
 static int backlog_order=0;
 #define BACKLOG_MASK ((1 << backlog_order) - 1)
+#ifdef HAVE_LIBZ
+static gzFile out_gz[NR_CPUS];
+#endif
+
+/* -M, or a module writing stream mode output through percpu files:
+ * the reader threads hand their data to merge_thread(), which writes
+ * the records of all cpus to out_fd[0] in sequence order. */
+struct merge_queue {
+	char *buf;
+	size_t head, len, cap;	/* unmerged bytes are buf[head..len) */
+	int queued;		/* next record is in the heap */
+	int dirty;		/* on merge_dirty[] */
+	unsigned long since;	/* merge_clock when the next record was queued */
+	unsigned long empty;	/* merge_clock when the reader last ran dry */
+};
+static struct merge_queue merge_q[NR_CPUS];
+static int merge_dirty[NR_CPUS];
+static int merge_ndirty = 0;
+static int merge_done = 0;
+static int merge_switch_file = 0;
+static unsigned long merge_clock = 0;	/* orders queueing and empty reports */
+static pthread_t merger;
+static pthread_mutex_t merge_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t merge_cond = PTHREAD_COND_INITIALIZER;
+
+/* The module prints user space addresses as tokens that
+ * merge_thread() replaces with symbols, see symbolize.c. */
+static int deferred_symbols = 0;
 
 #ifdef NEED_PPOLL
 int ppoll(struct pollfd *fds, nfds_t nfds,
@@ -67,6 +97,81 @@ time_t read_backlog(int cpu, int fnum)
 	return time_backlog[cpu][fnum & BACKLOG_MASK];
 }
 
+/**
+ *	open_compressor - wrap out_fd[cpu] in a gzip stream if -z was given
+ */
+static int open_compressor(int cpu)
+{
+#ifdef HAVE_LIBZ
+	char mode[4];
+
+	if (!compress_level)
+		return 0;
+	if (sprintf_chk(mode, "wb%d", compress_level))
+		return -1;
+	out_gz[cpu] = gzdopen(out_fd[cpu], mode);
+	if (out_gz[cpu] == NULL) {
+		_err("Couldn't set up output compression for cpu %d\n", cpu);
+		return -1;
+	}
+#else
+	(void) cpu;
+#endif
+	return 0;
+}
+
+static void close_outfile(int cpu)
+{
+#ifdef HAVE_LIBZ
+	if (out_gz[cpu]) {
+		/* Flushes the stream and writes the gzip trailer, so
+		 * each rotated file is complete on its own.  This also
+		 * closes out_fd[cpu]. */
+		if (gzclose(out_gz[cpu]) != Z_OK)
+			_err("Couldn't finish compressed output for cpu %d\n", cpu);
+		out_gz[cpu] = NULL;
+		return;
+	}
+#endif
+	close(out_fd[cpu]);
+}
+
+/* Writes all of @buf, returning @len, or -1 with errno set. */
+static ssize_t write_outfile(int cpu, const void *buf, size_t len)
+{
+	const char *p = buf;
+	size_t left = len;
+	ssize_t rc;
+
+#ifdef HAVE_LIBZ
+	if (out_gz[cpu]) {
+		int errnum;
+
+		if (len == 0 || gzwrite(out_gz[cpu], buf, len) > 0)
+			return len;
+		(void) gzerror(out_gz[cpu], &errnum);
+		if (errnum != Z_ERRNO)
+			errno = EIO;
+		return -1;
+	}
+#endif
+	while (left > 0) {
+		rc = write(out_fd[cpu], p, left);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (rc == 0) {
+			errno = EIO;
+			return -1;
+		}
+		p += rc;
+		left -= rc;
+	}
+	return len;
+}
+
 static int open_outfile(int fnum, int cpu, int remove_file)
 {
 	char buf[PATH_MAX];
@@ -82,14 +187,15 @@ static int open_outfile(int fnum, int cpu, int remove_file)
 			 /* remove oldest file */
 			if (make_outfile_name(buf, PATH_MAX, fnum - fnum_max,
 				 cpu, read_backlog(cpu, fnum - fnum_max),
-				 bulkmode) < 0)
+				 bulkmode && !merge_bulk) < 0)
 				return -1;
 			remove(buf); /* don't care */
 		}
 		write_backlog(cpu, fnum, t);
 	}
 
-	if (make_outfile_name(buf, PATH_MAX, fnum, cpu, t, bulkmode) < 0)
+	if (make_outfile_name(buf, PATH_MAX, fnum, cpu, t,
+			      bulkmode && !merge_bulk) < 0)
 		return -1;
 	out_fd[cpu] = open (buf, O_CREAT|O_TRUNC|O_WRONLY, 0666);
 	if (out_fd[cpu] < 0) {
@@ -98,7 +204,7 @@ static int open_outfile(int fnum, int cpu, int remove_file)
 	}
 	if (set_clexec(out_fd[cpu]) < 0)
 		return -1;
-	return 0;
+	return open_compressor(cpu);
 }
 
 static int switch_outfile(int cpu, int *fnum)
@@ -106,7 +212,7 @@ static int switch_outfile(int cpu, int *fnum)
 	int remove_file = 0;
 
 	dbug(3, "thread %d switching file\n", cpu);
-	close(out_fd[cpu]);
+	close_outfile(cpu);
 	*fnum += 1;
 	if (fnum_max && *fnum >= fnum_max)
 		remove_file = 1;
@@ -117,6 +223,279 @@ static int switch_outfile(int cpu, int *fnum)
 	return 0;
 }
 
+#ifdef SPLICE_F_MOVE
+/**
+ *	splice_relay - drain a per-cpu relay file with splice()
+ *	@cpu: cpu number of the channel buffer
+ *	@fnum: current output file number, advanced on file switch
+ *	@wsize: bytes written to the current output file
+ *	@pipefd: pipe used to move the pages between the two fds
+ *	@buf: bounce buffer, only used if the output fd refuses splice()
+ *	@bufsize: size of @buf, also the largest chunk moved at once
+ *
+ *	Moves data relay -> pipe -> output without copying it through
+ *	userspace. Returns 0 when the relay file has been drained, 1 if
+ *	splice() is not supported by the relay or output fd (the caller
+ *	should fall back to read()/write() from then on), and -1 on a
+ *	fatal error.
+ */
+static int splice_relay(int cpu, int *fnum, off_t *wsize, int pipefd[2],
+			char *buf, size_t bufsize)
+{
+	ssize_t len, rc, n;
+	int fallback = 0;
+
+	while ((len = splice(relay_fd[cpu], NULL, pipefd[1], NULL, bufsize,
+			     SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) > 0) {
+		/* Switching file */
+		if ((fsize_max && *wsize + len > fsize_max) ||
+		    switch_file[cpu]) {
+			if (switch_outfile(cpu, fnum) < 0)
+				return -1;
+			switch_file[cpu] = 0;
+			*wsize = 0;
+		}
+		for (n = len; n > 0; n -= rc) {
+			if (!fallback) {
+				rc = splice(pipefd[0], NULL, out_fd[cpu], NULL,
+					    n, SPLICE_F_MOVE);
+				if (rc < 0 && errno == EINVAL) {
+					/* e.g. a tty or an O_APPEND file */
+					dbug(2, "cpu %d: output fd doesn't support splice\n", cpu);
+					fallback = 1;
+				}
+			}
+			if (fallback) {
+				/* Empty what is left in the pipe by copying it. */
+				rc = read(pipefd[0], buf, (size_t)n < bufsize ? (size_t)n : bufsize);
+				if (rc > 0 && write_outfile(cpu, buf, rc) != rc)
+					rc = -1;
+			}
+			if (rc < 0) {
+				if (errno != EPIPE)
+					perr("Couldn't write to output %d for cpu %d, exiting.", out_fd[cpu], cpu);
+				return -1;
+			}
+			if (rc == 0) {
+				/* No error to report, the pipe just came up short. */
+				_err("Lost %zd bytes of output for cpu %d, exiting.\n", n, cpu);
+				return -1;
+			}
+		}
+		*wsize += len;
+		if (fallback)
+			return 1;
+	}
+	if (len < 0 && (errno == EINVAL || errno == ENOSYS)) {
+		dbug(2, "cpu %d: relay file doesn't support splice\n", cpu);
+		return 1;
+	}
+	return 0;
+}
+#endif
+
+/**
+ *	merge_append - queue data read from a cpu's relay file for merging
+ */
+static int merge_append(int cpu, const char *buf, size_t len)
+{
+	struct merge_queue *q = &merge_q[cpu];
+
+	pthread_mutex_lock(&merge_lock);
+	if (q->cap - q->len < len && q->head) {
+		memmove(q->buf, q->buf + q->head, q->len - q->head);
+		q->len -= q->head;
+		q->head = 0;
+	}
+	if (q->cap - q->len < len) {
+		size_t cap = q->cap ? q->cap : 65536;
+		char *nbuf;
+
+		while (cap - q->len < len)
+			cap *= 2;
+		nbuf = realloc(q->buf, cap);
+		if (nbuf == NULL) {
+			pthread_mutex_unlock(&merge_lock);
+			_err("Memory allocation failed\n");
+			return -1;
+		}
+		q->buf = nbuf;
+		q->cap = cap;
+	}
+	memcpy(q->buf + q->len, buf, len);
+	q->len += len;
+	if (!q->dirty) {
+		q->dirty = 1;
+		merge_dirty[merge_ndirty++] = cpu;
+	}
+	pthread_cond_signal(&merge_cond);
+	pthread_mutex_unlock(&merge_lock);
+	return 0;
+}
+
+/**
+ *	merge_report_empty - note that a cpu's relay file had no more data
+ */
+static void merge_report_empty(int cpu)
+{
+	pthread_mutex_lock(&merge_lock);
+	merge_q[cpu].empty = ++merge_clock;
+	pthread_cond_signal(&merge_cond);
+	pthread_mutex_unlock(&merge_lock);
+}
+
+/* Whether no cpu but @cpu can still hold a record that sorts before the
+ * one @cpu has queued: each other cpu has either queued a record of its
+ * own, or has run dry since that record was queued. */
+static int merge_others_drained(int cpu)
+{
+	unsigned long since = merge_q[cpu].since;
+	int i;
+
+	for (i = 0; i < ncpus; i++)
+		if (i != cpu && !merge_q[i].queued && merge_q[i].empty < since)
+			return 0;
+	return 1;
+}
+
+/* Puts cpu's next record in the heap, if it has arrived completely. */
+static void merge_queue_next(struct merge_heap *heap, int cpu)
+{
+	struct merge_queue *q = &merge_q[cpu];
+	struct merge_rec_hdr hdr;
+
+	if (q->queued || q->len - q->head < MERGE_HDR_SIZE)
+		return;
+	merge_get_hdr(&hdr, q->buf + q->head);
+	if (q->len - q->head - MERGE_HDR_SIZE < hdr.pdu_len)
+		return;
+	merge_heap_push(heap, hdr.sequence, cpu);
+	q->queued = 1;
+	q->since = ++merge_clock;
+}
+
+/**
+ *	merge_thread - write the records of all cpus in sequence order
+ *
+ *	A record is written once it is the next one expected, or once
+ *	every other cpu either has a record waiting or has reported its
+ *	relay file empty after the record was queued (each cpu's stream
+ *	is ordered, so the lowest one can't be overtaken any more).  The
+ *	module only numbers flushes that it has room for, so a missing
+ *	sequence number is still on its way, and is never skipped just
+ *	because it takes a while.
+ */
+static void *merge_thread(void *data)
+{
+	struct merge_heap heap;
+	struct merge_rec_hdr hdr;
+	char *rec = NULL;
+	size_t rec_size = 0, out_len;
+	const char *out;
+	uint32_t expected = 1;
+	off_t wsize = 0;
+	int fnum = 0;
+	int i, cpu;
+
+	(void) data;
+	if (merge_heap_init(&heap, ncpus) < 0) {
+		_err("Memory allocation failed\n");
+		goto error_out;
+	}
+
+	pthread_mutex_lock(&merge_lock);
+	for (;;) {
+		struct merge_queue *q;
+
+		while (merge_ndirty) {
+			cpu = merge_dirty[--merge_ndirty];
+			merge_q[cpu].dirty = 0;
+			merge_queue_next(&heap, cpu);
+		}
+
+		if (heap.n == 0) {
+			if (merge_done)
+				break;
+			pthread_cond_wait(&merge_cond, &merge_lock);
+			continue;
+		}
+
+		cpu = heap.ent[0].src;
+		q = &merge_q[cpu];
+		if (heap.ent[0].seq > expected && heap.n < ncpus && !merge_done
+		    && !merge_others_drained(cpu)) {
+			pthread_cond_wait(&merge_cond, &merge_lock);
+			continue;
+		}
+
+		merge_heap_pop(&heap);
+		q->queued = 0;
+		merge_get_hdr(&hdr, q->buf + q->head);
+		if (hdr.sequence > expected)
+			dbug(1, "merge: sequence %u..%u missing\n", expected,
+			     hdr.sequence - 1);
+		if (hdr.sequence >= expected)
+			expected = hdr.sequence + 1;
+		if (hdr.pdu_len > rec_size) {
+			char *nrec = realloc(rec, hdr.pdu_len);
+			if (nrec == NULL) {
+				pthread_mutex_unlock(&merge_lock);
+				_err("Memory allocation failed\n");
+				goto error_out;
+			}
+			rec = nrec;
+			rec_size = hdr.pdu_len;
+		}
+		memcpy(rec, q->buf + q->head + MERGE_HDR_SIZE, hdr.pdu_len);
+		q->head += MERGE_HDR_SIZE + hdr.pdu_len;
+		merge_queue_next(&heap, cpu);
+
+		/* Don't hold up the readers while writing. */
+		pthread_mutex_unlock(&merge_lock);
+		if ((fsize_max && wsize + hdr.pdu_len > fsize_max) ||
+		    merge_switch_file) {
+			if (switch_outfile(0, &fnum) < 0)
+				goto error_out;
+			merge_switch_file = 0;
+			wsize = 0;
+		}
+		out = rec;
+		out_len = hdr.pdu_len;
+		if (deferred_symbols && out_len) {
+			out = symbolize_record(rec, &out_len);
+			if (out == NULL) {
+				_err("Memory allocation failed\n");
+				goto error_out;
+			}
+		}
+		if (out_len && write_outfile(0, out, out_len) != (ssize_t)out_len) {
+			if (errno != EPIPE)
+				perr("Couldn't write to output %d, exiting.", out_fd[0]);
+			goto error_out;
+		}
+		wsize += out_len;
+		pthread_mutex_lock(&merge_lock);
+	}
+
+	for (i = 0; i < ncpus; i++)
+		if (merge_q[i].len != merge_q[i].head)
+			err("WARNING: %zu bytes of incomplete data from cpu %d\n",
+			    merge_q[i].len - merge_q[i].head, i);
+	pthread_mutex_unlock(&merge_lock);
+	merge_heap_free(&heap);
+	free(rec);
+	dbug(3, "exiting merge thread\n");
+	return(NULL);
+
+error_out:
+	merge_heap_free(&heap);
+	free(rec);
+	/* Signal the main thread that we need to quit */
+	kill(getpid(), SIGTERM);
+	dbug(2, "exiting merge thread after error\n");
+	return(NULL);
+}
+
 /**
  *	reader_thread - per-cpu channel buffer reader
  */
@@ -129,6 +508,7 @@ static void *reader_thread(void *data)
 	sigset_t sigs;
 	off_t wsize = 0;
 	int fnum = 0;
+	int pipefd[2] = { -1, -1 };
 
 	sigemptyset(&sigs);
 	sigaddset(&sigs,SIGUSR2);
@@ -137,12 +517,16 @@ static void *reader_thread(void *data)
 	sigfillset(&sigs);
 	sigdelset(&sigs,SIGUSR2);
 	
-	if (bulkmode) {
+	if (bulkmode || merge_bulk) {
 		cpu_set_t cpu_mask;
 		CPU_ZERO(&cpu_mask);
 		CPU_SET(cpu, &cpu_mask);
 		if( sched_setaffinity( 0, sizeof(cpu_mask), &cpu_mask ) < 0 )
 			_perr("sched_setaffinity");
+	}
+	/* When merging, keep the default timeout to pick up partly filled
+	 * buffers, so that quiet cpus don't hold back the merge. */
+	if (bulkmode && !merge_bulk) {
 #ifdef NEED_PPOLL
 		/* Without a real ppoll, there is a small race condition that could */
 		/* block ppoll(). So use a timeout to prevent that. */
@@ -154,6 +538,7 @@ static void *reader_thread(void *data)
 	}
 
         if (reader_timeout_ms) {
+                timeout = &tim;
                 timeout->tv_sec = reader_timeout_ms / 1000;
                 timeout->tv_nsec = (reader_timeout_ms - timeout->tv_sec * 1000) * 1000000;
         }
@@ -161,6 +546,22 @@ static void *reader_thread(void *data)
 	pollfd.fd = relay_fd[cpu];
 	pollfd.events = POLLIN;
 
+#ifdef SPLICE_F_MOVE
+	/* Compression and merging need the data in userspace anyway. */
+	if (!compress_level && !merge_bulk) {
+		if (pipe(pipefd) < 0) {
+			dbug(2, "cpu %d: pipe failed, not using splice\n", cpu);
+			pipefd[0] = pipefd[1] = -1;
+		} else if (set_clexec(pipefd[0]) < 0 || set_clexec(pipefd[1]) < 0)
+			goto error_out;
+	}
+#ifdef F_SETPIPE_SZ
+	/* Let one splice() move as much as one read() would. */
+	if (pipefd[0] >= 0)
+		(void) fcntl(pipefd[1], F_SETPIPE_SZ, sizeof(buf));
+#endif
+#endif
+
         do {
 		dbug(3, "thread %d start ppoll\n", cpu);
                 rc = ppoll(&pollfd, 1, timeout, &sigs);
@@ -182,7 +583,27 @@ static void *reader_thread(void *data)
 			}
                 }
 
+#ifdef SPLICE_F_MOVE
+		if (pipefd[0] >= 0) {
+			rc = splice_relay(cpu, &fnum, &wsize, pipefd,
+					  buf, sizeof(buf));
+			if (rc < 0)
+				goto error_out;
+			if (rc == 0)
+				continue;
+			/* Not supported here; use the copying loop from now on. */
+			close(pipefd[0]);
+			close(pipefd[1]);
+			pipefd[0] = pipefd[1] = -1;
+		}
+#endif
+
 		while ((rc = read(relay_fd[cpu], buf, sizeof(buf))) > 0) {
+			if (merge_bulk) {
+				if (merge_append(cpu, buf, rc) < 0)
+					goto error_out;
+				continue;
+			}
 			/* Switching file */
 			if ((fsize_max && wsize + rc > fsize_max) ||
 			    switch_file[cpu]) {
@@ -191,18 +612,28 @@ static void *reader_thread(void *data)
 				switch_file[cpu] = 0;
 				wsize = 0;
 			}
-			if (write(out_fd[cpu], buf, rc) != rc) {
+			if (write_outfile(cpu, buf, rc) != rc) {
 				if (errno != EPIPE)
 					perr("Couldn't write to output %d for cpu %d, exiting.", out_fd[cpu], cpu);
 				goto error_out;
 			}
 			wsize += rc;
 		}
+		if (merge_bulk && (rc == 0 || errno == EAGAIN))
+			merge_report_empty(cpu);
         } while (!stop_threads);
 	dbug(3, "exiting thread for cpu %d\n", cpu);
+	if (pipefd[0] >= 0) {
+		close(pipefd[0]);
+		close(pipefd[1]);
+	}
 	return(NULL);
 
 error_out:
+	if (pipefd[0] >= 0) {
+		close(pipefd[0]);
+		close(pipefd[1]);
+	}
 	/* Signal the main thread that we need to quit */
 	kill(getpid(), SIGTERM);
 	dbug(2, "exiting thread for cpu %d after error\n", cpu);
@@ -214,6 +645,11 @@ static void switchfile_handler(int sig)
 	int i;
 	if (stop_threads)
 		return;
+	if (merge_bulk) {
+		/* The merge thread switches before its next write. */
+		merge_switch_file = 1;
+		return;
+	}
 	for (i = 0; i < ncpus; i++)
 		if (reader[i] && switch_file[i]) {
 			dbug(2, "file switching is progressing, signal ignored.\n", sig);
@@ -261,6 +697,16 @@ int init_relayfs(void)
 
 	if (send_request(STP_BULK, rqbuf, sizeof(rqbuf)) == 0)
 		bulkmode = 1;
+	else if (send_request(STP_PERCPU_STREAM, rqbuf, sizeof(rqbuf)) == 0)
+		merge_bulk = 1; /* stream mode, but one file per cpu */
+	else
+		merge_bulk = 0; /* there is just one stream */
+
+	if (send_request(STP_DEFERRED_SYMBOLS, rqbuf, sizeof(rqbuf)) == 0) {
+		deferred_symbols = 1;
+		if (!merge_bulk)
+			err("WARNING: deferred user space symbols are only looked up in merged output (stream mode or -M)\n");
+	}
 
 	for (i = 0; i < NR_CPUS; i++) {
 		if (sprintf_chk(buf, "%s/trace%d", relay_filebase, i))
@@ -277,7 +723,7 @@ int init_relayfs(void)
 		_err("couldn't open %s.\n", buf);
 		return -1;
 	}
-	if (ncpus > 1 && bulkmode == 0) {
+	if (ncpus > 1 && bulkmode == 0 && merge_bulk == 0) {
 		_err("ncpus=%d, bulkmode = %d\n", ncpus, bulkmode);
 		_err("This is inconsistent! Please file a bug report. Exiting now.\n");
 		return -1;
@@ -289,13 +735,13 @@ int init_relayfs(void)
 
 	if (fsize_max) {
 		/* switch file mode */
-		for (i = 0; i < ncpus; i++) {
+		for (i = 0; i < (merge_bulk ? 1 : ncpus); i++) {
 			if (init_backlog(i) < 0)
 				return -1;
   			if (open_outfile(0, i, 0) < 0)
   				return -1;
 		}
-	} else if (bulkmode) {
+	} else if (bulkmode && !merge_bulk) {
 		for (i = 0; i < ncpus; i++) {
 			if (outfile_name) {
 				/* special case: for testing we sometimes want to write to /dev/null */
@@ -312,7 +758,8 @@ int init_relayfs(void)
 						return -1;
 					}
 					if (snprintf_chk(&buf[len],
-						PATH_MAX - len, "_%d", i))
+						PATH_MAX - len, "_%d%s", i,
+						compress_level ? ".gz" : ""))
 						return -1;
 				}
 			} else {
@@ -327,6 +774,8 @@ int init_relayfs(void)
 			}
 			if (set_clexec(out_fd[i]) < 0)
 				return -1;
+			if (open_compressor(i) < 0)
+				return -1;
 		}
 	} else {
 		/* stream mode */
@@ -337,6 +786,9 @@ int init_relayfs(void)
 				err("Invalid FILE name format\n");
 				return -1;
 			}
+			if (compress_level &&
+			    snprintf_chk(&buf[len], PATH_MAX - len, ".gz"))
+				return -1;
 			out_fd[0] = open (buf, O_CREAT|O_TRUNC|O_WRONLY, 0666);
 			if (out_fd[0] < 0) {
 				perr("Couldn't open output file %s", buf);
@@ -344,6 +796,8 @@ int init_relayfs(void)
 			}
 			if (set_clexec(out_fd[i]) < 0)
 				return -1;
+			if (open_compressor(0) < 0)
+				return -1;
 		} else
 			out_fd[0] = STDOUT_FILENO;
 		
@@ -355,6 +809,10 @@ int init_relayfs(void)
         sigemptyset(&sa.sa_mask);
         sigaction(SIGUSR2, &sa, NULL);
         dbug(2, "starting threads\n");
+	if (merge_bulk && pthread_create(&merger, NULL, merge_thread, NULL) < 0) {
+		_perr("failed to create thread");
+		return -1;
+	}
         for (i = 0; i < ncpus; i++) {
                 if (pthread_create(&reader[i], NULL, reader_thread,
                                    (void *)(long)i) < 0) {
@@ -383,6 +841,21 @@ void close_relayfs(void)
 		else
 			break;
 	}
+	if (merger) {
+		/* The readers are gone; write out whatever they left. */
+		pthread_mutex_lock(&merge_lock);
+		merge_done = 1;
+		pthread_cond_signal(&merge_cond);
+		pthread_mutex_unlock(&merge_lock);
+		pthread_join(merger, NULL);
+		symbolize_cleanup();
+	}
+#ifdef HAVE_LIBZ
+	for (i = 0; i < ncpus; i++) {
+		if (out_gz[i])
+			close_outfile(i);
+	}
+#endif
 	for (i = 0; i < ncpus; i++) {
 		if (relay_fd[i] >= 0)
 			close(relay_fd[i]);
@@ -413,6 +413,15 @@ int init_oldrelayfs(void)
 
 	dbug(2, "initializing relayfs.n_subbufs=%d subbuf_size=%d\n", n_subbufs, subbuf_size);
 
+	if (compress_level) {
+		err("Output compression is not supported by this kernel's transport.\n");
+		return -1;
+	}
+	if (merge_bulk) {
+		err("Merged bulk output is not supported by this kernel's transport.\n");
+		return -1;
+	}
+
 	if (n_subbufs)
 		bulkmode = 1;
  
@@ -14,7 +14,7 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  *
- * Copyright (C) Red Hat Inc, 2005-2007
+ * Copyright (C) Red Hat Inc, 2005-2012
  *
  */
 
@@ -23,6 +23,15 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "merge.h"
+
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
 
 static void usage (char *prog)
 {
@@ -30,24 +39,130 @@ static void usage (char *prog)
 	exit(-1);
 }
 
-#define TIMESTAMP_SIZE (sizeof(int))
-#define NR_CPUS 256
+/* One per-cpu input file.  Plain files are mmap'd and records are
+ * used in place; files written by "staprun -z" are read through zlib
+ * into a buffer. */
+struct input {
+	const char *name;
+	const char *map;
+	size_t size, pos;
+#ifdef HAVE_LIBZ
+	gzFile gz;
+	char *buf;
+	size_t bufsize;
+#endif
+	struct merge_rec_hdr hdr;	/* current record */
+	const char *data;
+};
 
-int main (int argc, char *argv[])
+static int open_input(struct input *in, const char *name)
 {
-	char *buf, *outfile_name = NULL;
-	int c, i, j, rc, dropped=0;
-	long count=0, min, num[NR_CPUS];
-	FILE *ofp = NULL;
-	FILE *fp[NR_CPUS] = { 0 };
-	int ncpus, len, verbose = 0;
-	int bufsize = 65536;
+	struct stat st;
+	unsigned char magic[2];
+	int fd;
 
-	buf = malloc(bufsize);
-	if (buf == NULL) {
-		fprintf(stderr, "Memory allocation failed.\n");
-		exit(-2);
+	memset(in, 0, sizeof(*in));
+	in->name = name;
+	fd = open(name, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "error opening file %s.\n", name);
+		return -1;
+	}
+
+	if (pread(fd, magic, 2, 0) == 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+#ifdef HAVE_LIBZ
+		in->gz = gzdopen(fd, "rb");
+		if (in->gz == NULL) {
+			fprintf(stderr, "error opening file %s.\n", name);
+			close(fd);
+			return -1;
+		}
+		return 0;
+#else
+		fprintf(stderr, "%s is compressed, but stap-merge was built without zlib.\n", name);
+		close(fd);
+		return -1;
+#endif
+	}
+
+	in->size = st.st_size;
+	if (in->size) {
+		in->map = mmap(NULL, in->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (in->map == MAP_FAILED) {
+			fprintf(stderr, "error mapping file %s: %s\n", name,
+				strerror(errno));
+			close(fd);
+			return -1;
+		}
+		madvise((void *)in->map, in->size, MADV_SEQUENTIAL);
+	}
+	close(fd);
+	return 0;
+}
+
+static void close_input(struct input *in)
+{
+#ifdef HAVE_LIBZ
+	if (in->gz) {
+		gzclose(in->gz);
+		free(in->buf);
+		return;
+	}
+#endif
+	if (in->map)
+		munmap((void *)in->map, in->size);
+}
+
+/* Load the next record of in.  Returns 1 if there is one, 0 at the end
+ * of the file.  A record cut short is fatal. */
+static int next_record(struct input *in)
+{
+#ifdef HAVE_LIBZ
+	if (in->gz) {
+		char hdr[MERGE_HDR_SIZE];
+
+		if (gzread(in->gz, hdr, MERGE_HDR_SIZE) != (int)MERGE_HDR_SIZE)
+			return 0;
+		merge_get_hdr(&in->hdr, hdr);
+		if (in->hdr.pdu_len > in->bufsize) {
+			in->bufsize = in->hdr.pdu_len;
+			in->buf = realloc(in->buf, in->bufsize);
+			if (in->buf == NULL) {
+				fprintf(stderr, "Memory allocation failed.\n");
+				exit(-2);
+			}
+		}
+		if (gzread(in->gz, in->buf, in->hdr.pdu_len) != (int)in->hdr.pdu_len) {
+			fprintf(stderr, "%s: truncated record %u\n", in->name,
+				in->hdr.sequence);
+			exit(-3);
+		}
+		in->data = in->buf;
+		return 1;
 	}
+#endif
+	if (in->size - in->pos < MERGE_HDR_SIZE)
+		return 0;
+	merge_get_hdr(&in->hdr, in->map + in->pos);
+	in->pos += MERGE_HDR_SIZE;
+	if (in->size - in->pos < in->hdr.pdu_len) {
+		fprintf(stderr, "%s: truncated record %u\n", in->name,
+			in->hdr.sequence);
+		exit(-3);
+	}
+	in->data = in->map + in->pos;
+	in->pos += in->hdr.pdu_len;
+	return 1;
+}
+
+int main (int argc, char *argv[])
+{
+	char *outfile_name = NULL;
+	int c, i, ninputs, verbose = 0;
+	long count = 0, dropped = 0;
+	FILE *ofp = NULL;
+	struct input *in;
+	struct merge_heap heap;
 
 	while ((c = getopt (argc, argv, "vo:")) != EOF)  {
 		switch (c) {
@@ -65,20 +180,19 @@ int main (int argc, char *argv[])
 	if (optind == argc)
 		usage (argv[0]);
 
-	i = 0;
-	while (optind < argc) {
-		fp[i] = fopen(argv[optind++], "r");
-		if (!fp[i]) {
-			fprintf(stderr, "error opening file %s.\n", argv[optind - 1]);
+	ninputs = argc - optind;
+	in = calloc(ninputs, sizeof(*in));
+	if (in == NULL || merge_heap_init(&heap, ninputs) < 0) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(-2);
+	}
+
+	for (i = 0; i < ninputs; i++) {
+		if (open_input(&in[i], argv[optind + i]) < 0)
 			return -1;
-		}
-		if (fread (buf, TIMESTAMP_SIZE, 1, fp[i]))
-			num[i] = *((int *)buf);
-		else
-			num[i] = 0;
-		i++;
+		if (next_record(&in[i]))
+			merge_heap_push(&heap, in[i].hdr.sequence, i);
 	}
-	ncpus = i;
 
 	if (!outfile_name)
 		ofp = stdout;
@@ -90,54 +204,42 @@ int main (int argc, char *argv[])
 			return -1;
 		}
 	}
-	
-	do {
-		min = num[0];
-		j = 0;
-		for (i = 1; i < ncpus; i++) {
-			if (min == 0 || (num[i] && num[i] < min)) {
-				min = num[i];
-				j = i;
-			}
-		}
+	setvbuf(ofp, NULL, _IOFBF, 1 << 20);
 
-		if (fread(&len, sizeof(int), 1, fp[j])) {
-			if (verbose)
-				fprintf(stdout, "[CPU:%d, seq=%ld, length=%d]\n", j, min, len);
-			if (len > bufsize) {
-				bufsize = len;
-				if (verbose) fprintf(stderr, "reallocating %d bytes\n", bufsize);
-				buf = realloc(buf, bufsize);
-				if (buf == NULL) {
-					fprintf(stderr, "Memory allocation failed.\n");	
-					exit(-2);
-				}
-			}
-			if ((rc = fread(buf, len, 1, fp[j])) <= 0 ) {
-				fprintf(stderr, "fread error: got %d\n", rc);
-				exit(-3);
-			}
-			if ((rc = fwrite(buf, len, 1, ofp)) <= 0 ) {
-				fprintf(stderr, "fread error: got %d\n", rc);
-				exit(-3);
-			}
+	while (heap.n) {
+		uint32_t min = heap.ent[0].seq;
+		struct input *cur = &in[heap.ent[0].src];
+
+		merge_heap_pop(&heap);
+		if (verbose)
+			fprintf(stdout, "[CPU:%d, seq=%u, length=%u]\n",
+				(int)(cur - in), min, cur->hdr.pdu_len);
+		if (cur->hdr.pdu_len
+		    && fwrite(cur->data, cur->hdr.pdu_len, 1, ofp) != 1) {
+			fprintf(stderr, "fwrite error: %s\n", strerror(errno));
+			exit(-3);
 		}
 
-		if (min && ++count != min) {
-			fprintf(stderr, "got %ld. expected %ld\n", min, count);
-			dropped += min - count ;
+		if (++count != min) {
+			fprintf(stderr, "got %u. expected %ld\n", min, count);
+			dropped += min - count;
 			count = min;
 		}
 
-		if (fread (buf, TIMESTAMP_SIZE, 1, fp[j]))
-			num[j] = *((int *)buf);
-		else
-			num[j] = 0;
-	} while (min);
+		if (next_record(cur))
+			merge_heap_push(&heap, cur->hdr.sequence, cur - in);
+	}
 
-	for (i = 0; i < ncpus; i++)
-		fclose (fp[i]);
-	fclose (ofp);
-	printf ("sequence had %d drops\n", dropped);
+	for (i = 0; i < ninputs; i++)
+		close_input(&in[i]);
+	merge_heap_free(&heap);
+	free(in);
+	if (fclose (ofp) != 0) {
+		fprintf(stderr, "ERROR: couldn't write output: %s\n", strerror(errno));
+		return -1;
+	}
+	/* Keep the count out of merged data going to stdout. */
+	fprintf (outfile_name ? stdout : stderr,
+		 "sequence had %ld drops\n", dropped);
 	return 0;
 }
@@ -40,6 +40,10 @@
 #include "config.h"
 #include "../../privilege.h"
 
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+
 /* define gettext options if NLS is set */
 #if ENABLE_NLS
 #define _(string) gettext(string)
@@ -142,6 +146,8 @@ void close_relayfs(void);
 int init_oldrelayfs(void);
 void close_oldrelayfs(int);
 int write_realtime_data(void *data, ssize_t nb);
+const char *symbolize_record(const char *buf, size_t *len);
+void symbolize_cleanup(void);
 void setup_signals(void);
 int make_outfile_name(char *buf, int max, int fnum, int cpu,
 		      time_t t, int bulk);
@@ -225,6 +231,8 @@ extern const char *uprobes_path;
 extern int daemon_mode;
 extern off_t fsize_max;
 extern int fnum_max;
+extern int compress_level;
+extern int merge_bulk;
 extern int remote_id;
 extern const char *remote_uri;
 
@@ -0,0 +1,483 @@
+/* -*- linux-c -*-
+ *
+ * symbolize.c - user space symbol lookups for --defer-symbols
+ *
+ * This file is part of systemtap, and is free software.  You can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License (GPL); either version 2, or (at your option) any
+ * later version.
+ *
+ * Copyright (C) 2012 Red Hat Inc.
+ */
+
+/*
+ * A module translated with --defer-symbols carries no symbol tables
+ * for user space modules.  Instead it prints user space addresses as
+ * tokens (see _stp_snprint_deferred_addr in runtime/sym.c):
+ *
+ *   "\036stpsym:flags:module:addr:vm_start:vm_size\036"
+ *
+ * with module an index into the modules it announced first, in records
+ * of their own:
+ *
+ *   "\036stpmod:module:build-id:path\036"
+ *
+ * Here each token is replaced by what _stp_snprint_addr would have
+ * printed, looking the symbol up in the file with elfutils.  Tokens cut
+ * short, e.g. by MAXSTRINGLEN, are left out.
+ */
+
+#include "staprun.h"
+#include <inttypes.h>
+#include <stdarg.h>
+#ifdef HAVE_LIBDW
+#include <elfutils/libdwfl.h>
+#include <gelf.h>
+#endif
+
+/* Keep in sync with the _STP_SYM flags in runtime/sym.h. */
+#define SYM_SYMBOL		1
+#define SYM_HEX_SYMBOL		2
+#define SYM_MODULE		4
+#define SYM_OFFSET		8
+#define SYM_SIZE		16
+#define SYM_INEXACT		32
+#define SYM_PRE_SPACE		64
+#define SYM_POST_SPACE		128
+#define SYM_NEWLINE		256
+#define SYM_MODULE_BASENAME	512
+
+#define SYM_TOKEN_MARK		'\036'
+#define SYM_TOKEN_START		"\036stpsym:"
+#define SYM_MODULE_START	"\036stpmod:"
+#define SYM_TOKEN_END		'\036'
+
+/* Both kinds of token start the same way, and are as long. */
+#define SYM_START_LEN		(sizeof(SYM_TOKEN_START) - 1)
+
+/* The modules the tokens refer to, by index. */
+struct sym_module {
+	char *path;
+	char *build_id;
+};
+
+static struct sym_module *sym_modules = NULL;
+static unsigned sym_num_modules = 0;
+
+/* Every file that was looked up, found or not, so each is only
+ * opened once. */
+struct sym_file {
+	char *path;
+	char *build_id;		/* as in the token */
+#ifdef HAVE_LIBDW
+	Dwfl *dwfl;
+	Dwfl_Module *mod;	/* NULL if the file couldn't be used */
+	GElf_Addr base;		/* page of the lowest address */
+	int is_dyn;
+#endif
+	struct sym_file *next;
+};
+
+static struct sym_file *sym_files = NULL;
+
+static char *sym_out = NULL;
+static size_t sym_out_len, sym_out_cap;
+
+static int sym_out_reserve(size_t n)
+{
+	if (sym_out_len + n > sym_out_cap) {
+		size_t cap = sym_out_cap ? sym_out_cap : 4096;
+		char *nout;
+		while (cap < sym_out_len + n)
+			cap *= 2;
+		nout = realloc(sym_out, cap);
+		if (nout == NULL)
+			return -1;
+		sym_out = nout;
+		sym_out_cap = cap;
+	}
+	return 0;
+}
+
+static int sym_out_add(const char *p, size_t n)
+{
+	if (sym_out_reserve(n) < 0)
+		return -1;
+	memcpy(sym_out + sym_out_len, p, n);
+	sym_out_len += n;
+	return 0;
+}
+
+static int sym_out_printf(const char *fmt, ...)
+	__attribute__ ((format (printf, 1, 2)));
+
+static int sym_out_printf(const char *fmt, ...)
+{
+	char buf[PATH_MAX + 256];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return -1;
+	if (n >= (int)sizeof(buf))
+		n = sizeof(buf) - 1;
+	return sym_out_add(buf, n);
+}
+
+#ifdef HAVE_LIBDW
+static const Dwfl_Callbacks sym_callbacks = {
+	.find_debuginfo = dwfl_standard_find_debuginfo,
+	.section_address = dwfl_offline_section_address,
+};
+
+/* Check the build-id of the file against the one of the probed
+ * process, a rebuilt binary would give bogus symbols. */
+static int sym_build_id_ok(Dwfl_Module *mod, const char *build_id)
+{
+	const unsigned char *bits;
+	GElf_Addr vaddr;
+	char hex[2 * 64 + 1];
+	int i, len;
+
+	if (strcmp(build_id, "-") == 0)
+		return 1;
+	len = dwfl_module_build_id(mod, &bits, &vaddr);
+	if (len <= 0 || len > 64)
+		return 0;
+	for (i = 0; i < len; i++)
+		sprintf(hex + 2 * i, "%02x", bits[i]);
+	return strcmp(hex, build_id) == 0;
+}
+
+static struct sym_file *sym_file_get(const char *path, const char *build_id)
+{
+	struct sym_file *f;
+
+	for (f = sym_files; f; f = f->next)
+		if (strcmp(f->path, path) == 0
+		    && strcmp(f->build_id, build_id) == 0)
+			return f;
+
+	f = calloc(1, sizeof(*f));
+	if (f == NULL)
+		return NULL;
+	f->path = strdup(path);
+	f->build_id = strdup(build_id);
+	if (f->path == NULL || f->build_id == NULL) {
+		free(f->path);
+		free(f->build_id);
+		free(f);
+		return NULL;
+	}
+
+	f->dwfl = dwfl_begin(&sym_callbacks);
+	if (f->dwfl) {
+		f->mod = dwfl_report_offline(f->dwfl, path, path, -1);
+		dwfl_report_end(f->dwfl, NULL, NULL);
+	}
+	if (f->mod && !sym_build_id_ok(f->mod, build_id)) {
+		err("WARNING: build-id mismatch for %s, not looking up its symbols\n",
+		    path);
+		f->mod = NULL;
+	}
+	if (f->mod) {
+		GElf_Addr bias, low;
+		Elf *elf = dwfl_module_getelf(f->mod, &bias);
+		GElf_Ehdr ehdr;
+
+		dwfl_module_info(f->mod, NULL, &low, NULL, NULL, NULL, NULL,
+				 NULL);
+		f->base = low & ~((GElf_Addr)getpagesize() - 1);
+		f->is_dyn = (elf && gelf_getehdr(elf, &ehdr)
+			     && ehdr.e_type == ET_DYN);
+	} else
+		dbug(2, "no symbols for %s\n", path);
+
+	f->next = sym_files;
+	sym_files = f;
+	return f;
+}
+#endif /* HAVE_LIBDW */
+
+/* Looks up the symbol of addr, mapped from path at vm_start.  Like
+ * _stp_kallsyms_lookup in the runtime.  */
+static const char *sym_lookup(const char *path, const char *build_id,
+			      uint64_t addr, uint64_t vm_start,
+			      uint64_t *offset, uint64_t *size)
+{
+#ifdef HAVE_LIBDW
+	struct sym_file *f = sym_file_get(path, build_id);
+	GElf_Sym sym;
+	GElf_Addr a;
+	const char *name;
+
+	if (f == NULL || f->mod == NULL)
+		return NULL;
+	/* Shared libraries and PIEs are looked up relative to where
+	 * they got mapped in, like _stp_kallsyms_lookup does for
+	 * modules with a .dynamic section. */
+	a = f->is_dyn ? addr - vm_start + f->base : addr;
+	name = dwfl_module_addrsym(f->mod, a, &sym, NULL);
+	if (name == NULL)
+		return NULL;
+	*offset = a - sym.st_value;
+	*size = sym.st_size;
+	return name;
+#else
+	(void)path; (void)build_id; (void)addr; (void)vm_start;
+	(void)offset; (void)size;
+	return NULL;
+#endif
+}
+
+/* Appends what _stp_snprint_addr would have printed for the token
+ * fields.  Returns -1 on allocation failure. */
+static int sym_format(int flags, uint64_t addr, uint64_t vm_start,
+		      uint64_t vm_end, const char *build_id, const char *path)
+{
+	const char *prestr, *exstr, *poststr;
+	const char *name = NULL, *modname = path;
+	uint64_t offset = 0, size = 0;
+	char hex[32];
+
+	prestr = (flags & SYM_PRE_SPACE) ? " " : "";
+	exstr = (((flags & SYM_INEXACT) && (flags & SYM_SYMBOL))
+		 ? " (inexact)" : "");
+	if (flags & SYM_POST_SPACE)
+		poststr = " ";
+	else if (flags & SYM_NEWLINE)
+		poststr = "\n";
+	else
+		poststr = "";
+
+	name = sym_lookup(path, build_id, addr, vm_start, &offset, &size);
+	if (name == NULL) {
+		/* In case no symbol is found, fill in based on module. */
+		offset = addr - vm_start;
+		size = vm_end - vm_start;
+	} else if (name[0] == '.')
+		name++;
+
+	if (flags & SYM_MODULE_BASENAME) {
+		const char *slash = strrchr(modname, '/');
+		if (slash)
+			modname = slash + 1;
+	}
+
+	/* The runtime prints the address with %p, which is %#x. */
+	snprintf(hex, sizeof(hex), "%#" PRIx64, addr);
+
+	if (name && (flags & SYM_SYMBOL)) {
+		if (flags & SYM_HEX_SYMBOL) {
+			if (sym_out_printf("%s%s : %s", prestr, hex, name) < 0)
+				return -1;
+		} else if (sym_out_printf("%s%s", prestr, name) < 0)
+			return -1;
+		if (flags & SYM_OFFSET) {
+			if (sym_out_printf("+%#" PRIx64, offset) < 0)
+				return -1;
+			if ((flags & SYM_SIZE)
+			    && sym_out_printf("/%#" PRIx64, size) < 0)
+				return -1;
+		}
+		if ((flags & SYM_MODULE) && *modname
+		    && sym_out_printf(" [%s]", modname) < 0)
+			return -1;
+	} else if ((flags & SYM_MODULE) && *modname) {
+		/* hex address, module name, maybe offset and size */
+		if (sym_out_printf("%s%s [%s", prestr, hex, modname) < 0)
+			return -1;
+		if (flags & SYM_OFFSET) {
+			if (sym_out_printf("+%#" PRIx64, offset) < 0)
+				return -1;
+			if ((flags & SYM_SIZE)
+			    && sym_out_printf("/%#" PRIx64, size) < 0)
+				return -1;
+		}
+		if (sym_out_add("]", 1) < 0)
+			return -1;
+	} else if (sym_out_printf("%s%s", prestr, hex) < 0)
+		return -1;
+
+	return sym_out_printf("%s%s", exstr, poststr);
+}
+
+/* Splits the token at p (just after its start) up to end, which points
+ * at the closing SYM_TOKEN_END, into its n fields.  The last field takes
+ * the rest, a path may contain ':' itself.  Returns 0 on success. */
+static int sym_fields(const char *p, const char *end, char *tok,
+		      size_t tok_size, char **fields, int n)
+{
+	char *s = tok;
+	int i;
+
+	if ((size_t)(end - p) >= tok_size)
+		return -1;
+	memcpy(tok, p, end - p);
+	tok[end - p] = '\0';
+
+	for (i = 0; i < n - 1; i++) {
+		char *colon = strchr(s, ':');
+		if (colon == NULL)
+			return -1;
+		*colon = '\0';
+		fields[i] = s;
+		s = colon + 1;
+	}
+	fields[n - 1] = s;
+	return 0;
+}
+
+/* Remembers a module announced by a SYM_MODULE_START record.  Returns 0
+ * if it was taken, 1 if it wasn't a valid record, -1 on allocation
+ * failure. */
+static int sym_module(const char *p, const char *end)
+{
+	char tok[PATH_MAX + 256];
+	char *fields[3];
+	unsigned idx;
+
+	if (sym_fields(p, end, tok, sizeof(tok), fields, 3) != 0
+	    || sscanf(fields[0], "%x", &idx) != 1 || idx > 0xffff)
+		return 1;
+
+	if (idx >= sym_num_modules) {
+		struct sym_module *m = realloc(sym_modules,
+					       (idx + 1) * sizeof(*m));
+		if (m == NULL)
+			return -1;
+		memset(m + sym_num_modules, 0,
+		       (idx + 1 - sym_num_modules) * sizeof(*m));
+		sym_modules = m;
+		sym_num_modules = idx + 1;
+	}
+	free(sym_modules[idx].path);
+	free(sym_modules[idx].build_id);
+	sym_modules[idx].path = strdup(fields[2]);
+	sym_modules[idx].build_id = strdup(fields[1]);
+	if (sym_modules[idx].path == NULL || sym_modules[idx].build_id == NULL)
+		return -1;
+	return 0;
+}
+
+/* Parses one token at p (just after SYM_TOKEN_START) up to end, which
+ * points at the closing SYM_TOKEN_END.  Returns 0 if it was replaced,
+ * 1 if it wasn't a valid token, -1 on allocation failure. */
+static int sym_token(const char *p, const char *end)
+{
+	char tok[128];
+	char *fields[5];
+	unsigned long long addr, vm_start, vm_size;
+	unsigned flags, idx;
+
+	if (sym_fields(p, end, tok, sizeof(tok), fields, 5) != 0
+	    || sscanf(fields[0], "%x", &flags) != 1
+	    || sscanf(fields[1], "%x", &idx) != 1
+	    || sscanf(fields[2], "%llx", &addr) != 1
+	    || sscanf(fields[3], "%llx", &vm_start) != 1
+	    || sscanf(fields[4], "%llx", &vm_size) != 1)
+		return 1;
+	if (idx >= sym_num_modules || sym_modules[idx].path == NULL)
+		return 1;
+
+	return sym_format(flags, addr, vm_start, vm_start + vm_size,
+			  sym_modules[idx].build_id, sym_modules[idx].path);
+}
+
+/* Returns the start of the next token in [p, end), or NULL. */
+static const char *sym_next_token(const char *p, const char *end)
+{
+	while ((p = memchr(p, SYM_TOKEN_MARK, end - p)) != NULL) {
+		if ((size_t)(end - p) >= SYM_START_LEN
+		    && (memcmp(p, SYM_TOKEN_START, SYM_START_LEN) == 0
+			|| memcmp(p, SYM_MODULE_START, SYM_START_LEN) == 0))
+			return p;
+		p++;
+	}
+	return NULL;
+}
+
+/**
+ *	symbolize_record - replace the symbol tokens in a record
+ *	@buf: the record
+ *	@len: its length, updated to the length of the result
+ *
+ *	Returns buf if there was nothing to replace, otherwise a buffer
+ *	that stays valid until the next call.  Returns NULL on
+ *	allocation failure.  Records are complete print flushes, so a
+ *	token never spans two of them, but a token may be cut short when
+ *	it was part of a string.  Such a token ends where the next one
+ *	starts, or at the end of the record, and is left out.
+ */
+const char *symbolize_record(const char *buf, size_t *len)
+{
+	const char *p = buf, *end = buf + *len;
+	const char *tok;
+
+	tok = sym_next_token(p, end);
+	if (tok == NULL)
+		return buf;
+
+	sym_out_len = 0;
+	while (tok) {
+		const char *tok_end = memchr(tok + SYM_START_LEN, SYM_TOKEN_END,
+					     end - tok - SYM_START_LEN);
+		int rc;
+
+		if (sym_out_add(p, tok - p) < 0)
+			return NULL;
+		if (tok_end == NULL || sym_next_token(tok_end, end) == tok_end) {
+			/* Cut short, resynchronise on the next token. */
+			p = tok_end ? tok_end : end;
+			tok = sym_next_token(p, end);
+			continue;
+		}
+
+		if (memcmp(tok, SYM_MODULE_START, SYM_START_LEN) == 0)
+			rc = sym_module(tok + SYM_START_LEN, tok_end);
+		else
+			rc = sym_token(tok + SYM_START_LEN, tok_end);
+		if (rc < 0)
+			return NULL;
+		if (rc > 0 && sym_out_add(tok, tok_end + 1 - tok) < 0)
+			return NULL;
+		p = tok_end + 1;
+		tok = sym_next_token(p, end);
+	}
+	if (sym_out_add(p, end - p) < 0)
+		return NULL;
+
+	*len = sym_out_len;
+	return sym_out;
+}
+
+void symbolize_cleanup(void)
+{
+	struct sym_file *f = sym_files;
+
+	while (f) {
+		struct sym_file *next = f->next;
+#ifdef HAVE_LIBDW
+		if (f->dwfl)
+			dwfl_end(f->dwfl);
+#endif
+		free(f->path);
+		free(f->build_id);
+		free(f);
+		f = next;
+	}
+	sym_files = NULL;
+	while (sym_num_modules > 0) {
+		sym_num_modules--;
+		free(sym_modules[sym_num_modules].path);
+		free(sym_modules[sym_num_modules].build_id);
+	}
+	free(sym_modules);
+	sym_modules = NULL;
+	free(sym_out);
+	sym_out = NULL;
+	sym_out_len = sym_out_cap = 0;
+}
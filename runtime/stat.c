@@ -193,22 +193,9 @@ static void _stp_stat_clear_data (Stat st, stat *sd)
         }
 }
 
-/** Get Stats.
- * Gets the aggregated Stats for all CPUs.
- *
- * If NEED_STAT_LOCKS is set, you MUST call STAT_UNLOCK()
- * when you are finished with the returned pointer.
- *
- * @param st Stat
- * @param clear Set if you want the data cleared after the read. Useful
- * for polling.
- * @returns A pointer to a stat.
- */
-static stat *_stp_stat_get (Stat st, int clear)
+static void __stp_stat_aggregate (Stat st, stat *agg, int clear)
 {
 	int i, j;
-	stat *agg = st->agg;
-	STAT_LOCK(agg);
 	_stp_stat_clear_data (st, agg);
 
 	for_each_possible_cpu(i) {
@@ -234,9 +221,40 @@ static stat *_stp_stat_get (Stat st, int clear)
 		}
 		STAT_UNLOCK(sd);
 	}
+}
+
+/** Get Stats.
+ * Gets the aggregated Stats for all CPUs.
+ *
+ * If NEED_STAT_LOCKS is set, you MUST call STAT_UNLOCK()
+ * when you are finished with the returned pointer.
+ *
+ * @param st Stat
+ * @param clear Set if you want the data cleared after the read. Useful
+ * for polling.
+ * @returns A pointer to a stat.
+ */
+static stat *_stp_stat_get (Stat st, int clear)
+{
+	stat *agg = st->agg;
+	STAT_LOCK(agg);
+	__stp_stat_aggregate (st, agg, clear);
 	return agg;
 }
 
+/** Copy Stats.
+ * Aggregates the Stats for all CPUs into a caller's buffer, rather
+ * than the one _stp_stat_get() returns.  Use this to poll a Stat that
+ * may be read elsewhere at the same time.
+ *
+ * @param st Stat
+ * @param agg Buffer with room for the Stat's histogram.
+ */
+static void _stp_stat_copy (Stat st, stat *agg)
+{
+	__stp_stat_aggregate (st, agg, 0);
+}
+
 
 /** Clear Stats.
  * Clears the Stats.
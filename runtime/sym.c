@@ -16,6 +16,9 @@
 #include "vma.c"
 #include "string.c"
 #include <asm/uaccess.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/sort.h>
 
 #ifdef STAPCONF_PROBE_KERNEL
 #include <linux/uaccess.h>
@@ -91,13 +94,201 @@ static unsigned long _stp_umodule_relocate(const char *path,
   return 0;
 }
 
+/* Sorted, non-overlapping address ranges of all kernel module sections
+   currently in memory, so _stp_kmod_sec_lookup() can binary search
+   instead of scanning every section of every module.  The index is
+   rebuilt whenever a section address changes and swapped in with RCU,
+   so lookups need no lock.  Until it is built at startup, or if
+   building it failed, lookups fall back to the linear scan. */
+struct _stp_kmod_sec_ent {
+  unsigned long addr;
+  unsigned long size;
+  struct _stp_module *mod;
+  struct _stp_section *sec;
+};
+
+struct _stp_kmod_sec_index {
+  struct rcu_head rcu;
+  unsigned num_entries;
+  struct _stp_kmod_sec_ent entries[];
+};
+
+static struct _stp_kmod_sec_index *_stp_kmod_sec_index = NULL;
+static int _stp_kmod_sec_index_active = 0;
+static DEFINE_MUTEX(_stp_kmod_sec_index_mutex);
+
+static int _stp_kmod_sec_ent_cmp(const void *a, const void *b)
+{
+  const struct _stp_kmod_sec_ent *x = a, *y = b;
+  if (x->addr == y->addr)
+    return 0;
+  return x->addr < y->addr ? -1 : 1;
+}
+
+/* NB: old indexes are freed from an RCU callback, where the DEBUG_MEM
+   _stp_kfree() can't be used, hence plain kmalloc/kfree. */
+static void _stp_kmod_sec_index_free(struct rcu_head *rcu)
+{
+  kfree(container_of(rcu, struct _stp_kmod_sec_index, rcu));
+}
+
+/* Replace the index.  Must hold _stp_kmod_sec_index_mutex. */
+static void _stp_kmod_sec_index_update(void)
+{
+  struct _stp_kmod_sec_index *idx = NULL, *old;
+  unsigned mi, si, i, n = 0;
+
+  if (_stp_kmod_sec_index_active) {
+    for (mi = 0; mi < _stp_num_modules; mi++)
+      for (si = 0; si < _stp_modules[mi]->num_sections; si++)
+        if (_stp_modules[mi]->sections[si].static_addr != 0
+            && _stp_modules[mi]->sections[si].size != 0)
+          n++;
+
+    idx = kmalloc(sizeof(*idx) + n * sizeof(idx->entries[0]),
+                  GFP_KERNEL | __GFP_NOWARN);
+  }
+  if (idx) {
+    n = 0;
+    for (mi = 0; mi < _stp_num_modules; mi++)
+      for (si = 0; si < _stp_modules[mi]->num_sections; si++)
+        {
+          struct _stp_section *s = &_stp_modules[mi]->sections[si];
+          if (s->static_addr == 0 || s->size == 0)
+            continue;
+          idx->entries[n].addr = s->static_addr;
+          idx->entries[n].size = s->size;
+          idx->entries[n].mod = _stp_modules[mi];
+          idx->entries[n].sec = s;
+          n++;
+        }
+    sort(idx->entries, n, sizeof(idx->entries[0]),
+         _stp_kmod_sec_ent_cmp, NULL);
+
+    /* Sections shouldn't overlap; if they do, the lower one wins. */
+    idx->num_entries = 0;
+    for (i = 0; i < n; i++)
+      {
+        struct _stp_kmod_sec_ent *prev = NULL;
+        if (idx->num_entries)
+          prev = &idx->entries[idx->num_entries - 1];
+        if (prev && idx->entries[i].addr - prev->addr < prev->size)
+          {
+            dbug_sym(1, "section %s of %s overlaps %s of %s\n",
+                     idx->entries[i].sec->name, idx->entries[i].mod->name,
+                     prev->sec->name, prev->mod->name);
+            continue;
+          }
+        idx->entries[idx->num_entries++] = idx->entries[i];
+      }
+  }
+
+  old = _stp_kmod_sec_index;
+  rcu_assign_pointer(_stp_kmod_sec_index, idx);
+  if (old)
+    call_rcu(&old->rcu, _stp_kmod_sec_index_free);
+}
+
+/* Per-cpu, direct-mapped cache of _stp_kallsyms_lookup() results, so
+   that scripts symbolizing the same few addresses over and over (by
+   probefunc(), symname(caller_addr()) or backtraces) skip the module
+   and symbol searches.  Entries are keyed by address and tgid (0 for
+   the kernel), and only valid for the _stp_sym_cache_gen they were
+   filled in. */
+#ifndef STP_SYM_CACHE_BITS
+#define STP_SYM_CACHE_BITS 6
+#endif
+
+#ifndef in_nmi
+#define in_nmi() 0
+#endif
+
+struct _stp_sym_cache_ent {
+  unsigned long addr;	/* 0 while the entry is being written */
+  pid_t tgid;
+  int gen;
+  const char *symbol;
+  const char *modname;
+  unsigned long offset;
+  unsigned long symbolsize;
+};
+
+struct _stp_sym_cache {
+  struct _stp_sym_cache_ent entries[1 << STP_SYM_CACHE_BITS];
+};
+
+static struct _stp_sym_cache *_stp_sym_cache = NULL;
+
+static inline struct _stp_sym_cache_ent *
+_stp_sym_cache_ent(unsigned long addr, pid_t tgid)
+{
+  return &per_cpu_ptr(_stp_sym_cache, smp_processor_id())
+    ->entries[hash_long(addr ^ tgid, STP_SYM_CACHE_BITS)];
+}
+
+/* Called at startup, once staprun has sent all relocations. */
+static void _stp_sym_init(void)
+{
+  mutex_lock(&_stp_kmod_sec_index_mutex);
+  _stp_kmod_sec_index_active = 1;
+  _stp_kmod_sec_index_update();
+  mutex_unlock(&_stp_kmod_sec_index_mutex);
+
+  /* Without the cache, lookups just take the slow path. */
+  _stp_sym_cache = _stp_alloc_percpu(sizeof(struct _stp_sym_cache));
+}
+
+static void _stp_sym_exit(void)
+{
+  mutex_lock(&_stp_kmod_sec_index_mutex);
+  _stp_kmod_sec_index_active = 0;
+  _stp_kmod_sec_index_update();
+  mutex_unlock(&_stp_kmod_sec_index_mutex);
+  /* Wait for the pending frees before our module text goes away. */
+  rcu_barrier();
+
+  if (_stp_sym_cache) {
+    _stp_free_percpu(_stp_sym_cache);
+    _stp_sym_cache = NULL;
+  }
+}
+
 /* Return (kernel) module owner and, if sec != NULL, fills in closest
    section of the address if found, return NULL otherwise. */
 static struct _stp_module *_stp_kmod_sec_lookup(unsigned long addr,
 						struct _stp_section **sec)
 {
+  struct _stp_kmod_sec_index *idx;
   unsigned midx = 0;
 
+  rcu_read_lock();
+  idx = rcu_dereference(_stp_kmod_sec_index);
+  if (idx)
+    {
+      struct _stp_module *m = NULL;
+      unsigned begin = 0, end = idx->num_entries;
+
+      while (begin < end)
+	{
+	  unsigned mid = begin + (end - begin) / 2;
+	  struct _stp_kmod_sec_ent *e = &idx->entries[mid];
+	  if (addr < e->addr)
+	    end = mid;
+	  else if (addr - e->addr >= e->size)
+	    begin = mid + 1;
+	  else
+	    {
+	      if (sec)
+		*sec = e->sec;
+	      m = e->mod;
+	      break;
+	    }
+	}
+      rcu_read_unlock();
+      return m;
+    }
+  rcu_read_unlock();
+
   for (midx = 0; midx < _stp_num_modules; midx++)
     {
       unsigned secidx;
@@ -147,18 +338,34 @@ static struct _stp_module *_stp_umod_lookup(unsigned long addr,
   return NULL;
 }
 
-static const char *_stp_kallsyms_lookup(unsigned long addr,
-                                        unsigned long *symbolsize,
-                                        unsigned long *offset, 
-                                        const char **modname, 
-                                        /* char ** secname? */
-					struct task_struct *task)
+/* Decodes one uleb128 value of a compact symbol table. */
+static inline unsigned long _stp_symtab_uleb128(const uint8_t **p)
+{
+	unsigned long val = 0;
+	unsigned shift = 0;
+	uint8_t b;
+
+	do {
+		b = *(*p)++;
+		val |= (unsigned long)(b & 0x7f) << shift;
+		shift += 7;
+	} while (b & 0x80);
+	return val;
+}
+
+static const char *__stp_kallsyms_lookup(unsigned long addr,
+                                         unsigned long *symbolsize,
+                                         unsigned long *offset,
+                                         const char **modname,
+                                         struct task_struct *task)
 {
 	struct _stp_module *m = NULL;
 	struct _stp_section *sec = NULL;
-	struct _stp_symbol *s = NULL;
-	unsigned end, begin = 0;
+	const struct _stp_symtab_restart *r;
+	const uint8_t *p;
+	unsigned end, begin = 0, nres, i, n;
 	unsigned long rel_addr = 0;
+	unsigned long sym_addr, next_addr = 0, name;
 
 	if (addr == 0)
 	  return NULL;
@@ -209,34 +416,109 @@ static const char *_stp_kallsyms_lookup(unsigned long addr,
         
         /* NB: relativize the address to the section. */
         addr = rel_addr;
-	end = sec->num_symbols;
-
-	/* binary search for symbols within the module */
-	do {
+	if (sec->num_symbols == 0)
+		return NULL;
+	nres = (sec->num_symbols + STP_SYMTAB_RESTART - 1) / STP_SYMTAB_RESTART;
+	end = nres;
+
+	/* binary search for the restart point before addr */
+	r = sec->symtab_restarts;
+	if (addr < r[0].addr)
+		return NULL;
+	while (begin + 1 < end) {
 		unsigned mid = (begin + end) / 2;
-		if (addr < sec->symbols[mid].addr)
+		if (addr < r[mid].addr)
 			end = mid;
 		else
 			begin = mid;
-	} while (begin + 1 < end);
+	}
 	/* result index in $begin */
 
-	s = & sec->symbols[begin];
-	if (likely(addr >= s->addr)) {
-		if (offset)
-			*offset = addr - s->addr;
-                /* We could also pass sec->name here. */
-		if (symbolsize) {
-			if ((begin + 1) < sec->num_symbols)
-				*symbolsize = sec->symbols[begin + 1].addr - s->addr;
-			else
-				*symbolsize = 0;
-			// NB: This is only a heuristic.  Sometimes there are large
-			// gaps between text areas of modules.
+	/* then decode the entries following it */
+	n = sec->num_symbols - begin * STP_SYMTAB_RESTART;
+	if (n > STP_SYMTAB_RESTART)
+		n = STP_SYMTAB_RESTART;
+	p = sec->symtab + r[begin].pos;
+	sym_addr = r[begin].addr + _stp_symtab_uleb128(&p);
+	name = _stp_symtab_uleb128(&p);
+	for (i = 1; i < n; i++) {
+		unsigned long next = sym_addr + _stp_symtab_uleb128(&p);
+		unsigned long next_name = _stp_symtab_uleb128(&p);
+		if (addr < next) {
+			next_addr = next;
+			break;
 		}
-		return s->symbol;
+		sym_addr = next;
+		name = next_name;
 	}
-	return NULL;
+	if (i == n && begin + 1 < nres)
+		next_addr = r[begin + 1].addr;
+
+	if (offset)
+		*offset = addr - sym_addr;
+	/* We could also pass sec->name here. */
+	// NB: The size is only a heuristic.  Sometimes there are large
+	// gaps between text areas of modules.
+	if (symbolsize)
+		*symbolsize = next_addr ? next_addr - sym_addr : 0;
+	return sec->symstr + name;
+}
+
+static const char *_stp_kallsyms_lookup(unsigned long addr,
+                                        unsigned long *symbolsize,
+                                        unsigned long *offset, 
+                                        const char **modname, 
+                                        /* char ** secname? */
+					struct task_struct *task)
+{
+	struct _stp_sym_cache_ent *e;
+	const char *symbol;
+	pid_t tgid = task ? task->tgid : 0;
+	unsigned long flags;
+	int gen;
+
+	/* Only cache complete answers; skip NMIs, which could interrupt
+	   an entry update on this cpu. */
+	if (!_stp_sym_cache || !symbolsize || !offset || !modname
+	    || addr == 0 || in_nmi())
+		return __stp_kallsyms_lookup(addr, symbolsize, offset,
+					     modname, task);
+
+	gen = atomic_read(&_stp_sym_cache_gen);
+	preempt_disable();
+	e = _stp_sym_cache_ent(addr, tgid);
+	if (e->addr == addr && e->tgid == tgid && e->gen == gen) {
+		symbol = e->symbol;
+		*symbolsize = e->symbolsize;
+		*offset = e->offset;
+		*modname = e->modname;
+		barrier();
+		/* Recheck, in case an irq refilled it meanwhile. */
+		if (e->addr == addr) {
+			preempt_enable_no_resched();
+			return symbol;
+		}
+	}
+	preempt_enable_no_resched();
+
+	symbol = __stp_kallsyms_lookup(addr, symbolsize, offset, modname, task);
+	if (symbol == NULL)
+		return NULL;
+
+	local_irq_save(flags);
+	e = _stp_sym_cache_ent(addr, tgid);
+	e->addr = 0;
+	barrier();
+	e->tgid = tgid;
+	e->gen = gen;
+	e->symbol = symbol;
+	e->symbolsize = *symbolsize;
+	e->offset = *offset;
+	e->modname = *modname;
+	barrier();
+	e->addr = addr;
+	local_irq_restore(flags);
+	return symbol;
 }
 
 static int _stp_build_id_check (struct _stp_module *m,
@@ -440,6 +722,83 @@ static int _stp_usermodule_check(struct task_struct *tsk, const char *path_name,
 }
 
 
+#ifdef STP_DEFER_SYMBOLS
+/** Tells stapio which user space modules the deferred symbol tokens
+ * refer to, one _STP_SYM_DEFER_MODULE record each.  Called when stapio
+ * asks for deferred symbols, before any probe runs, so these are the
+ * first records in the data stream.
+ */
+static void _stp_defer_symbols_modules(void)
+{
+  static const char hex[] = "0123456789abcdef";
+  char build_id[2 * 64 + 1];
+  unsigned mi;
+  int i, n;
+
+  preempt_disable();
+  for (mi = 0; mi < _stp_num_modules; mi++) {
+    struct _stp_module *m = _stp_modules[mi];
+    if (m->path[0] != '/')
+      continue;
+    n = 0;
+    for (i = 0; i < m->build_id_len && n + 2 < (int)sizeof(build_id); i++) {
+      build_id[n++] = hex[m->build_id_bits[i] >> 4];
+      build_id[n++] = hex[m->build_id_bits[i] & 0xf];
+    }
+    if (n == 0)
+      build_id[n++] = '-';
+    build_id[n] = '\0';
+    _stp_printf(_STP_SYM_DEFER_MODULE "%x:%s:%s" _STP_SYM_DEFER_END,
+		mi, build_id, m->path);
+    _stp_print_flush();
+  }
+  preempt_enable();
+}
+
+/** Leaves the lookup of a user space address to stapio, which has
+ * the full symbol tables at hand; the module only carries the unwind
+ * data of user space modules then.  Prints a _STP_SYM_DEFER_START
+ * token with the flags, the module and the mapping the address is in.
+ * Returns -1 if the address isn't in a known module, or if the token
+ * doesn't fit in str.
+ */
+static int _stp_snprint_deferred_addr(char *str, size_t len,
+				      unsigned long address, int flags,
+				      struct task_struct *task)
+{
+  char tok[64];
+  const char *path = NULL;
+  void *user = NULL;
+  unsigned long vm_start = 0, vm_end = 0;
+  unsigned mi;
+  int n;
+
+#ifdef CONFIG_COMPAT
+  if (test_tsk_thread_flag(task, TIF_32BIT))
+    address &= ((compat_ulong_t) ~0);
+#endif
+  if (stap_find_vma_map_info(task->group_leader, address,
+			     &vm_start, &vm_end, &path, &user) != 0
+      || user == NULL)
+    return -1;
+
+  for (mi = 0; mi < _stp_num_modules; mi++)
+    if (_stp_modules[mi] == user)
+      break;
+  if (mi == _stp_num_modules)
+    return -1;
+
+  /* Never hand out a partial token, stapio couldn't tell where it
+     ends. */
+  n = _stp_snprintf(tok, sizeof(tok), _STP_SYM_DEFER_START "%x:%x:%lx:%lx:%lx"
+		    _STP_SYM_DEFER_END, flags, mi, address, vm_start,
+		    vm_end - vm_start);
+  if (n >= (int)sizeof(tok) || (str && n >= (int)len))
+    return -1;
+  return _stp_snprintf(str, len, "%s", tok);
+}
+#endif /* STP_DEFER_SYMBOLS */
+
 /** Prints an address based on the _STP_SYM flags.
  * @param address The address to lookup.
  * @param task The address to lookup (if NULL lookup kernel/module address).
@@ -453,6 +812,16 @@ static int _stp_snprint_addr(char *str, size_t len, unsigned long address,
   unsigned long offset = 0, size = 0;
   char *exstr, *poststr, *prestr;
 
+#ifdef STP_DEFER_SYMBOLS
+  if (task && (flags & (_STP_SYM_SYMBOL | _STP_SYM_MODULE))) {
+    int rc = _stp_snprint_deferred_addr(str, len, address, flags, task);
+    if (rc >= 0)
+      return rc;
+    /* Unknown module, nothing to look up here either. */
+    flags &= ~(_STP_SYM_SYMBOL | _STP_SYM_MODULE);
+  }
+#endif
+
   prestr = (flags & _STP_SYM_PRE_SPACE) ? " " : "";
   exstr = (((flags & _STP_SYM_INEXACT) && (flags & _STP_SYM_SYMBOL))
 	   ? " (inexact)" : "");
@@ -591,6 +960,12 @@ static int _stp_snprint_addr(char *str, size_t len, unsigned long address,
 static void _stp_print_addr(unsigned long address, int flags,
 			    struct task_struct *task)
 {
+  if (flags & _STP_SYM_RAW) {
+    void *p = _stp_reserve_bytes(sizeof(address));
+    if (p)
+      memcpy(p, &address, sizeof(address));
+    return;
+  }
   _stp_snprint_addr(NULL, 0, address, flags, task);
 }
 
@@ -599,7 +974,9 @@ static void _stp_print_addr(unsigned long address, int flags,
 
 
 /* Update the given module/section's offset value.  Assume that there
-   is no need for locking or for super performance.  NB: this is only
+   is no need for locking or for super performance, other than for
+   replacing the lookup index afterwards, which is only done if an
+   address actually changed.  NB: this is only
    for kernel modules, which exist singly at run time.  User-space
    modules (executables, shared libraries) exist at different
    addresses in different processes, so are tracked in the
@@ -609,6 +986,7 @@ static void _stp_kmodule_update_address(const char* module,
                                         unsigned long address)
 {
   unsigned mi, si;
+  int changed = 0;
         
   for (mi=0; mi<_stp_num_modules; mi++)
     {
@@ -634,13 +1012,23 @@ static void _stp_kmodule_update_address(const char* module,
                        _stp_modules[mi]->name,
                        _stp_modules[mi]->sections[si].name,
                        address);
-              _stp_modules[mi]->sections[si].static_addr = address;
+              if (_stp_modules[mi]->sections[si].static_addr != address) {
+                _stp_modules[mi]->sections[si].static_addr = address;
+                changed = 1;
+              }
 
               if (reloc) break;
               else continue; /* wildcarded - will have more hits */
             }
         } /* loop over sections */
     } /* loop over modules */
+
+  if (!changed)
+    return;
+  atomic_inc(&_stp_sym_cache_gen);
+  mutex_lock(&_stp_kmod_sec_index_mutex);
+  _stp_kmod_sec_index_update();
+  mutex_unlock(&_stp_kmod_sec_index_mutex);
 }
 
 
@@ -35,6 +35,21 @@
 #define _STP_SYM_NEWLINE    256
 /* Adds only module " [`basename name`]" if found, use with _STP_SYM_MODULE. */
 #define _STP_SYM_MODULE_BASENAME 512
+/* Writes the raw address into the print buffer, no formatting at all.
+   Used to collect backtrace addresses, overrides all other flags. */
+#define _STP_SYM_RAW 1024
+
+/* With STP_DEFER_SYMBOLS, user space addresses are printed as a short
+   token that stapio replaces with the symbol (see staprun/symbolize.c):
+   "\036stpsym:flags:module:addr:vm_start:vm_size\036", all in hex, with
+   module the index of the mapped file in _stp_modules.  A token always
+   fits in MAXSTRINGLEN.  stapio learns the modules from records
+   "\036stpmod:module:build-id:path\036" that the runtime writes into the
+   data stream before any probe runs, with a build-id of "-" when it
+   isn't known. */
+#define _STP_SYM_DEFER_START "\036stpsym:"
+#define _STP_SYM_DEFER_MODULE "\036stpmod:"
+#define _STP_SYM_DEFER_END "\036"
 
 /* Used for backtraces in hex string form. */
 #define _STP_SYM_NONE	(_STP_SYM_HEXSTR | _STP_SYM_POST_SPACE)
@@ -52,16 +67,27 @@
 #define _STP_SYM_DATA   (_STP_SYM_SYMBOL | _STP_SYM_MODULE \
 			 | _STP_SYM_OFFSET | _STP_SYM_SIZE)
 
-struct _stp_symbol {
+/* Symbol tables are stored compactly: for every symbol a uleb128
+   address delta to the previous symbol and a uleb128 offset of its name
+   in symstr, in which each distinct name is stored only once.  Every
+   STP_SYMTAB_RESTART symbols there is a restart point with the absolute
+   address and the position in symtab, so lookups can binary search the
+   restart points and then decode at most STP_SYMTAB_RESTART entries.
+   The first entry after a restart point has address delta 0.  */
+#define STP_SYMTAB_RESTART 16
+
+struct _stp_symtab_restart {
 	unsigned long addr;
-	const char *symbol;
+	uint32_t pos;
 };
 
 struct _stp_section {
         const char *name;
         unsigned long static_addr; /* XXX non-null if everywhere the same. */
 	unsigned long size; /* length of the address space module covers. */
-	struct _stp_symbol *symbols;  /* ordered by address */
+	const uint8_t *symtab;  /* ordered by address */
+	const struct _stp_symtab_restart *symtab_restarts;
+	const char *symstr;
   	unsigned num_symbols;
 
 	/* Synthesized index for .debug_frame table, keep section
@@ -105,6 +131,10 @@ static unsigned _stp_num_modules;
 /* load address, fixup by transport symbols _stp_do_relocation */
 static unsigned long _stp_kretprobe_trampoline;
 
+/* Bumped whenever a kernel module section moves or a user vma goes
+   away, which invalidates the symbol lookup cache in sym.c. */
+static atomic_t _stp_sym_cache_gen = ATOMIC_INIT(0);
+
 static unsigned long _stp_kmodule_relocate (const char *module,
 					    const char *section,
 					    unsigned long offset);
@@ -115,5 +145,8 @@ static struct _stp_module *_stp_get_unwind_info (unsigned long addr);
 static void _stp_kmodule_update_address(const char* module,
                                         const char* section,
                                         unsigned long offset);
+#ifdef STP_DEFER_SYMBOLS
+static void _stp_defer_symbols_modules(void);
+#endif
 
 #endif /* _STP_SYM_H_ */
@@ -4,6 +4,7 @@
 #include "stp_utrace.c"
 
 #include <linux/list.h>
+#include <linux/jhash.h>
 #include <linux/binfmts.h>
 #include <linux/mount.h>
 #ifndef STAPCONF_TASK_UID
@@ -15,6 +16,15 @@
 
 static LIST_HEAD(__stp_task_finder_list);
 
+// The targets on __stp_task_finder_list are also hashed on procname,
+// so matching a task's path only has to look at the targets in its
+// bucket, plus the ones without a procname (pid-based or all threads),
+// which are on a list of their own.
+#define __STP_TF_PATH_HASH_BITS 8
+#define __STP_TF_PATH_TABLE_SIZE (1 << __STP_TF_PATH_HASH_BITS)
+static struct hlist_head __stp_tf_path_table[__STP_TF_PATH_TABLE_SIZE];
+static HLIST_HEAD(__stp_tf_pathless_targets);
+
 struct stap_task_finder_target;
 
 #define __STP_TF_UNITIALIZED	0
@@ -73,6 +83,8 @@ typedef int
 struct stap_task_finder_target {
 /* private: */
 	struct list_head list;		/* __stp_task_finder_list linkage */
+	struct hlist_node hash_node;	/* __stp_tf_path_table or
+					 * __stp_tf_pathless_targets linkage */
 	struct list_head callback_list_head;
 	struct list_head callback_list;
 	struct utrace_engine_ops ops;
@@ -91,6 +103,25 @@ struct stap_task_finder_target {
 	stap_task_finder_mprotect_callback mprotect_callback;
 };
 
+// Returns the __stp_tf_path_table bucket of a path.
+static inline struct hlist_head *
+__stp_tf_path_bucket(const char *path, size_t pathlen)
+{
+	return &__stp_tf_path_table[jhash(path, pathlen, 0)
+				    & (__STP_TF_PATH_TABLE_SIZE - 1)];
+}
+
+// Iterates over the targets that can match a task with the given path:
+// the ones hashed to the path's bucket, then the ones without a
+// procname.  Callers still have to compare the procnames.
+#define __stp_tf_for_each_candidate(tgt, node, i, path, pathlen)	\
+	for (i = 0; i < 2; i++)						\
+		hlist_for_each_entry(tgt, node,				\
+				     (i == 0				\
+				      ? __stp_tf_path_bucket(path, pathlen) \
+				      : &__stp_tf_pathless_targets),	\
+				     hash_node)
+
 static LIST_HEAD(__stp_tf_task_work_list);
 static DEFINE_SPINLOCK(__stp_tf_task_work_list_lock);
 struct __stp_tf_task_work {
@@ -269,6 +300,13 @@ stap_register_task_finder_target(struct stap_task_finder_target *new_tgt)
 	if (! found_node) {
 		INIT_LIST_HEAD(&new_tgt->callback_list_head);
 		list_add(&new_tgt->list, &__stp_task_finder_list);
+		if (new_tgt->pathlen > 0)
+			hlist_add_head(&new_tgt->hash_node,
+				       __stp_tf_path_bucket(new_tgt->procname,
+							    new_tgt->pathlen));
+		else
+			hlist_add_head(&new_tgt->hash_node,
+				       &__stp_tf_pathless_targets);
 		tgt = new_tgt;
 	}
 
@@ -803,9 +841,10 @@ __stp_utrace_attach_match_filename(struct task_struct *tsk,
 				   int process_p)
 {
 	size_t filelen;
-	struct list_head *tgt_node;
+	struct hlist_node *tgt_node;
 	struct stap_task_finder_target *tgt;
 	uid_t tsk_euid;
+	int i;
 
 #ifdef STAPCONF_TASK_UID
 	tsk_euid = tsk->euid;
@@ -813,11 +852,9 @@ __stp_utrace_attach_match_filename(struct task_struct *tsk,
 	tsk_euid = task_euid(tsk);
 #endif
 	filelen = strlen(filename);
-	list_for_each(tgt_node, &__stp_task_finder_list) {
+	__stp_tf_for_each_candidate(tgt, tgt_node, i, filename, filelen) {
 		int rc;
 
-		tgt = list_entry(tgt_node, struct stap_task_finder_target,
-				 list);
 		// If we've got a matching procname or we're probing
 		// all threads, we've got a match.  We've got to keep
 		// matching since a single thread could match a
@@ -855,7 +892,7 @@ __stp_utrace_attach_match_filename(struct task_struct *tsk,
 					 __STP_ATTACHED_TASK_EVENTS,
 					 UTRACE_STOP);
 		if (rc != 0 && rc != EPERM)
-			break;
+			return;
 		tgt->engine_attached = 1;
 	}
 }
@@ -1561,7 +1598,9 @@ stap_start_task_finder(void)
 		struct mm_struct *mm;
 		char *mmpath;
 		size_t mmpathlen;
-		struct list_head *tgt_node;
+		struct hlist_node *tgt_node;
+		struct stap_task_finder_target *tgt;
+		int i;
 
 		/* Skip over processes other than that specified with
 		 * stap -c or -x. */
@@ -1617,11 +1656,7 @@ stap_start_task_finder(void)
 		tsk_euid = task_euid(tsk);
 #endif
 		mmpathlen = strlen(mmpath);
-		list_for_each(tgt_node, &__stp_task_finder_list) {
-			struct stap_task_finder_target *tgt;
-
-			tgt = list_entry(tgt_node,
-					 struct stap_task_finder_target, list);
+		__stp_tf_for_each_candidate(tgt, tgt_node, i, mmpath, mmpathlen) {
 			if (tgt == NULL)
 				continue;
 			/* procname-based target */
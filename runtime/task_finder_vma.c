@@ -1,20 +1,25 @@
 #include <linux/list.h>
 #include <linux/jhash.h>
 #include <linux/spinlock.h>
+#include <linux/rcupdate.h>
 
 #include <linux/fs.h>
 #include <linux/dcache.h>
 
-// __stp_tf_vma_lock protects the hash table.
-// Documentation/spinlocks.txt suggest we can be a bit more clever
-// if we guarantee that in interrupt context we only read, not write
-// the datastructures. We should never change the hash table or the
-// contents in interrupt context (which should only ever call 
-// stap_find_vma_map_info for getting stored vma info). So we might
-// want to look into that if this seems a bottleneck.
-static DEFINE_RWLOCK(__stp_tf_vma_lock);
-
-#define __STP_TF_HASH_BITS 4
+// The vma map keeps, per tracked process, an array of its vma entries
+// sorted by vm_start, so lookups are a binary search.  The processes
+// are found through a hash table on pid.
+//
+// Lookups (stap_find_vma_map_info*, called from probe context) don't
+// lock anything, they only run under rcu_read_lock().  Changes are
+// serialized by __stp_tf_vma_lock and never modify an array readers
+// might be looking at: they install a new copy and free the old array,
+// and any removed entries, after an rcu grace period.  The only thing
+// changed in place is the vm_end of an entry, which readers can see
+// either before or after the change.
+static DEFINE_SPINLOCK(__stp_tf_vma_lock);
+
+#define __STP_TF_HASH_BITS 8
 #define __STP_TF_TABLE_SIZE (1 << __STP_TF_HASH_BITS)
 
 #ifndef TASK_FINDER_VMA_ENTRY_PATHLEN
@@ -24,10 +29,11 @@ static DEFINE_RWLOCK(__stp_tf_vma_lock);
 #endif
 
 
+// NB: the rcu head is the first member of all vma map structures, so
+// __stp_tf_vma_free_rcu() can free any of them.
 struct __stp_tf_vma_entry {
-	struct hlist_node hlist;
+	struct rcu_head rcu;
 
-	pid_t pid;
 	unsigned long vm_start;
 	unsigned long vm_end;
         char path[TASK_FINDER_VMA_ENTRY_PATHLEN]; /* mmpath name, if known */
@@ -36,39 +42,69 @@ struct __stp_tf_vma_entry {
 	void *user;
 };
 
+struct __stp_tf_vma_array {
+	struct rcu_head rcu;
+
+	unsigned num;
+	unsigned size;
+	struct __stp_tf_vma_entry *vmas[]; /* ordered by vm_start */
+};
+
+struct __stp_tf_vma_proc {
+	struct rcu_head rcu;
+	struct hlist_node hlist;
+
+	pid_t pid;
+	struct __stp_tf_vma_array *array;
+};
+
 static struct hlist_head *__stp_tf_vma_map;
 
-// __stp_tf_vma_new_entry(): Returns an newly allocated or NULL.
+// __stp_tf_vma_alloc(): Returns newly allocated memory or NULL.
 // Must only be called from user context.
 // ... except, with inode-uprobes / task-finder2, it can be called from
 // random tracepoints.  So we cannot sleep after all.
-static struct __stp_tf_vma_entry *
-__stp_tf_vma_new_entry(void)
+// NB: entries, arrays and procs are freed from an rcu callback, where
+// the DEBUG_MEM _stp_kfree() can't be used, hence plain kmalloc/kfree.
+static void *
+__stp_tf_vma_alloc(size_t size)
 {
-	struct __stp_tf_vma_entry *entry;
-	size_t size = sizeof (struct __stp_tf_vma_entry);
 #ifdef CONFIG_UTRACE
-	entry = (struct __stp_tf_vma_entry *) _stp_kmalloc_gfp(size,
-                                                         STP_ALLOC_SLEEP_FLAGS);
+	return kmalloc(size, STP_ALLOC_SLEEP_FLAGS);
 #else
-	entry = (struct __stp_tf_vma_entry *) _stp_kmalloc_gfp(size,
-                                                               STP_ALLOC_FLAGS);
+	return kmalloc(size, STP_ALLOC_FLAGS);
 #endif
-	return entry;
 }
 
-// __stp_tf_vma_release_entry(): Frees an entry.
+// __stp_tf_vma_new_array(): Returns an empty array with room for
+// size entries, or NULL.
+static struct __stp_tf_vma_array *
+__stp_tf_vma_new_array(unsigned size)
+{
+	struct __stp_tf_vma_array *array;
+
+	array = __stp_tf_vma_alloc(sizeof(*array)
+				   + size * sizeof(array->vmas[0]));
+	if (array != NULL) {
+		array->num = 0;
+		array->size = size;
+	}
+	return array;
+}
+
+// __stp_tf_vma_free_rcu(): Frees an entry, array or proc after the
+// rcu grace period.
 static void
-__stp_tf_vma_release_entry(struct __stp_tf_vma_entry *entry)
+__stp_tf_vma_free_rcu(struct rcu_head *rcu)
 {
-	_stp_kfree (entry);
+	kfree(rcu);
 }
 
-// stap_initialize_vma_map():  Initialize the free list.  Grabs the
-// spinlock.  Should be called before any of the other stap_*_vma_map
-// functions.  Since this is run before any other function is called,
-// this doesn't need any locking.  Should be called from a user context
-// since it can allocate memory.
+// stap_initialize_vma_map():  Initialize the hash table.  Should be
+// called before any of the other stap_*_vma_map functions.  Since this
+// is run before any other function is called, this doesn't need any
+// locking.  Should be called from a user context since it can allocate
+// memory.
 static int
 stap_initialize_vma_map(void)
 {
@@ -84,24 +120,30 @@ stap_initialize_vma_map(void)
 
 // stap_destroy_vma_map(): Unconditionally destroys vma entries.
 // Nothing should be using it anymore. Doesn't lock anything and just
-// frees all items.
+// frees all items, after waiting for the pending rcu frees.
 static void
 stap_destroy_vma_map(void)
 {
+	rcu_barrier();
+
 	if (__stp_tf_vma_map != NULL) {
 		int i;
 		for (i = 0; i < __STP_TF_TABLE_SIZE; i++) {
 			struct hlist_head *head = &__stp_tf_vma_map[i];
 			struct hlist_node *node;
 			struct hlist_node *n;
-			struct __stp_tf_vma_entry *entry = NULL;
+			struct __stp_tf_vma_proc *proc = NULL;
 
 			if (hlist_empty(head))
 				continue;
 
-		        hlist_for_each_entry_safe(entry, node, n, head, hlist) {
-				hlist_del(&entry->hlist);
-				__stp_tf_vma_release_entry(entry);
+		        hlist_for_each_entry_safe(proc, node, n, head, hlist) {
+				unsigned j;
+				hlist_del(&proc->hlist);
+				for (j = 0; j < proc->array->num; j++)
+					kfree(proc->array->vmas[j]);
+				kfree(proc->array);
+				kfree(proc);
 			}
 		}
 		_stp_kfree(__stp_tf_vma_map);
@@ -111,53 +153,62 @@ stap_destroy_vma_map(void)
 
 // __stp_tf_vma_map_hash(): Compute the vma map hash.
 static inline u32
-__stp_tf_vma_map_hash(struct task_struct *tsk)
+__stp_tf_vma_map_hash(pid_t pid)
 {
-    return (jhash_1word(tsk->pid, 0) & (__STP_TF_TABLE_SIZE - 1));
+    return (jhash_1word(pid, 0) & (__STP_TF_TABLE_SIZE - 1));
 }
 
-// Get vma_entry if the vma is present in the vma map hash table.
-// Returns NULL if not present.  The __stp_tf_vma_lock must be read locked
-// before calling this function.
-static struct __stp_tf_vma_entry *
-__stp_tf_get_vma_map_entry_internal(struct task_struct *tsk,
-				    unsigned long vm_start)
+// Get the vma map of a process, or NULL if it has none.
+// The __stp_tf_vma_lock must be held when calling this function.
+static struct __stp_tf_vma_proc *
+__stp_tf_get_vma_proc(pid_t pid)
 {
 	struct hlist_head *head;
 	struct hlist_node *node;
-	struct __stp_tf_vma_entry *entry;
+	struct __stp_tf_vma_proc *proc;
 
-	head = &__stp_tf_vma_map[__stp_tf_vma_map_hash(tsk)];
-	hlist_for_each_entry(entry, node, head, hlist) {
-		if (tsk->pid == entry->pid
-		    && vm_start == entry->vm_start) {
-			return entry;
-		}
+	head = &__stp_tf_vma_map[__stp_tf_vma_map_hash(pid)];
+	hlist_for_each_entry(proc, node, head, hlist) {
+		if (pid == proc->pid)
+			return proc;
 	}
 	return NULL;
 }
 
-// Get vma_entry if the vma with the given vm_end is present in the vma map
-// hash table for the tsk.  Returns NULL if not present.
-// The __stp_tf_vma_lock must be read locked before calling this function.
-static struct __stp_tf_vma_entry *
-__stp_tf_get_vma_map_entry_end_internal(struct task_struct *tsk,
-					unsigned long vm_end)
+// Same as __stp_tf_get_vma_proc(), but for readers, which must be in
+// an rcu read-side critical section instead.
+static struct __stp_tf_vma_proc *
+__stp_tf_get_vma_proc_rcu(pid_t pid)
 {
 	struct hlist_head *head;
 	struct hlist_node *node;
-	struct __stp_tf_vma_entry *entry;
+	struct __stp_tf_vma_proc *proc;
 
-	head = &__stp_tf_vma_map[__stp_tf_vma_map_hash(tsk)];
-	hlist_for_each_entry(entry, node, head, hlist) {
-		if (tsk->pid == entry->pid
-		    && vm_end == entry->vm_end) {
-			return entry;
-		}
+	head = &__stp_tf_vma_map[__stp_tf_vma_map_hash(pid)];
+	hlist_for_each_entry_rcu(proc, node, head, hlist) {
+		if (pid == proc->pid)
+			return proc;
 	}
 	return NULL;
 }
 
+// Returns the index of the last entry in the array that starts at or
+// below addr, or -1 if there is none.
+static int
+__stp_tf_vma_array_find(struct __stp_tf_vma_array *array, unsigned long addr)
+{
+	unsigned begin = 0, end = array->num;
+
+	while (begin < end) {
+		unsigned mid = (begin + end) / 2;
+		if (addr < array->vmas[mid]->vm_start)
+			end = mid;
+		else
+			begin = mid + 1;
+	}
+	return (int) begin - 1;
+}
+
 
 // Add the vma info to the vma map hash table.
 // Caller is responsible for name lifetime.
@@ -168,32 +219,19 @@ stap_add_vma_map_info(struct task_struct *tsk,
 		      unsigned long vm_start, unsigned long vm_end,
 		      const char *path, void *user)
 {
-	struct hlist_head *head;
-	struct hlist_node *node;
 	struct __stp_tf_vma_entry *entry;
-	struct __stp_tf_vma_entry *new_entry;
+	struct __stp_tf_vma_proc *proc, *new_proc = NULL;
+	struct __stp_tf_vma_array *old, *array = NULL;
 	unsigned long flags;
+	unsigned num;
+	int i, rc = 0;
 
-	// Take a write lock, since we are most likely going to write
-	// after reading. But reserve a new entry first outside the lock.
-	new_entry = __stp_tf_vma_new_entry();
-	write_lock_irqsave(&__stp_tf_vma_lock, flags);
-	entry = __stp_tf_get_vma_map_entry_internal(tsk, vm_start);
-	if (entry != NULL) {
-		write_unlock_irqrestore(&__stp_tf_vma_lock, flags);
-		if (new_entry)
-			__stp_tf_vma_release_entry(new_entry);
-		return -EBUSY;	/* Already there */
-	}
-
-	if (!new_entry) {
-		write_unlock_irqrestore(&__stp_tf_vma_lock, flags);
+	// Reserve the new entry first outside the lock.
+	entry = __stp_tf_vma_alloc(sizeof(*entry));
+	if (entry == NULL)
 		return -ENOMEM;
-	}
 
 	// Fill in the info
-	entry = new_entry;
-	entry->pid = tsk->pid;
 	entry->vm_start = vm_start;
 	entry->vm_end = vm_end;
         if (strlen(path) >= TASK_FINDER_VMA_ENTRY_PATHLEN-3)
@@ -208,10 +246,75 @@ stap_add_vma_map_info(struct task_struct *tsk,
           }
 	entry->user = user;
 
-	head = &__stp_tf_vma_map[__stp_tf_vma_map_hash(tsk)];
-	hlist_add_head(&entry->hlist, head);
-	write_unlock_irqrestore(&__stp_tf_vma_lock, flags);
-	return 0;
+	for (;;) {
+		spin_lock_irqsave(&__stp_tf_vma_lock, flags);
+		proc = __stp_tf_get_vma_proc(tsk->pid);
+		old = proc ? proc->array : NULL;
+		num = old ? old->num : 0;
+		i = old ? __stp_tf_vma_array_find(old, vm_start) : -1;
+		if (i >= 0 && old->vmas[i]->vm_start == vm_start) {
+			rc = -EBUSY;	/* Already there */
+			break;
+		}
+		if ((proc || new_proc) && array && array->size > num)
+			break;
+
+		// Not enough reserved (anymore), allocate outside the lock
+		// and try again.
+		spin_unlock_irqrestore(&__stp_tf_vma_lock, flags);
+		if (!proc && !new_proc) {
+			new_proc = __stp_tf_vma_alloc(sizeof(*new_proc));
+			if (new_proc == NULL) {
+				rc = -ENOMEM;
+				goto out;
+			}
+		}
+		if (array)
+			kfree(array);
+		array = __stp_tf_vma_new_array(num + 1);
+		if (array == NULL) {
+			rc = -ENOMEM;
+			goto out;
+		}
+	}
+
+	if (rc == 0) {
+		// Copy the old array with the new entry in place.
+		i++;
+		if (i > 0)
+			memcpy(&array->vmas[0], &old->vmas[0],
+			       i * sizeof(array->vmas[0]));
+		array->vmas[i] = entry;
+		if (num > (unsigned) i)
+			memcpy(&array->vmas[i + 1], &old->vmas[i],
+			       (num - i) * sizeof(array->vmas[0]));
+		array->num = num + 1;
+
+		if (proc) {
+			rcu_assign_pointer(proc->array, array);
+		} else {
+			proc = new_proc;
+			proc->pid = tsk->pid;
+			proc->array = array;
+			hlist_add_head_rcu(&proc->hlist,
+					   &__stp_tf_vma_map[__stp_tf_vma_map_hash(tsk->pid)]);
+			new_proc = NULL;
+		}
+		array = NULL;
+		entry = NULL;
+	}
+	spin_unlock_irqrestore(&__stp_tf_vma_lock, flags);
+	if (rc == 0 && old)
+		call_rcu(&old->rcu, __stp_tf_vma_free_rcu);
+
+out:
+	if (array)
+		kfree(array);
+	if (new_proc)
+		kfree(new_proc);
+	if (entry)
+		kfree(entry);
+	return rc;
 }
 
 // Extend the vma info vm_end in the vma map hash table if there is already
@@ -222,22 +325,20 @@ static int
 stap_extend_vma_map_info(struct task_struct *tsk,
 			 unsigned long vm_start, unsigned long vm_end)
 {
-	struct hlist_head *head;
-	struct hlist_node *node;
-	struct __stp_tf_vma_entry *entry;
-
+	struct __stp_tf_vma_proc *proc;
 	unsigned long flags;
-	int res = -ESRCH; // Entry not there or doesn't match.
-
-	// Take a write lock, since we are most likely going to write
-	// to the entry after reading, if its vm_end matches our vm_start.
-	write_lock_irqsave(&__stp_tf_vma_lock, flags);
-	entry = __stp_tf_get_vma_map_entry_end_internal(tsk, vm_start);
-	if (entry != NULL) {
-		entry->vm_end = vm_end;
-		res = 0;
+	int i, res = -ESRCH; // Entry not there or doesn't match.
+
+	spin_lock_irqsave(&__stp_tf_vma_lock, flags);
+	proc = __stp_tf_get_vma_proc(tsk->pid);
+	if (proc != NULL) {
+		i = __stp_tf_vma_array_find(proc->array, vm_start - 1);
+		if (i >= 0 && proc->array->vmas[i]->vm_end == vm_start) {
+			proc->array->vmas[i]->vm_end = vm_end;
+			res = 0;
+		}
 	}
-	write_unlock_irqrestore(&__stp_tf_vma_lock, flags);
+	spin_unlock_irqrestore(&__stp_tf_vma_lock, flags);
 	return res;
 }
 
@@ -247,22 +348,62 @@ stap_extend_vma_map_info(struct task_struct *tsk,
 static int
 stap_remove_vma_map_info(struct task_struct *tsk, unsigned long vm_start)
 {
-	struct hlist_head *head;
-	struct hlist_node *node;
-	struct __stp_tf_vma_entry *entry;
-	int rc = -ESRCH;
-
-	// Take a write lock since we are most likely going to delete
-	// after reading.
+	struct __stp_tf_vma_entry *entry = NULL;
+	struct __stp_tf_vma_proc *proc;
+	struct __stp_tf_vma_array *old, *array = NULL;
 	unsigned long flags;
-	write_lock_irqsave(&__stp_tf_vma_lock, flags);
-	entry = __stp_tf_get_vma_map_entry_internal(tsk, vm_start);
-	if (entry != NULL) {
-		hlist_del(&entry->hlist);
-		__stp_tf_vma_release_entry(entry);
-                rc = 0;
+	unsigned num = 0;
+	int i, rc = 0;
+
+	for (;;) {
+		spin_lock_irqsave(&__stp_tf_vma_lock, flags);
+		proc = __stp_tf_get_vma_proc(tsk->pid);
+		old = proc ? proc->array : NULL;
+		i = old ? __stp_tf_vma_array_find(old, vm_start) : -1;
+		if (i < 0 || old->vmas[i]->vm_start != vm_start) {
+			rc = -ESRCH;
+			break;
+		}
+		num = old->num;
+		if (num == 1 || (array && array->size >= num - 1))
+			break;
+
+		// Allocate the smaller copy outside the lock and try again.
+		spin_unlock_irqrestore(&__stp_tf_vma_lock, flags);
+		if (array)
+			kfree(array);
+		array = __stp_tf_vma_new_array(num - 1);
+		if (array == NULL)
+			return -ENOMEM;
+	}
+
+	if (rc == 0) {
+		entry = old->vmas[i];
+		if (num == 1) {
+			// The last one, the process goes away as well.
+			hlist_del_rcu(&proc->hlist);
+		} else {
+			memcpy(&array->vmas[0], &old->vmas[0],
+			       i * sizeof(array->vmas[0]));
+			memcpy(&array->vmas[i], &old->vmas[i + 1],
+			       (num - i - 1) * sizeof(array->vmas[0]));
+			array->num = num - 1;
+			rcu_assign_pointer(proc->array, array);
+			array = NULL;
+			proc = NULL;
+		}
+		atomic_inc(&_stp_sym_cache_gen);
 	}
-	write_unlock_irqrestore(&__stp_tf_vma_lock, flags);
+	spin_unlock_irqrestore(&__stp_tf_vma_lock, flags);
+
+	if (rc == 0) {
+		call_rcu(&entry->rcu, __stp_tf_vma_free_rcu);
+		call_rcu(&old->rcu, __stp_tf_vma_free_rcu);
+		if (proc)
+			call_rcu(&proc->rcu, __stp_tf_vma_free_rcu);
+	}
+	if (array)
+		kfree(array);
 	return rc;
 }
 
@@ -275,25 +416,21 @@ stap_find_vma_map_info(struct task_struct *tsk, unsigned long addr,
 		       unsigned long *vm_start, unsigned long *vm_end,
 		       const char **path, void **user)
 {
-	struct hlist_head *head;
-	struct hlist_node *node;
-	struct __stp_tf_vma_entry *entry;
+	struct __stp_tf_vma_proc *proc;
+	struct __stp_tf_vma_array *array;
 	struct __stp_tf_vma_entry *found_entry = NULL;
-	int rc = -ESRCH;
-	unsigned long flags;
+	int i, rc = -ESRCH;
 
 	if (__stp_tf_vma_map == NULL)
 		return rc;
 
-	read_lock_irqsave(&__stp_tf_vma_lock, flags);
-	head = &__stp_tf_vma_map[__stp_tf_vma_map_hash(tsk)];
-	hlist_for_each_entry(entry, node, head, hlist) {
-		if (tsk->pid == entry->pid
-		    && addr >= entry->vm_start
-		    && addr < entry->vm_end) {
-			found_entry = entry;
-			break;
-		}
+	rcu_read_lock();
+	proc = __stp_tf_get_vma_proc_rcu(tsk->pid);
+	if (proc != NULL) {
+		array = rcu_dereference(proc->array);
+		i = __stp_tf_vma_array_find(array, addr);
+		if (i >= 0 && addr < array->vmas[i]->vm_end)
+			found_entry = array->vmas[i];
 	}
 	if (found_entry != NULL) {
 		if (vm_start != NULL)
@@ -306,7 +443,7 @@ stap_find_vma_map_info(struct task_struct *tsk, unsigned long addr,
 			*user = found_entry->user;
 		rc = 0;
 	}
-	read_unlock_irqrestore(&__stp_tf_vma_lock, flags);
+	rcu_read_unlock();
 	return rc;
 }
 
@@ -319,23 +456,24 @@ stap_find_vma_map_info_user(struct task_struct *tsk, void *user,
 			    unsigned long *vm_start, unsigned long *vm_end,
 			    const char **path)
 {
-	struct hlist_head *head;
-	struct hlist_node *node;
-	struct __stp_tf_vma_entry *entry;
+	struct __stp_tf_vma_proc *proc;
+	struct __stp_tf_vma_array *array;
 	struct __stp_tf_vma_entry *found_entry = NULL;
+	unsigned i;
 	int rc = -ESRCH;
-	unsigned long flags;
 
 	if (__stp_tf_vma_map == NULL)
 		return rc;
 
-	read_lock_irqsave(&__stp_tf_vma_lock, flags);
-	head = &__stp_tf_vma_map[__stp_tf_vma_map_hash(tsk)];
-	hlist_for_each_entry(entry, node, head, hlist) {
-		if (tsk->pid == entry->pid
-		    && user == entry->user) {
-			found_entry = entry;
-			break;
+	rcu_read_lock();
+	proc = __stp_tf_get_vma_proc_rcu(tsk->pid);
+	if (proc != NULL) {
+		array = rcu_dereference(proc->array);
+		for (i = 0; i < array->num; i++) {
+			if (user == array->vmas[i]->user) {
+				found_entry = array->vmas[i];
+				break;
+			}
 		}
 	}
 	if (found_entry != NULL) {
@@ -347,27 +485,31 @@ stap_find_vma_map_info_user(struct task_struct *tsk, void *user,
 			*path = found_entry->path;
 		rc = 0;
 	}
-	read_unlock_irqrestore(&__stp_tf_vma_lock, flags);
+	rcu_read_unlock();
 	return rc;
 }
 
 static int
 stap_drop_vma_maps(struct task_struct *tsk)
 {
-	struct hlist_head *head;
-	struct hlist_node *node;
-	struct hlist_node *n;
-	struct __stp_tf_vma_entry *entry;
-
+	struct __stp_tf_vma_proc *proc;
 	unsigned long flags;
-	write_lock_irqsave(&__stp_tf_vma_lock, flags);
-	head = &__stp_tf_vma_map[__stp_tf_vma_map_hash(tsk)];
-        hlist_for_each_entry_safe(entry, node, n, head, hlist) {
-            if (tsk->pid == entry->pid) {
-		    hlist_del(&entry->hlist);
-		    __stp_tf_vma_release_entry(entry);
-            }
-        }
-	write_unlock_irqrestore(&__stp_tf_vma_lock, flags);
+	unsigned i;
+
+	spin_lock_irqsave(&__stp_tf_vma_lock, flags);
+	proc = __stp_tf_get_vma_proc(tsk->pid);
+	if (proc != NULL)
+		hlist_del_rcu(&proc->hlist);
+	atomic_inc(&_stp_sym_cache_gen);
+	spin_unlock_irqrestore(&__stp_tf_vma_lock, flags);
+
+	// Unhashed, so no one else can get to it anymore but the readers.
+	if (proc != NULL) {
+		for (i = 0; i < proc->array->num; i++)
+			call_rcu(&proc->array->vmas[i]->rcu,
+				 __stp_tf_vma_free_rcu);
+		call_rcu(&proc->array->rcu, __stp_tf_vma_free_rcu);
+		call_rcu(&proc->rcu, __stp_tf_vma_free_rcu);
+	}
 	return 0;
 }
@@ -72,6 +72,20 @@ static ssize_t _stp_ctl_write_cmd(struct file *file, const char __user *buf, siz
 		return count + sizeof(u32);
 #else
 		return -EINVAL;
+#endif
+	case STP_PERCPU_STREAM:
+#ifdef STP_RELAY_PERCPU_STREAM
+		return count + sizeof(u32);
+#else
+		return -EINVAL;
+#endif
+	case STP_DEFERRED_SYMBOLS:
+#ifdef STP_DEFER_SYMBOLS
+		if (started == 0)
+			_stp_defer_symbols_modules();
+		return count + sizeof(u32);
+#else
+		return -EINVAL;
 #endif
 	case STP_RELOCATION:
 		if (euid != 0)
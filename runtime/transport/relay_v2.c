@@ -31,25 +31,43 @@
 #include <linux/mm.h>
 #include <linux/relay.h>
 #include <linux/timer.h>
-
-#ifndef STP_RELAY_TIMER_INTERVAL
-/* Wakeup timer interval in jiffies (default 10 ms) */
-#define STP_RELAY_TIMER_INTERVAL		((HZ + 99) / 100)
+#include <linux/seq_file.h>
+#ifdef STAPCONF_IRQ_WORK
+#include <linux/irq_work.h>
 #endif
 
+/* In stream mode the cpus share one global buffer, so stp_print_flush()
+ * has to serialize them with a spinlock.  With -DSTP_RELAY_PERCPU_STREAM,
+ * each cpu writes its own buffer without locking instead, prefixing
+ * every flush with a _stp_trace header as in bulk mode, and stapio
+ * merges the buffers back into one stream in sequence order.  This
+ * needs a stapio that asks for it with STP_PERCPU_STREAM, so it is
+ * left off by default. */
+
 /* Note: if struct _stp_relay_data_type changes, staplog.c might need
  * to be changed. */
 struct _stp_relay_data_type {
 	struct rchan *rchan;
 	atomic_t /* enum _stp_transport_state */ transport_state;
 	struct dentry *dropped_file;
+	struct dentry *dropped_cpu_file;
 	atomic_t dropped;
 	atomic_t wakeup;
 	struct timer_list timer;
+	unsigned long timer_interval;
+	size_t watermark;
+#ifdef STAPCONF_IRQ_WORK
+	struct irq_work wakeup_work;
+#endif
 	int overwrite_flag;
 };
 struct _stp_relay_data_type _stp_relay_data;
 
+/* Full sub-buffers we had to drop, per cpu buffer. */
+static DEFINE_PER_CPU(atomic_t, _stp_relay_cpu_dropped);
+/* Unread sub-buffers overwritten in overwrite (flight recorder) mode. */
+static DEFINE_PER_CPU(atomic_t, _stp_relay_cpu_overwritten);
+
 /* relay_file_operations is const, so .owner is obviously not set there.
  * Below struct, filled in _stp_transport_data_fs_init(), fixes it. */
 static struct file_operations relay_file_operations_w_owner;
@@ -78,7 +96,7 @@ static size_t __stp_relay_switch_subbuf(struct rchan_buf *buf, size_t length)
 		buf->dentry->d_inode->i_size += buf->chan->subbuf_size -
 			buf->padding[old_subbuf];
 		smp_mb();
-		if (waitqueue_active(&buf->read_wait))
+		if (waitqueue_active(&buf->read_wait)) {
 			/*
 			 * Calling wake_up_interruptible() and __mod_timer()
 			 * from here will deadlock if we happen to be logging
@@ -86,6 +104,19 @@ static size_t __stp_relay_switch_subbuf(struct rchan_buf *buf, size_t length)
 			 * rq->lock/timer->base->lock), so just set a flag.
 			 */
 			atomic_set(&_stp_relay_data.wakeup, 1);
+#ifdef STAPCONF_IRQ_WORK
+			/*
+			 * Past the watermark, don't wait for the timer.
+			 * irq_work runs the wakeup once we're out of
+			 * whatever context we are logging from.
+			 */
+			if (buf->subbufs_produced - buf->subbufs_consumed
+			    >= _stp_relay_data.watermark
+			    && atomic_read(&_stp_relay_data.transport_state)
+			    == STP_TRANSPORT_RUNNING)
+				irq_work_queue(&_stp_relay_data.wakeup_work);
+#endif
+		}
 	}
 
 	old = buf->data;
@@ -116,24 +147,70 @@ static void __stp_relay_wakeup_readers(struct rchan_buf *buf)
 		wake_up_interruptible(&buf->read_wait);
 }
 
-static void __stp_relay_wakeup_timer(unsigned long val)
+static void __stp_relay_wakeup_all_readers(void)
 {
-#ifdef STP_BULKMODE
+#if defined(STP_BULKMODE) || defined(STP_RELAY_PERCPU_STREAM)
 	int i;
+
+	for_each_possible_cpu(i)
+		__stp_relay_wakeup_readers(_stp_relay_data.rchan->buf[i]);
+#else
+	__stp_relay_wakeup_readers(_stp_relay_data.rchan->buf[0]);
 #endif
+}
 
-	if (atomic_read(&_stp_relay_data.wakeup)) {
-		atomic_set(&_stp_relay_data.wakeup, 0);
-#ifdef STP_BULKMODE
-		for_each_possible_cpu(i)
-			__stp_relay_wakeup_readers(_stp_relay_data.rchan->buf[i]);
+#ifdef STAPCONF_IRQ_WORK
+static void __stp_relay_wakeup_work(struct irq_work *work)
+{
+	__stp_relay_wakeup_all_readers();
+}
+#endif
+
+/* How much of @buf, in percent, stapio hasn't read yet. */
+static unsigned __stp_relay_buf_used(struct rchan_buf *buf)
+{
+	size_t subbuf_size, unread;
+
+	if (buf == NULL)
+		return 0;
+	subbuf_size = buf->chan->subbuf_size;
+	unread = (buf->subbufs_produced - buf->subbufs_consumed) * subbuf_size;
+	if (buf->offset <= subbuf_size)
+		unread += buf->offset;
+	return __stp_relay_pct(unread, subbuf_size * buf->chan->n_subbufs);
+}
+
+static unsigned __stp_relay_used(void)
+{
+#if defined(STP_BULKMODE) || defined(STP_RELAY_PERCPU_STREAM)
+	unsigned used = 0, u;
+	int i;
+
+	for_each_possible_cpu(i) {
+		u = __stp_relay_buf_used(_stp_relay_data.rchan->buf[i]);
+		if (u > used)
+			used = u;
+	}
+	return used;
 #else
-		__stp_relay_wakeup_readers(_stp_relay_data.rchan->buf[0]);
+	return __stp_relay_buf_used(_stp_relay_data.rchan->buf[0]);
 #endif
+}
+
+static void __stp_relay_wakeup_timer(unsigned long val)
+{
+	if (atomic_read(&_stp_relay_data.wakeup)) {
+		atomic_set(&_stp_relay_data.wakeup, 0);
+		__stp_relay_wakeup_all_readers();
 	}
 
-	if (atomic_read(&_stp_relay_data.transport_state) == STP_TRANSPORT_RUNNING)
-        	mod_timer(&_stp_relay_data.timer, jiffies + STP_RELAY_TIMER_INTERVAL);
+	if (atomic_read(&_stp_relay_data.transport_state) == STP_TRANSPORT_RUNNING) {
+		_stp_relay_data.timer_interval
+			= __stp_relay_next_interval(_stp_relay_data.timer_interval,
+						    __stp_relay_used());
+        	mod_timer(&_stp_relay_data.timer,
+			  jiffies + _stp_relay_data.timer_interval);
+	}
         else
 		dbug_trans(0, "relay_v2 wakeup timer expiry\n");
 }
@@ -141,6 +218,7 @@ static void __stp_relay_wakeup_timer(unsigned long val)
 static void __stp_relay_timer_init(void)
 {
 	atomic_set(&_stp_relay_data.wakeup, 0);
+	_stp_relay_data.timer_interval = STP_RELAY_TIMER_INTERVAL;
 	init_timer(&_stp_relay_data.timer);
 	_stp_relay_data.timer.expires = jiffies + STP_RELAY_TIMER_INTERVAL;
 	_stp_relay_data.timer.function = __stp_relay_wakeup_timer;
@@ -181,18 +259,53 @@ static struct file_operations __stp_relay_dropped_fops = {
 	.read =		__stp_relay_dropped_read,
 };
 
+/* One "cpu dropped overwritten" line per possible cpu. */
+static int __stp_relay_dropped_cpu_show(struct seq_file *m, void *v)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		seq_printf(m, "%d %u %u\n", cpu,
+			   atomic_read(&per_cpu(_stp_relay_cpu_dropped, cpu)),
+			   atomic_read(&per_cpu(_stp_relay_cpu_overwritten, cpu)));
+	return 0;
+}
+
+static int __stp_relay_dropped_cpu_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, __stp_relay_dropped_cpu_show, NULL);
+}
+
+static struct file_operations __stp_relay_dropped_cpu_fops = {
+	.owner =	THIS_MODULE,
+	.open =		__stp_relay_dropped_cpu_open,
+	.read =		seq_read,
+	.llseek =	seq_lseek,
+	.release =	single_release,
+};
+
 /*
  * Keep track of how many times we encountered a full subbuffer, to aid
- * the user space app in telling how many lost events there were.
+ * the user space app in telling how many lost events there were.  In
+ * overwrite mode, the oldest unread subbuffer is reused instead.
  */
 static int __stp_relay_subbuf_start_callback(struct rchan_buf *buf,
 					     void *subbuf, void *prev_subbuf,
 					     size_t prev_padding)
 {
-	if (_stp_relay_data.overwrite_flag || !relay_buf_full(buf))
+	if (_stp_relay_data.overwrite_flag) {
+		/* Unlike relay_buf_full(), this still holds once the
+		 * writer has lapped the reader. */
+		if (buf->subbufs_produced - buf->subbufs_consumed
+		    >= buf->chan->n_subbufs)
+			atomic_inc(&per_cpu(_stp_relay_cpu_overwritten, buf->cpu));
+		return 1;
+	}
+	if (!relay_buf_full(buf))
 		return 1;
 
 	atomic_inc(&_stp_relay_data.dropped);
+	atomic_inc(&per_cpu(_stp_relay_cpu_dropped, buf->cpu));
 	return 0;
 }
 
@@ -223,7 +336,7 @@ __stp_relay_create_buf_file_callback(const char *filename,
 	 * than the default set of per-cpu buffers.
 	 */
 	if (is_global) {
-#ifdef STP_BULKMODE
+#if defined(STP_BULKMODE) || defined(STP_RELAY_PERCPU_STREAM)
 		*is_global = 0;
 #else
 		*is_global = 1;
@@ -260,6 +373,9 @@ static void _stp_transport_data_fs_stop(void)
 	if (atomic_read (&_stp_relay_data.transport_state) == STP_TRANSPORT_RUNNING) {
 		atomic_set (&_stp_relay_data.transport_state, STP_TRANSPORT_STOPPED);
 		del_timer_sync(&_stp_relay_data.timer);
+#ifdef STAPCONF_IRQ_WORK
+		irq_work_sync(&_stp_relay_data.wakeup_work);
+#endif
 		dbug_trans(0, "flushing...\n");
 		if (_stp_relay_data.rchan)
 			relay_flush(_stp_relay_data.rchan);
@@ -269,6 +385,12 @@ static void _stp_transport_data_fs_stop(void)
 static void _stp_transport_data_fs_close(void)
 {
 	_stp_transport_data_fs_stop();
+#ifdef STAPCONF_IRQ_WORK
+	/* Writers may still have queued a wakeup after the stop. */
+	irq_work_sync(&_stp_relay_data.wakeup_work);
+#endif
+	if (_stp_relay_data.dropped_cpu_file)
+		debugfs_remove(_stp_relay_data.dropped_cpu_file);
 	if (_stp_relay_data.dropped_file)
 		debugfs_remove(_stp_relay_data.dropped_file);
 	if (_stp_relay_data.rchan) {
@@ -279,15 +401,26 @@ static void _stp_transport_data_fs_close(void)
 
 static int _stp_transport_data_fs_init(void)
 {
-	int rc;
+	int rc, cpu;
 	u64 npages;
 	struct sysinfo si;
 
 	atomic_set(&_stp_relay_data.transport_state, STP_TRANSPORT_STOPPED);
 	_stp_relay_data.overwrite_flag = 0;
 	atomic_set(&_stp_relay_data.dropped, 0);
+	for_each_possible_cpu(cpu) {
+		atomic_set(&per_cpu(_stp_relay_cpu_dropped, cpu), 0);
+		atomic_set(&per_cpu(_stp_relay_cpu_overwritten, cpu), 0);
+	}
 	_stp_relay_data.dropped_file = NULL;
+	_stp_relay_data.dropped_cpu_file = NULL;
 	_stp_relay_data.rchan = NULL;
+	_stp_relay_data.watermark = _stp_nsubbufs * STP_RELAY_WAKEUP_WATERMARK / 100;
+	if (_stp_relay_data.watermark == 0)
+		_stp_relay_data.watermark = 1;
+#ifdef STAPCONF_IRQ_WORK
+	init_irq_work(&_stp_relay_data.wakeup_work, __stp_relay_wakeup_work);
+#endif
 
 	/* Create "dropped" file. */
 	_stp_relay_data.dropped_file
@@ -306,9 +439,33 @@ static int _stp_transport_data_fs_init(void)
 	_stp_relay_data.dropped_file->d_inode->i_uid = _stp_uid;
 	_stp_relay_data.dropped_file->d_inode->i_gid = _stp_gid;
 
+	/* Create "dropped_cpu" file. */
+	_stp_relay_data.dropped_cpu_file
+		= debugfs_create_file("dropped_cpu", 0400, _stp_get_module_dir(),
+				      NULL, &__stp_relay_dropped_cpu_fops);
+	if (!_stp_relay_data.dropped_cpu_file) {
+		rc = -EIO;
+		goto err;
+	}
+	else if (IS_ERR(_stp_relay_data.dropped_cpu_file)) {
+		rc = PTR_ERR(_stp_relay_data.dropped_cpu_file);
+		_stp_relay_data.dropped_cpu_file = NULL;
+		goto err;
+	}
+
+	_stp_relay_data.dropped_cpu_file->d_inode->i_uid = _stp_uid;
+	_stp_relay_data.dropped_cpu_file->d_inode->i_gid = _stp_gid;
+
+#if defined(STP_BULKMODE) || defined(STP_RELAY_PERCPU_STREAM)
+	/* A full print buffer goes out as one record with its header, and
+	 * relay never splits a reservation across sub-buffers. */
+	if (_stp_subbuf_size < STP_BUFFER_SIZE + sizeof(struct _stp_trace))
+		_stp_subbuf_size = STP_BUFFER_SIZE + sizeof(struct _stp_trace);
+#endif
+
 	/* Create "trace" file. */
 	npages = _stp_subbuf_size * _stp_nsubbufs;
-#ifdef STP_BULKMODE
+#if defined(STP_BULKMODE) || defined(STP_RELAY_PERCPU_STREAM)
 	npages *= num_online_cpus();
 #endif
 	npages >>= PAGE_SHIFT;
@@ -347,7 +504,7 @@ static int _stp_transport_data_fs_init(void)
         {
                 u64 relay_mem;
                 relay_mem = _stp_subbuf_size * _stp_nsubbufs;
-#ifdef STP_BULKMODE
+#if defined(STP_BULKMODE) || defined(STP_RELAY_PERCPU_STREAM)
                 relay_mem *= num_online_cpus();
 #endif
                 _stp_allocated_net_memory += relay_mem;
@@ -3,10 +3,21 @@
 #include <linux/wait.h>
 #include <linux/poll.h>
 #include <linux/cpumask.h>
+#include <linux/seq_file.h>
 #include <asm/local.h>
+#ifdef STAPCONF_IRQ_WORK
+#include <linux/irq_work.h>
+#endif
 
 static DEFINE_PER_CPU(local_t, _stp_cpu_disabled);
 
+/* Bytes committed but not yet consumed, and events we could not
+ * reserve space for, per cpu buffer. */
+static DEFINE_PER_CPU(atomic_long_t, _stp_cpu_pending);
+static DEFINE_PER_CPU(atomic_t, _stp_cpu_dropped);
+/* Unread events thrown away to make room in overwrite mode. */
+static DEFINE_PER_CPU(atomic_t, _stp_cpu_overwritten);
+
 static inline void _stp_ring_buffer_disable_cpu(void)
 {
 	preempt_disable();
@@ -24,11 +35,6 @@ static inline int _stp_ring_buffer_cpu_disabled(void)
     return local_read(&__get_cpu_var(_stp_cpu_disabled));
 }
 
-#ifndef STP_RELAY_TIMER_INTERVAL
-/* Wakeup timer interval in jiffies (default 10 ms) */
-#define STP_RELAY_TIMER_INTERVAL		((HZ + 99) / 100)
-#endif
-
 struct _stp_data_entry {
 	size_t			len;
 	unsigned char		buf[];
@@ -61,6 +67,12 @@ struct _stp_relay_data_type {
 	struct _stp_iterator iter[NR_ITERS];
 	cpumask_var_t trace_reader_cpumask;
 	struct timer_list timer;
+	unsigned long timer_interval;
+	long watermark;
+	unsigned long cpu_size;	/* bytes per cpu buffer */
+#ifdef STAPCONF_IRQ_WORK
+	struct irq_work wakeup_work;
+#endif
 	int overwrite_flag;
 };
 static struct _stp_relay_data_type _stp_relay_data;
@@ -98,6 +110,8 @@ static int __stp_alloc_ring_buffer(void)
 	 * we need to divide buffer_size by the number of cpus. */
 	buffer_size /= num_online_cpus();
 	dbug_trans(1, "%lu\n", buffer_size);
+	_stp_relay_data.cpu_size = buffer_size;
+	_stp_relay_data.watermark = buffer_size / 100 * STP_RELAY_WAKEUP_WATERMARK;
 	_stp_relay_data.rb = ring_buffer_alloc(buffer_size, 0);
 	if (!_stp_relay_data.rb)
 		goto fail;
@@ -265,8 +279,10 @@ static void _stp_ring_buffer_iterator_increment(struct _stp_iterator *iter)
 	}
 }
 
-static void _stp_ring_buffer_consume(struct _stp_iterator *iter)
+static void _stp_ring_buffer_consume(struct _stp_iterator *iter, size_t len)
 {
+	atomic_long_sub(sizeof(struct _stp_data_entry) + len,
+			&per_cpu(_stp_cpu_pending, iter->cpu));
 	_stp_ring_buffer_iterator_increment(iter);
 	_stp_ring_buffer_disable_cpu();
 #ifdef STAPCONF_RING_BUFFER_LOST_EVENTS
@@ -493,7 +509,7 @@ _stp_data_read_trace(struct file *filp, char __user *ubuf,
 		if (len <= 0)
 			break;
 
-		_stp_ring_buffer_consume(iter);
+		_stp_ring_buffer_consume(iter, len);
 		dbug_trans(1, "event consumed\n");
 		ubuf += len;
 		cnt -= len;
@@ -586,6 +602,7 @@ _stp_data_write_reserve(size_t size_request, void **entry)
 
 	if (_stp_ring_buffer_cpu_disabled()) {
 		dbug_trans(0, "cpu disabled\n");
+		atomic_inc(&__get_cpu_var(_stp_cpu_dropped));
 		entry = NULL;
 		return 0;
 	}
@@ -603,6 +620,7 @@ _stp_data_write_reserve(size_t size_request, void **entry)
 	if (unlikely(! event)) {
 		dbug_trans(0, "event = NULL (%p)?\n", event);
 		if (! _stp_relay_data.overwrite_flag) {
+			atomic_inc(&__get_cpu_var(_stp_cpu_dropped));
 			entry = NULL;
 			return 0;
 		}
@@ -623,7 +641,8 @@ _stp_data_write_reserve(size_t size_request, void **entry)
 			sde = ring_buffer_event_data(event);
 			if (sde->len < size_request)
 				size_request = sde->len;
-			_stp_ring_buffer_consume(iter);
+			atomic_inc(&per_cpu(_stp_cpu_overwritten, iter->cpu));
+			_stp_ring_buffer_consume(iter, sde->len);
 			_stp_buffer_iter_finish(iter);
 
 			/* Try to reserve again. */
@@ -669,6 +688,7 @@ static unsigned char *_stp_data_entry_data(void *entry)
 static int _stp_data_write_commit(void *entry)
 {
 	struct ring_buffer_event *event = (struct ring_buffer_event *)entry;
+	long len, pending;
 
 	if (unlikely(! entry)) {
 		dbug_trans(1, "entry = NULL, returning -EINVAL\n");
@@ -684,6 +704,21 @@ static int _stp_data_write_commit(void *entry)
 #endif
 	atomic_inc(&(_stp_get_iterator()->nr_events));
 
+	len = sizeof(struct _stp_data_entry)
+		+ ((struct _stp_data_entry *)ring_buffer_event_data(event))->len;
+	pending = atomic_long_add_return(len, &__get_cpu_var(_stp_cpu_pending));
+#ifdef STAPCONF_IRQ_WORK
+	/*
+	 * Waking the reader from here could deadlock on the scheduler's
+	 * locks (see relay_v2.c), so when this write crosses the
+	 * watermark leave the wakeup to irq_work.
+	 */
+	if (pending >= _stp_relay_data.watermark
+	    && pending - len < _stp_relay_data.watermark
+	    && atomic_read(&_stp_relay_data.transport_state) == STP_TRANSPORT_RUNNING)
+		irq_work_queue(&_stp_relay_data.wakeup_work);
+#endif
+
 #ifdef STAPCONF_RING_BUFFER_FLAGS
 	return ring_buffer_unlock_commit(_stp_relay_data.rb, event, 0);
 #else
@@ -691,18 +726,48 @@ static int _stp_data_write_commit(void *entry)
 #endif
 }
 
+#ifdef STAPCONF_IRQ_WORK
+static void __stp_relay_wakeup_work(struct irq_work *work)
+{
+	if (waitqueue_active(&_stp_poll_wait))
+		wake_up_interruptible(&_stp_poll_wait);
+}
+#endif
+
+/* How much of the fullest cpu buffer, in percent, is still unread. */
+static unsigned __stp_relay_used(void)
+{
+	unsigned used = 0, u;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		long pending = atomic_long_read(&per_cpu(_stp_cpu_pending, cpu));
+
+		u = pending > 0 ? __stp_relay_pct(pending, _stp_relay_data.cpu_size) : 0;
+		if (u > used)
+			used = u;
+	}
+	return used;
+}
+
 static void __stp_relay_wakeup_timer(unsigned long val)
 {
 	if (waitqueue_active(&_stp_poll_wait) && ! _stp_ring_buffer_empty())
 		wake_up_interruptible(&_stp_poll_wait);
-	if (atomic_read(&_stp_relay_data.transport_state) == STP_TRANSPORT_RUNNING)
-        	mod_timer(&_stp_relay_data.timer, jiffies + STP_RELAY_TIMER_INTERVAL);
+	if (atomic_read(&_stp_relay_data.transport_state) == STP_TRANSPORT_RUNNING) {
+		_stp_relay_data.timer_interval
+			= __stp_relay_next_interval(_stp_relay_data.timer_interval,
+						    __stp_relay_used());
+        	mod_timer(&_stp_relay_data.timer,
+			  jiffies + _stp_relay_data.timer_interval);
+	}
         else
 		dbug_trans(0, "ring_buffer wakeup timer expiry\n");
 }
 
 static void __stp_relay_timer_start(void)
 {
+	_stp_relay_data.timer_interval = STP_RELAY_TIMER_INTERVAL;
 	init_timer(&_stp_relay_data.timer);
 	_stp_relay_data.timer.expires = jiffies + STP_RELAY_TIMER_INTERVAL;
 	_stp_relay_data.timer.function = __stp_relay_wakeup_timer;
@@ -714,9 +779,38 @@ static void __stp_relay_timer_start(void)
 static void __stp_relay_timer_stop(void)
 {
 	del_timer_sync(&_stp_relay_data.timer);
+#ifdef STAPCONF_IRQ_WORK
+	irq_work_sync(&_stp_relay_data.wakeup_work);
+#endif
+}
+
+/* One "cpu dropped overwritten" line per possible cpu. */
+static int __stp_dropped_cpu_show(struct seq_file *m, void *v)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		seq_printf(m, "%d %u %u\n", cpu,
+			   atomic_read(&per_cpu(_stp_cpu_dropped, cpu)),
+			   atomic_read(&per_cpu(_stp_cpu_overwritten, cpu)));
+	return 0;
+}
+
+static int __stp_dropped_cpu_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, __stp_dropped_cpu_show, NULL);
 }
 
+static struct file_operations __stp_dropped_cpu_fops = {
+	.owner		= THIS_MODULE,
+	.open		= __stp_dropped_cpu_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 static struct dentry *__stp_entry[NR_CPUS] = { NULL };
+static struct dentry *__stp_dropped_cpu_entry = NULL;
 
 static int _stp_transport_data_fs_init(void)
 {
@@ -725,6 +819,14 @@ static int _stp_transport_data_fs_init(void)
 
 	atomic_set (&_stp_relay_data.transport_state, STP_TRANSPORT_STOPPED);
 	_stp_relay_data.rb = NULL;
+	for_each_possible_cpu(cpu) {
+		atomic_long_set(&per_cpu(_stp_cpu_pending, cpu), 0);
+		atomic_set(&per_cpu(_stp_cpu_dropped, cpu), 0);
+		atomic_set(&per_cpu(_stp_cpu_overwritten, cpu), 0);
+	}
+#ifdef STAPCONF_IRQ_WORK
+	init_irq_work(&_stp_relay_data.wakeup_work, __stp_relay_wakeup_work);
+#endif
 
 	// allocate buffer
 	dbug_trans(1, "entry...\n");
@@ -783,6 +885,21 @@ static int _stp_transport_data_fs_init(void)
 #endif
 	}
 
+	__stp_dropped_cpu_entry = debugfs_create_file("dropped_cpu", 0400,
+						      _stp_get_module_dir(),
+						      NULL,
+						      &__stp_dropped_cpu_fops);
+	if (!__stp_dropped_cpu_entry || IS_ERR(__stp_dropped_cpu_entry)) {
+		rc = __stp_dropped_cpu_entry
+			? PTR_ERR(__stp_dropped_cpu_entry) : -ENOENT;
+		__stp_dropped_cpu_entry = NULL;
+		pr_warning("Could not create debugfs 'dropped_cpu' entry\n");
+		_stp_transport_data_fs_close();
+		return rc;
+	}
+	__stp_dropped_cpu_entry->d_inode->i_uid = _stp_uid;
+	__stp_dropped_cpu_entry->d_inode->i_gid = _stp_gid;
+
 	dbug_trans(1, "returning 0...\n");
 	atomic_set (&_stp_relay_data.transport_state, STP_TRANSPORT_INITIALIZED);
 	return 0;
@@ -808,6 +925,12 @@ static void _stp_transport_data_fs_close(void)
 {
 	int cpu;
 
+#ifdef STAPCONF_IRQ_WORK
+	irq_work_sync(&_stp_relay_data.wakeup_work);
+#endif
+	if (__stp_dropped_cpu_entry)
+		debugfs_remove(__stp_dropped_cpu_entry);
+	__stp_dropped_cpu_entry = NULL;
 	for_each_possible_cpu(cpu) {
 		if (__stp_entry[cpu])
 			debugfs_remove(__stp_entry[cpu]);
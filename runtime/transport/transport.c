@@ -53,6 +53,12 @@ static DEFINE_MUTEX(_stp_transport_mutex);
 #define STP_TRANSPORT_VERSION 2
 #endif
 
+// Per-cpu stream buffers are only implemented by relay_v2.c, and bulk
+// mode has per-cpu buffers of its own.
+#if STP_TRANSPORT_VERSION != 2 || defined(STP_BULKMODE)
+#undef STP_RELAY_PERCPU_STREAM
+#endif
+
 #include "control.h"
 #if STP_TRANSPORT_VERSION == 1
 #include "relayfs.c"
@@ -119,6 +125,11 @@ static void _stp_handle_start(struct _stp_msg_start *st)
 #endif
 
 		_stp_target = st->target;
+		/* staprun has sent all relocations by now. */
+		_stp_sym_init();
+#ifdef STP_USE_DWARF_UNWINDER
+		_stp_unwind_cache_init();
+#endif
 		st->res = systemtap_module_init();
 		if (st->res == 0)
 			_stp_probes_started = 1;
@@ -293,6 +304,10 @@ static void _stp_transport_close(void)
 	dbug_trans(1, "%d: ************** transport_close *************\n",
 		   current->pid);
 	_stp_cleanup_and_exit(0);
+	_stp_sym_exit();
+#ifdef STP_USE_DWARF_UNWINDER
+	_stp_unwind_cache_exit();
+#endif
 	_stp_unregister_ctl_channel();
 	_stp_transport_fs_close();
 	_stp_print_cleanup();	/* free print buffers */
@@ -20,6 +20,58 @@
 #define STP_CTL_BUFFER_SIZE 256
 #endif
 
+#ifndef STP_RELAY_TIMER_INTERVAL
+/* Wakeup timer interval in jiffies (default 10 ms) */
+#define STP_RELAY_TIMER_INTERVAL		((HZ + 99) / 100)
+#endif
+
+#ifndef STP_RELAY_TIMER_MAX_INTERVAL
+/* While little or no data arrives, the wakeup timer interval grows up
+ * to this many jiffies (default 32 * STP_RELAY_TIMER_INTERVAL, about
+ * 320 ms). */
+#define STP_RELAY_TIMER_MAX_INTERVAL		(32 * STP_RELAY_TIMER_INTERVAL)
+#endif
+
+#ifndef STP_RELAY_WAKEUP_WATERMARK
+/* Percentage of a per-cpu buffer that, once filled, makes the writer
+ * wake the reader right away instead of waiting for the timer.  This
+ * needs irq_work; without it the timer drops back to its shortest
+ * interval on its next run. */
+#define STP_RELAY_WAKEUP_WATERMARK		50
+#endif
+
+/* Next wakeup timer interval, given the percentage of the fullest
+ * per-cpu buffer that was found unread after the last one.  While
+ * nothing is unread, back off exponentially.  Otherwise, take the
+ * interval in which the buffer would fill to half the wakeup watermark
+ * at the rate just seen. */
+static inline unsigned long __stp_relay_next_interval(unsigned long interval,
+						      unsigned used_pct)
+{
+	unsigned long next;
+
+	if (interval < STP_RELAY_TIMER_INTERVAL)
+		interval = STP_RELAY_TIMER_INTERVAL;
+	if (used_pct == 0)
+		next = interval * 2;
+	else
+		next = interval * STP_RELAY_WAKEUP_WATERMARK / (2 * used_pct);
+	if (next < STP_RELAY_TIMER_INTERVAL)
+		return STP_RELAY_TIMER_INTERVAL;
+	if (next > STP_RELAY_TIMER_MAX_INTERVAL)
+		return STP_RELAY_TIMER_MAX_INTERVAL;
+	return next;
+}
+
+/* @used out of @size as a percentage, without overflowing for large
+ * buffers. */
+static inline unsigned __stp_relay_pct(unsigned long used, unsigned long size)
+{
+	if (used >= size)
+		return 100;
+	return used / (size / 100 + 1);
+}
+
 static unsigned _stp_nsubbufs;
 static unsigned _stp_subbuf_size;
 static pid_t _stp_target;
@@ -83,6 +83,16 @@ enum
 	/** Send by staprun to notify module of remote identity, if any.
             Only send once at startup.  */
         STP_REMOTE_ID,
+	/** Send by stapio after a failed STP_BULK.  Absorbed by the module
+	    if its stream mode output comes through percpu files, with a
+	    struct _stp_trace header before each flush, that stapio has to
+	    merge in sequence order.  Otherwise returns -EINVAL.  */
+	STP_PERCPU_STREAM,
+	/** Send by stapio at startup.  Absorbed by the module if it was
+	    translated with --defer-symbols (STP_DEFER_SYMBOLS), so prints
+	    user space addresses as tokens for stapio to symbolize.
+	    Otherwise returns -EINVAL.  */
+	STP_DEFERRED_SYMBOLS,
 	/** Max number of message types, sanity check only.  */
 	STP_MAX_CMD
 };
@@ -106,6 +116,8 @@ static const char *_stp_command_name[] = {
 	"STP_TZINFO",
 	"STP_PRIVILEGE_CREDENTIALS",
 	"STP_REMOTE_ID",
+	"STP_PERCPU_STREAM",
+	"STP_DEFERRED_SYMBOLS",
 };
 #endif /* DEBUG_TRANS */
 
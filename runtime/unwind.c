@@ -755,6 +755,49 @@ adjustStartLoc (unsigned long startLoc,
     return startLoc + vm_addr - s->sec_load_offset;
 }
 
+/* Binary search for the FDE of pc in the translator's compact index. */
+static u32 *_stp_search_unwind_index(unsigned long pc,
+				     struct _stp_module *m,
+				     struct _stp_section *s,
+				     const struct _stp_unwind_index *idx,
+				     uint32_t idx_len,
+				     int is_ehframe, int user)
+{
+	unsigned long bias, base, delta;
+	unsigned lo, hi;
+
+	if (idx_len < sizeof(*idx) || idx->num == 0
+	    || idx_len != sizeof(*idx) + idx->num * sizeof(idx->entries[0])) {
+		_stp_warn("bad unwind index\n");
+		return NULL;
+	}
+
+	/* adjustStartLoc() just adds the load address of the module
+	   (0 means no address at all), so only look that up once. */
+	bias = adjustStartLoc(1, m, s, DW_EH_PE_absptr, is_ehframe, user) - 1;
+	base = (unsigned long)idx->base + bias;
+	if (pc < base)
+		return NULL;
+	delta = pc - base;
+
+	/* Find the last entry starting at or before pc. */
+	lo = 0;
+	hi = idx->num;
+	while (hi - lo > 1) {
+		unsigned mid = lo + (hi - lo) / 2;
+		if (idx->entries[mid].start <= delta)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	if (idx->entries[lo].start > delta)
+		return NULL;
+
+	dbug_unwind(1, "index fde off=%x\n", idx->entries[lo].fde);
+	return (u32 *)((is_ehframe ? (u8 *)m->eh_frame : (u8 *)m->debug_frame)
+		       + idx->entries[lo].fde);
+}
+
 /* If we previously created an unwind header, then use it now to binary search */
 /* for the FDE corresponding to pc. */
 static u32 *_stp_search_unwind_hdr(unsigned long pc,
@@ -769,6 +812,11 @@ static u32 *_stp_search_unwind_hdr(unsigned long pc,
 	unsigned num, tableSize, t2;
 	unsigned long eh_hdr_addr = m->unwind_hdr_addr;
 
+	if (hdr != NULL && hdr_len >= 4 && hdr[0] == STP_UNWIND_INDEX_VERSION)
+		return _stp_search_unwind_index(pc, m, s,
+						(const struct _stp_unwind_index *)hdr,
+						hdr_len, is_ehframe, user);
+
 	if (hdr == NULL || hdr_len < 4 || hdr[0] != 1) {
 		_stp_warn("no or bad debug frame hdr\n");
 		return NULL;
@@ -1140,6 +1188,139 @@ divzero:
 #undef	POP
 }
 
+/* Per-cpu cache of the register rules unwind_frame() found for a pc,
+   so that unwinding through the same call sites again, the normal case
+   when profiling, skips the FDE search and the CFI interpretation.
+   Entries are keyed by unwind table, pc and tgid (0 for the kernel),
+   and only valid for the _stp_sym_cache_gen they were filled in. */
+#ifndef STP_UNWIND_CACHE_BITS
+#define STP_UNWIND_CACHE_BITS 5
+#endif
+
+struct _stp_unwind_cache_ent {
+	void *table;		/* NULL while unused */
+	unsigned long pc;
+	pid_t tgid;
+	int gen;
+	int res;		/* unwind_frame() result if not 0 */
+	signed call_frame;
+	uleb128_t retAddrReg;
+	struct unwind_reg_state rules;
+};
+
+struct _stp_unwind_cache {
+	struct _stp_unwind_cache_ent entries[1 << STP_UNWIND_CACHE_BITS];
+};
+
+static struct _stp_unwind_cache *_stp_unwind_cache = NULL;
+
+#ifdef STP_TIMING
+static atomic_t _stp_unwind_cache_hits = ATOMIC_INIT(0);
+static atomic_t _stp_unwind_cache_misses = ATOMIC_INIT(0);
+#endif
+
+static void _stp_unwind_cache_init(void)
+{
+	/* Without the cache, every frame takes the slow path. */
+	_stp_unwind_cache = _stp_alloc_percpu(sizeof(struct _stp_unwind_cache));
+}
+
+static void _stp_unwind_cache_exit(void)
+{
+	if (_stp_unwind_cache) {
+		_stp_free_percpu(_stp_unwind_cache);
+		_stp_unwind_cache = NULL;
+	}
+}
+
+#ifdef STP_TIMING
+static void _stp_unwind_cache_report(void)
+{
+	int hits = atomic_read(&_stp_unwind_cache_hits);
+	int misses = atomic_read(&_stp_unwind_cache_misses);
+
+	if (hits || misses)
+		_stp_printf("unwind cache: hits: %d, misses: %d\n",
+			    hits, misses);
+}
+#endif
+
+static inline struct _stp_unwind_cache_ent *
+_stp_unwind_cache_ent(void *table, unsigned long pc, pid_t tgid)
+{
+	return &per_cpu_ptr(_stp_unwind_cache, smp_processor_id())
+		->entries[hash_long(pc ^ (unsigned long)table ^ tgid,
+				    STP_UNWIND_CACHE_BITS)];
+}
+
+/* Looks up the rules for pc, filling in state->reg[0] on a hit.
+   Returns 1 on a hit, with the unwind_frame() result in *res. */
+static int _stp_unwind_cache_get(void *table, unsigned long pc, int user,
+				 int gen, struct unwind_state *state,
+				 uleb128_t *retAddrReg, signed *call_frame,
+				 int *res)
+{
+	struct _stp_unwind_cache_ent *e;
+	pid_t tgid = user ? current->tgid : 0;
+	unsigned long flags;
+	int hit = 0;
+
+	/* NMIs could interrupt an entry update on this cpu. */
+	if (!_stp_unwind_cache || in_nmi())
+		return 0;
+
+	/* Interrupts off, so no probe on this cpu refills the entry
+	   while it is being copied. */
+	local_irq_save(flags);
+	e = _stp_unwind_cache_ent(table, pc, tgid);
+	if (e->table == table && e->pc == pc && e->tgid == tgid
+	    && e->gen == gen) {
+		*res = e->res;
+		if (e->res == 0) {
+			state->stackDepth = 0;
+			memcpy(&state->reg[0], &e->rules, sizeof(e->rules));
+			*retAddrReg = e->retAddrReg;
+			*call_frame = e->call_frame;
+		}
+		hit = 1;
+	}
+	local_irq_restore(flags);
+
+#ifdef STP_TIMING
+	atomic_inc(hit ? &_stp_unwind_cache_hits : &_stp_unwind_cache_misses);
+#endif
+	return hit;
+}
+
+/* Remembers the rules in REG_STATE, or just the result if res != 0. */
+static void _stp_unwind_cache_put(void *table, unsigned long pc, int user,
+				  int gen, const struct unwind_state *state,
+				  uleb128_t retAddrReg, signed call_frame,
+				  int res)
+{
+	struct _stp_unwind_cache_ent *e;
+	pid_t tgid = user ? current->tgid : 0;
+	unsigned long flags;
+
+	if (!_stp_unwind_cache || in_nmi())
+		return;
+
+	local_irq_save(flags);
+	e = _stp_unwind_cache_ent(table, pc, tgid);
+	e->table = table;
+	e->pc = pc;
+	e->tgid = tgid;
+	e->gen = gen;
+	e->res = res;
+	if (res == 0) {
+		memcpy(&e->rules, &state->reg[state->stackDepth],
+		       sizeof(e->rules));
+		e->retAddrReg = retAddrReg;
+		e->call_frame = call_frame;
+	}
+	local_irq_restore(flags);
+}
+
 /* Unwind to previous to frame.  Returns 0 if successful, negative
  * number in case of an error.  A positive return means unwinding is finished;
  * don't try to fallback to dumping addresses on the stack. */
@@ -1161,6 +1342,8 @@ static int unwind_frame(struct unwind_context *context,
 	uleb128_t retAddrReg = 0;
 	struct unwind_state *state = &context->state;
 	unsigned long addr;
+	int gen = atomic_read(&_stp_sym_cache_gen);
+	int res;
 
 	if (unlikely(table_len == 0)) {
 		// Don't _stp_warn about this, debug_frame and/or eh_frame
@@ -1173,6 +1356,14 @@ static int unwind_frame(struct unwind_context *context,
 		goto err;
 	}
 
+	if (_stp_unwind_cache_get(table, pc, user, gen, state,
+				  &retAddrReg, &call_frame, &res)) {
+		if (res != 0)
+			return res;
+		frame->call_frame = call_frame;
+		goto update_frame;
+	}
+
 	/* Sets all rules to default Same value. */
 	memset(state, 0, sizeof(*state));
 
@@ -1197,7 +1388,7 @@ static int unwind_frame(struct unwind_context *context,
 					  &state->dataAlign,
 					  &retAddrReg,
 					  &call_frame) < 0)
-				goto err;
+				goto bad_rules;
 			startLoc = adjustStartLoc(startLoc, m, s, ptrType, is_ehframe, user);
 			endLoc = startLoc + locRange;
 			dbug_unwind(1, "startLoc: %lx, endLoc: %lx\n", startLoc, endLoc);
@@ -1250,7 +1441,7 @@ static int unwind_frame(struct unwind_context *context,
 	dbug_unwind(1, "cie=%lx fde=%lx startLoc=%lx endLoc=%lx, pc=%lx\n",
                     (unsigned long) cie, (unsigned long)fde, (unsigned long) startLoc, (unsigned long) endLoc, pc);
 	if (cie == NULL || fde == NULL)
-		goto err;
+		goto bad_rules;
 
 	/* found the CIE and FDE */
 
@@ -1259,7 +1450,7 @@ static int unwind_frame(struct unwind_context *context,
 	    || REG_INVALID(retAddrReg)
 	    || reg_info[retAddrReg].width != sizeof(unsigned long)) {
 		_stp_warn("Bad retAddrReg value\n");
-		goto err;
+		goto bad_rules;
 	}
 
 	frame->call_frame = call_frame;
@@ -1270,7 +1461,7 @@ static int unwind_frame(struct unwind_context *context,
 	/* Common Information Entry (CIE) instructions. */
 	dbug_unwind (1, "processCFI for CIE\n");
 	if (!processCFI(cieStart, cieEnd, 0, ptrType, user, state))
-		goto err;
+		goto bad_rules;
 
 	/* Store initial state for use with DW_CFA_restore... */
 	memcpy(&state->cie_regs, &REG_STATE, sizeof (REG_STATE));
@@ -1283,8 +1474,12 @@ static int unwind_frame(struct unwind_context *context,
 	    || REG_STATE.cfa.reg >= ARRAY_SIZE(reg_info)
 	    || reg_info[REG_STATE.cfa.reg].width != sizeof(unsigned long)
 	    || REG_STATE.cfa.off % sizeof(unsigned long))
-		goto err;
+		goto bad_rules;
 
+	_stp_unwind_cache_put(table, pc, user, gen, state,
+			      retAddrReg, call_frame, 0);
+
+update_frame:
 	/* update frame */
 	if (REG_STATE.cfa_is_expr) {
 		if (compute_expr(REG_STATE.cfa_expr, frame, &cfa, user))
@@ -1426,6 +1621,10 @@ static int unwind_frame(struct unwind_context *context,
 	dbug_unwind(1, "returning 0 (%lx)\n", UNW_PC(frame));
 	return 0;
 
+bad_rules:
+	_stp_unwind_cache_put(table, pc, user, gen, NULL, 0, 0, -EIO);
+	return -EIO;
+
 copy_failed:
 	_stp_warn("_stp_read_address failed to access memory location\n");
 err:
@@ -1435,6 +1634,7 @@ done:
 	/* PC was in a range convered by a module but no unwind info */
 	/* found for the specific PC. This seems to happen only for kretprobe */
 	/* trampolines and at the end of interrupt backtraces. */
+	_stp_unwind_cache_put(table, pc, user, gen, NULL, 0, 0, 1);
 	return 1;
 #undef CASES
 #undef FRAME_REG
@@ -336,4 +336,22 @@ struct unwind_context {
 
 static const struct cfa badCFA = { ARRAY_SIZE(reg_info), 1 };
 
+/* Compact FDE search table that the translator synthesizes for the
+   debug_frame and eh_frame of a module (create_unwind_index in
+   translate.cxx), in place of an eh_frame_hdr style table.  */
+#define STP_UNWIND_INDEX_VERSION 2
+
+struct _stp_unwind_index_ent {
+	u32 start;	/* FDE start address - base */
+	u32 fde;	/* offset of the FDE in its unwind table */
+};
+
+struct _stp_unwind_index {
+	u8 version;	/* STP_UNWIND_INDEX_VERSION, eh_frame_hdr has 1 */
+	u8 pad[3];
+	u32 num;
+	u64 base;	/* lowest FDE start address */
+	struct _stp_unwind_index_ent entries[];	/* sorted by start */
+};
+
 #endif /*_STP_UNWIND_H_*/
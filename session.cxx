@@ -141,6 +141,12 @@ systemtap_session::systemtap_session ():
   omit_werror = false;
   compatible = VERSION; // XXX: perhaps also process GIT_SHAID if available?
   unwindsym_ldd = false;
+  defer_symbols = false;
+  striped_locks = false;
+  seqlock_reads = false;
+  fold_globals = false;
+  percpu_arrays = false;
+  amortize_actions = false;
   client_options = false;
   server_cache = NULL;
   automatic_server_mode = false;
@@ -308,6 +314,12 @@ systemtap_session::systemtap_session (const systemtap_session& other,
   omit_werror = other.omit_werror;
   compatible = other.compatible;
   unwindsym_ldd = other.unwindsym_ldd;
+  defer_symbols = other.defer_symbols;
+  striped_locks = other.striped_locks;
+  seqlock_reads = other.seqlock_reads;
+  fold_globals = other.fold_globals;
+  percpu_arrays = other.percpu_arrays;
+  amortize_actions = other.amortize_actions;
   client_options = other.client_options;
   server_cache = NULL;
   use_server_on_error = other.use_server_on_error;
@@ -496,6 +508,8 @@ systemtap_session::usage (int exitcode)
     << _F("   --ldd      add unwind/symbol data for all referenced object files.\n"
     "   --all-modules\n"
     "              add unwind/symbol data for all loaded kernel objects.\n"
+    "   --defer-symbols\n"
+    "              leave user-space symbol lookups to staprun.\n"
     "   -t         collect probe timing information\n"
 #ifdef HAVE_LIBSQLITE3
     "   -q         generate information on tapset coverage\n"
@@ -521,6 +535,16 @@ systemtap_session::usage (int exitcode)
     "              substitute zero for bad context $variables\n"
     "   --suppress-handler-errors\n"
     "              catch all runtime errors, quietly skip probe handlers\n"
+    "   --striped-locks\n"
+    "              lock global arrays per hash stripe for single elements\n"
+    "   --seqlock-reads\n"
+    "              read rarely written numeric globals without locking\n"
+    "   --fold-globals\n"
+    "              turn globals only set in begin probes into constants\n"
+    "   --percpu-arrays\n"
+    "              keep global arrays only added to in per-cpu maps\n"
+    "   --amortize-actions\n"
+    "              check MAXACTION only where code can repeat\n"
     "   --use-server[=SERVER-SPEC]\n"
     "              specify systemtap compile-servers\n"
     "   --list-servers[=PROPERTIES]\n"
@@ -1091,6 +1115,36 @@ systemtap_session::parse_cmdline (int argc, char * const argv [])
 	  unwindsym_ldd = true;
 	  break;
 
+	case LONG_OPT_DEFER_SYMBOLS:
+	  server_args.push_back ("--defer-symbols");
+	  defer_symbols = true;
+	  break;
+
+	case LONG_OPT_STRIPED_LOCKS:
+	  server_args.push_back ("--striped-locks");
+	  striped_locks = true;
+	  break;
+
+	case LONG_OPT_SEQLOCK_READS:
+	  server_args.push_back ("--seqlock-reads");
+	  seqlock_reads = true;
+	  break;
+
+	case LONG_OPT_FOLD_GLOBALS:
+	  server_args.push_back ("--fold-globals");
+	  fold_globals = true;
+	  break;
+
+	case LONG_OPT_PERCPU_ARRAYS:
+	  server_args.push_back ("--percpu-arrays");
+	  percpu_arrays = true;
+	  break;
+
+	case LONG_OPT_AMORTIZE_ACTIONS:
+	  server_args.push_back ("--amortize-actions");
+	  amortize_actions = true;
+	  break;
+
 	case LONG_OPT_ALL_MODULES:
 	  if (client_options) {
 	    cerr << _F("ERROR: %s is invalid with %s", "--all-modules", "--client-options") << endl;
@@ -196,6 +196,11 @@ public:
   bool dump_probe_types;
   int download_dbinfo;
   bool suppress_handler_errors;
+  bool striped_locks;
+  bool seqlock_reads;
+  bool fold_globals;
+  bool percpu_arrays;
+  bool amortize_actions;
 
   // NB: It is very important for all of the above (and below) fields
   // to be cleared in the systemtap_session ctor (session.cxx).
@@ -329,6 +334,7 @@ public:
   // List of libdwfl module names to extract symbol/unwind data for.
   std::set<std::string> unwindsym_modules;
   bool unwindsym_ldd;
+  bool defer_symbols;
   struct module_cache* module_cache;
   std::vector<std::string> build_ids;
 
@@ -146,7 +146,8 @@ probe_point::component::component (std::string const & f, literal * a):
 
 
 vardecl::vardecl ():
-  arity_tok(0), arity (-1), maxsize(0), init(NULL), synthetic(false), wrap(false)
+  arity_tok(0), arity (-1), maxsize(0), init(NULL), synthetic(false), wrap(false),
+  percpu_counter(false), seqlock(false), read_mostly(false)
 {
 }
 
@@ -2109,7 +2110,10 @@ varuse_collecting_visitor::visit_symbol (symbol *e)
     {
       written.insert (e->referent);
     }
-  if (current_lvalue != e || current_lrvalue == e)
+  // Per-cpu counters are only ever added to in statements of their
+  // own, whose value goes unused, so that doesn't read them.
+  if ((current_lvalue != e && current_lrvalue != e)
+      || (current_lrvalue == e && !e->referent->percpu_counter))
     {
       read.insert (e->referent);
     }
@@ -2248,6 +2252,12 @@ varuse_collecting_visitor::visit_delete_statement (delete_statement* s)
   functioncall_traversing_visitor::visit_delete_statement (s);
   current_lrvalue = last_lrvalue;
   current_lvalue_read = last_lvalue_read;
+
+  // Unlike adding to them, clearing per-cpu counters touches every
+  // cpu's share, so it needs the exclusive lock a read gets.
+  symbol *sym = dynamic_cast<symbol *>(s->value);
+  if (sym && sym->referent && sym->referent->percpu_counter)
+    read.insert (sym->referent);
 }
 
 bool
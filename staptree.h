@@ -500,6 +500,9 @@ struct vardecl: public symboldecl
   literal *init; // for global scalars only
   bool synthetic; // for probe locals only, don't init on entry
   bool wrap;
+  bool percpu_counter; // for numeric globals only, only ever added to
+  bool seqlock; // for global scalars only, read without locking
+  bool read_mostly; // for global scalars only, fixed once other probes run
 };
 
 
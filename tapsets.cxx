@@ -4842,20 +4842,11 @@ dwarf_derived_probe_group::emit_module_decls (systemtap_session& s)
   s.op->newline(1) << "return enter_kretprobe_common(inst, regs, 1);";
   s.op->newline(-1) << "}";
 
+  // Fill in a kprobe or kretprobe for registration at its relocated address.
   s.op->newline();
-}
-
-
-void
-dwarf_derived_probe_group::emit_module_init (systemtap_session& s)
-{
-  s.op->newline() << "for (i=0; i<" << probes_by_module.size() << "; i++) {";
-  s.op->newline(1) << "struct stap_dwarf_probe *sdp = & stap_dwarf_probes[i];";
-  s.op->newline() << "struct stap_dwarf_kprobe *kp = & stap_dwarf_kprobes[i];";
-  s.op->newline() << "unsigned long relocated_addr = _stp_kmodule_relocate (sdp->module, sdp->section, sdp->address);";
-  s.op->newline() << "if (relocated_addr == 0) continue;"; // quietly; assume module is absent
-  s.op->newline() << "probe_point = sdp->probe->pp;"; // for error messages
-  s.op->newline() << "if (sdp->return_p) {";
+  s.op->newline() << "static void stap_dwarf_kprobe_setup (struct stap_dwarf_probe *sdp,";
+  s.op->line() << " struct stap_dwarf_kprobe *kp, unsigned long relocated_addr) {";
+  s.op->newline(1) << "if (sdp->return_p) {";
   s.op->newline(1) << "kp->u.krp.kp.addr = (void *) relocated_addr;";
   s.op->newline() << "if (sdp->maxactive_p) {";
   s.op->newline(1) << "kp->u.krp.maxactive = sdp->maxactive_val;";
@@ -4870,8 +4861,38 @@ dwarf_derived_probe_group::emit_module_init (systemtap_session& s)
   s.op->newline() << "                      sdp->saved_strings * MAXSTRINGLEN;";
   s.op->newline(-1) << "}";
   s.op->newline() << "#endif";
+  s.op->newline(-1) << "} else {";
+  s.op->newline(1) << "kp->u.kp.addr = (void *) relocated_addr;";
+  s.op->newline() << "kp->u.kp.pre_handler = &enter_kprobe_probe;";
+  s.op->newline(-1) << "}";
+  s.op->newline(-1) << "}";
+
+  s.op->newline();
+}
+
+
+void
+dwarf_derived_probe_group::emit_module_init (systemtap_session& s)
+{
+  // Relocate each probe once, leaving the address NULL if its module
+  // is absent.
+  s.op->newline() << "for (i=0; i<" << probes_by_module.size() << "; i++) {";
+  s.op->newline(1) << "struct stap_dwarf_probe *sdp = & stap_dwarf_probes[i];";
+  s.op->newline() << "struct stap_dwarf_kprobe *kp = & stap_dwarf_kprobes[i];";
+  s.op->newline() << "unsigned long relocated_addr = _stp_kmodule_relocate (sdp->module, sdp->section, sdp->address);";
+  s.op->newline() << "if (relocated_addr == 0) continue;"; // quietly; assume module is absent
+  s.op->newline() << "stap_dwarf_kprobe_setup (sdp, kp, relocated_addr);";
+  s.op->newline(-1) << "}";
+
+  s.op->newline() << "for (i=0; i<" << probes_by_module.size() << "; i++) {";
+  s.op->newline(1) << "struct stap_dwarf_probe *sdp = & stap_dwarf_probes[i];";
+  s.op->newline() << "struct stap_dwarf_kprobe *kp = & stap_dwarf_kprobes[i];";
+  s.op->newline() << "unsigned long relocated_addr = (unsigned long) (sdp->return_p ? kp->u.krp.kp.addr : kp->u.kp.addr);";
+  s.op->newline() << "if (relocated_addr == 0) continue;"; // module absent, see above
+  s.op->newline() << "probe_point = sdp->probe->pp;"; // for error messages
+  s.op->newline() << "if (sdp->return_p) {";
   // to ensure safeness of bspcache, always use aggr_kprobe on ia64
-  s.op->newline() << "#ifdef __ia64__";
+  s.op->newline(1) << "#ifdef __ia64__";
   s.op->newline() << "kp->dummy.addr = kp->u.krp.kp.addr;";
   s.op->newline() << "kp->dummy.pre_handler = NULL;";
   s.op->newline() << "rc = register_kprobe (& kp->dummy);";
@@ -4885,9 +4906,7 @@ dwarf_derived_probe_group::emit_module_init (systemtap_session& s)
   s.op->newline() << "#endif";
   s.op->newline(-1) << "} else {";
   // to ensure safeness of bspcache, always use aggr_kprobe on ia64
-  s.op->newline(1) << "kp->u.kp.addr = (void *) relocated_addr;";
-  s.op->newline() << "kp->u.kp.pre_handler = &enter_kprobe_probe;";
-  s.op->newline() << "#ifdef __ia64__";
+  s.op->newline(1) << "#ifdef __ia64__";
   s.op->newline() << "kp->dummy.addr = kp->u.kp.addr;";
   s.op->newline() << "kp->dummy.pre_handler = NULL;";
   s.op->newline() << "rc = register_kprobe (& kp->dummy);";
@@ -4940,23 +4959,10 @@ dwarf_derived_probe_group::emit_module_refresh (systemtap_session& s)
 
   // new module arrived?
   s.op->newline() << "if (sdp->registered_p == 0 && relocated_addr != 0) {";
-  s.op->newline(1) << "if (sdp->return_p) {";
-  s.op->newline(1) << "kp->u.krp.kp.addr = (void *) relocated_addr;";
-  s.op->newline() << "if (sdp->maxactive_p) {";
-  s.op->newline(1) << "kp->u.krp.maxactive = sdp->maxactive_val;";
-  s.op->newline(-1) << "} else {";
-  s.op->newline(1) << "kp->u.krp.maxactive = KRETACTIVE;";
-  s.op->newline(-1) << "}";
-  s.op->newline() << "kp->u.krp.handler = &enter_kretprobe_probe;";
-  s.op->newline() << "#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,25)";
-  s.op->newline() << "if (sdp->entry_probe) {";
-  s.op->newline(1) << "kp->u.krp.entry_handler = &enter_kretprobe_entry_probe;";
-  s.op->newline() << "kp->u.krp.data_size = sdp->saved_longs * sizeof(int64_t) + ";
-  s.op->newline() << "                      sdp->saved_strings * MAXSTRINGLEN;";
-  s.op->newline(-1) << "}";
-  s.op->newline() << "#endif";
+  s.op->newline(1) << "stap_dwarf_kprobe_setup (sdp, kp, relocated_addr);";
+  s.op->newline() << "if (sdp->return_p) {";
   // to ensure safeness of bspcache, always use aggr_kprobe on ia64
-  s.op->newline() << "#ifdef __ia64__";
+  s.op->newline(1) << "#ifdef __ia64__";
   s.op->newline() << "kp->dummy.addr = kp->u.krp.kp.addr;";
   s.op->newline() << "kp->dummy.pre_handler = NULL;";
   s.op->newline() << "rc = register_kprobe (& kp->dummy);";
@@ -4970,9 +4976,7 @@ dwarf_derived_probe_group::emit_module_refresh (systemtap_session& s)
   s.op->newline() << "#endif";
   s.op->newline(-1) << "} else {";
   // to ensure safeness of bspcache, always use aggr_kprobe on ia64
-  s.op->newline(1) << "kp->u.kp.addr = (void *) relocated_addr;";
-  s.op->newline() << "kp->u.kp.pre_handler = &enter_kprobe_probe;";
-  s.op->newline() << "#ifdef __ia64__";
+  s.op->newline(1) << "#ifdef __ia64__";
   s.op->newline() << "kp->dummy.addr = kp->u.kp.addr;";
   s.op->newline() << "kp->dummy.pre_handler = NULL;";
   s.op->newline() << "rc = register_kprobe (& kp->dummy);";
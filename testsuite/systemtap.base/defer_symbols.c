@@ -0,0 +1,19 @@
+#include <stdio.h>
+
+void __attribute__((noinline)) outer(void);
+
+void __attribute__((noinline)) inner(void (*f)(void))
+{
+  asm volatile ("" : : "r" (f) : "memory");
+}
+
+void __attribute__((noinline)) outer(void)
+{
+  inner(outer);
+}
+
+int main()
+{
+  outer();
+  return 0;
+}
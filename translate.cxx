@@ -20,6 +20,7 @@
 #include "task_finder.h"
 #include "dwflpp.h"
 
+#include <algorithm>
 #include <cstdlib>
 #include <iostream>
 #include <set>
@@ -69,6 +70,7 @@ struct c_unparser: public unparser, public visitor
   unsigned tmpvar_counter;
   unsigned label_counter;
   unsigned action_counter;
+  unsigned unchecked_actions; // with --amortize-actions, see record_actions
 
   varuse_collecting_visitor vcv_needs_global_locks;
 
@@ -76,10 +78,18 @@ struct c_unparser: public unparser, public visitor
 
   map<pair<bool, string>, string> compiled_printfs;
 
+  // Functions with a bounded call depth keep their locals at a fixed
+  // offset of c->frames, laid out from the static call graph.  They are
+  // listed callers first.  The others use rows of c->locals[].
+  vector<functiondecl*> framed_functions;
+  map<functiondecl*, set<functiondecl*> > function_callees;
+  bool is_framed (functiondecl* fd);
+  string c_funclocals (functiondecl* fd);
+
   c_unparser (systemtap_session* ss):
     session (ss), o (ss->op), current_probe(0), current_function (0),
     tmpvar_counter (0), label_counter (0), action_counter(0),
-    vcv_needs_global_locks (*ss) {}
+    unchecked_actions(0), vcv_needs_global_locks (*ss) {}
   ~c_unparser () {}
 
   void emit_map_type_instantiations ();
@@ -87,10 +97,12 @@ struct c_unparser: public unparser, public visitor
   void emit_global (vardecl* v);
   void emit_global_init (vardecl* v);
   void emit_global_param (vardecl* v);
+  void emit_read_mostly_global (vardecl* v);
   void emit_functionsig (functiondecl* v);
   void emit_module_init ();
   void emit_module_refresh ();
   void emit_module_exit ();
+  void emit_timing_file ();
   void emit_function (functiondecl* v);
   void emit_lock_decls (const varuse_collecting_visitor& v);
   void emit_locks (const varuse_collecting_visitor& v);
@@ -146,6 +158,7 @@ struct c_unparser: public unparser, public visitor
   var getvar(vardecl* v, token const* tok = NULL);
   itervar getiter(symbol* s);
   mapvar getmap(vardecl* v, token const* tok = NULL);
+  bool is_striped (vardecl* v);
 
   void load_map_indices(arrayindex* e,
 			vector<tmpvar> & idx);
@@ -156,7 +169,8 @@ struct c_unparser: public unparser, public visitor
   void collect_map_index_types(vector<vardecl* > const & vars,
 			       set< pair<vector<exp_type>, exp_type> > & types);
 
-  void record_actions (unsigned actions, const token* tok, bool update=false);
+  void record_actions (unsigned actions, const token* tok, bool update=false,
+                       bool check=false);
 
   void visit_block (block* s);
   void visit_try_block (try_block* s);
@@ -334,23 +348,32 @@ protected:
   statistic_decl sd;
   string name;
   bool do_mangle;
+  bool read_mostly; // a global kept outside the globals struct
 
 public:
 
   var(c_unparser *u, bool local, exp_type ty,
       statistic_decl const & sd, string const & name)
-    : u(u), local(local), ty(ty), sd(sd), name(name), do_mangle(true)
+    : u(u), local(local), ty(ty), sd(sd), name(name), do_mangle(true),
+      read_mostly(false)
   {}
 
   var(c_unparser *u, bool local, exp_type ty, string const & name)
-    : u(u), local(local), ty(ty), name(name), do_mangle(true)
+    : u(u), local(local), ty(ty), name(name), do_mangle(true),
+      read_mostly(false)
   {}
 
   var(c_unparser *u, bool local, exp_type ty,
       string const & name, bool do_mangle)
-    : u(u), local(local), ty(ty), name(name), do_mangle(do_mangle)
+    : u(u), local(local), ty(ty), name(name), do_mangle(do_mangle),
+      read_mostly(false)
   {}
 
+  void set_read_mostly()
+  {
+    read_mostly = true;
+  }
+
   virtual ~var() {}
 
   bool is_local() const
@@ -404,6 +427,8 @@ public:
   {
     if (local)
       return "l->" + c_name();
+    else if (read_mostly)
+      return c_name();
     else
       return "global." + c_name();
   }
@@ -582,15 +607,17 @@ struct mapvar
   vector<exp_type> index_types;
   int maxsize;
   bool wrap;
+  bool percpu; // a counting array kept in a pmap, see percpu_counter
+  bool striped; // element accesses lock their hash stripe, see --striped-locks
   mapvar (c_unparser *u,
           bool local, exp_type ty,
 	  statistic_decl const & sd,
 	  string const & name,
 	  vector<exp_type> const & index_types,
-	  int maxsize, bool wrap)
+	  int maxsize, bool wrap, bool percpu = false, bool striped = false)
     : var (u, local, ty, sd, name),
       index_types (index_types),
-      maxsize (maxsize), wrap(wrap)
+      maxsize (maxsize), wrap(wrap), percpu(percpu), striped(striped)
   {}
 
   static string shortname(exp_type e);
@@ -641,7 +668,7 @@ struct mapvar
 
   bool is_parallel() const
   {
-    return type() == pe_stats;
+    return type() == pe_stats || percpu;
   }
 
   string calculate_aggregate() const
@@ -665,6 +692,16 @@ struct mapvar
     return (call_prefix("del", indices) + ")");
   }
 
+  string lock_stripe (vector<tmpvar> const & indices) const
+  {
+    return ("_stp_map_lock_stripe (c, " + call_prefix("stripe", indices) + "))");
+  }
+
+  string unlock_stripe () const
+  {
+    return "_stp_map_unlock_stripe (c)";
+  }
+
   string exists (vector<tmpvar> const & indices) const
   {
     if (type() == pe_long || type() == pe_string)
@@ -694,7 +731,7 @@ struct mapvar
     string res = "{ int rc = ";
 
     // impedance matching: empty strings -> NULL
-    if (type() == pe_stats)
+    if (type() == pe_stats || (type() == pe_long && is_parallel()))
       res += (call_prefix("add", indices) + ", " + val.value() + ")");
     else
       throw semantic_error(_("adding a value of an unsupported map type"));
@@ -762,6 +799,8 @@ struct mapvar
         else
           suffix = suffix + " else " + value() + "->wrap = 1;";
       }
+    if (striped)
+      suffix = suffix + " else if (_stp_map_init_stripes (" + value() + ")) rc = -ENOMEM;";
     if (type() == pe_stats)
       {
 	switch (sdecl().type)
@@ -952,6 +991,25 @@ translator_output::line ()
 
 // ------------------------------------------------------------------------
 
+// Fold VALUE into the maximum MAX of some frame offsets.  Every step
+// gets an enum constant of its own, since nesting STP_FRAME_MAX would
+// double the expression for each value.
+static void
+emit_frame_max (translator_output* o, string& max, unsigned& n,
+                const string& value)
+{
+  if (max.empty())
+    {
+      max = value;
+      return;
+    }
+  string next = "stp_frames_" + lex_cast (n++);
+  o->newline() << "enum { " << next << " = STP_FRAME_MAX ("
+               << max << ", " << value << ") };";
+  max = next;
+}
+
+
 void
 c_unparser::emit_common_header ()
 {
@@ -959,9 +1017,82 @@ c_unparser::emit_common_header ()
   o->newline();
   o->newline() << "#include \"common_session_state.h\"";
 
+  // PR10516: function locals, declared ahead of the context so their
+  // sizes can lay out the frames below.
+  for (map<string,functiondecl*>::iterator it = session->functions.begin(); it != session->functions.end(); it++)
+    {
+      functiondecl* fd = it->second;
+      o->newline()
+        << "struct " << c_funcname (fd->name) << "_locals {";
+      o->indent(1);
+      for (unsigned j=0; j<fd->locals.size(); j++)
+        {
+	  vardecl* v = fd->locals[j];
+	  try
+	    {
+	      o->newline() << c_typename (v->type) << " "
+			   << c_localname (v->name) << ";";
+	    } catch (const semantic_error& e) {
+	      semantic_error e2 (e);
+	      if (e2.tok1 == 0) e2.tok1 = v->tok;
+	      throw e2;
+	    }
+        }
+      for (unsigned j=0; j<fd->formal_args.size(); j++)
+        {
+          vardecl* v = fd->formal_args[j];
+	  try
+	    {
+	      o->newline() << c_typename (v->type) << " "
+			   << c_localname (v->name) << ";";
+	    } catch (const semantic_error& e) {
+	      semantic_error e2 (e);
+	      if (e2.tok1 == 0) e2.tok1 = v->tok;
+	      throw e2;
+	    }
+        }
+      c_tmpcounter ct (this);
+      fd->body->visit (& ct);
+      if (fd->type == pe_unknown)
+	o->newline() << "/* no return value */";
+      else
+	{
+	  o->newline() << c_typename (fd->type) << " __retvalue;";
+	}
+      o->newline(-1) << "};";
+    }
+
+  // Functions that can't recurse get a frame at a fixed offset, right
+  // past the end of the frames of all the functions that call them.
+  // So a frame never overlaps one of a function that is active at the
+  // same time, and all of them together take only as much room as the
+  // largest sum of frames along a call chain.
+  if (!framed_functions.empty())
+    {
+      o->newline() << "#define STP_FRAME_END(f) "
+                   << "((stp_frame_##f + sizeof (struct f##_locals) + 7) & ~(size_t) 7)";
+      o->newline() << "#define STP_FRAME_MAX(a, b) ((a) > (b) ? (a) : (b))";
+      unsigned n = 0;
+      string frames_size;
+      for (unsigned i=0; i<framed_functions.size(); i++)
+        {
+          functiondecl* fd = framed_functions[i];
+          string offset;
+          for (unsigned j=0; j<i; j++)
+            if (function_callees[framed_functions[j]].count (fd))
+              emit_frame_max (o, offset, n, "STP_FRAME_END ("
+                              + c_funcname (framed_functions[j]->name) + ")");
+          o->newline() << "enum { stp_frame_" << c_funcname (fd->name)
+                       << " = " << (offset.empty() ? "0" : offset) << " };";
+          emit_frame_max (o, frames_size, n, "STP_FRAME_END ("
+                          + c_funcname (fd->name) + ")");
+        }
+      o->newline() << "enum { stp_frames_size = " << frames_size << " };";
+    }
+
   // Per CPU context for probes. Includes common shared state held for
   // all probes (defined in common_probe_context), the probe locals (union)
-  // and the function locals (union).
+  // and the function locals (frames and union).
   o->newline() << "struct context {";
 
   // Common state held shared by probes.
@@ -1023,52 +1154,19 @@ c_unparser::emit_common_header ()
   o->newline(-1) << "} probe_locals;";
 
   // PR10516: function locals
-  o->newline() << "union {";
-  o->indent(1);
+  if (!framed_functions.empty())
+    o->newline() << "char frames [stp_frames_size] __attribute__ ((aligned (8)));";
 
-  for (map<string,functiondecl*>::iterator it = session->functions.begin(); it != session->functions.end(); it++)
+  if (framed_functions.size() < session->functions.size())
     {
-      functiondecl* fd = it->second;
-      o->newline()
-        << "struct " << c_funcname (fd->name) << "_locals {";
+      o->newline() << "union {";
       o->indent(1);
-      for (unsigned j=0; j<fd->locals.size(); j++)
-        {
-	  vardecl* v = fd->locals[j];
-	  try
-	    {
-	      o->newline() << c_typename (v->type) << " "
-			   << c_localname (v->name) << ";";
-	    } catch (const semantic_error& e) {
-	      semantic_error e2 (e);
-	      if (e2.tok1 == 0) e2.tok1 = v->tok;
-	      throw e2;
-	    }
-        }
-      for (unsigned j=0; j<fd->formal_args.size(); j++)
-        {
-          vardecl* v = fd->formal_args[j];
-	  try
-	    {
-	      o->newline() << c_typename (v->type) << " "
-			   << c_localname (v->name) << ";";
-	    } catch (const semantic_error& e) {
-	      semantic_error e2 (e);
-	      if (e2.tok1 == 0) e2.tok1 = v->tok;
-	      throw e2;
-	    }
-        }
-      c_tmpcounter ct (this);
-      fd->body->visit (& ct);
-      if (fd->type == pe_unknown)
-	o->newline() << "/* no return value */";
-      else
-	{
-	  o->newline() << c_typename (fd->type) << " __retvalue;";
-	}
-      o->newline(-1) << "} " << c_funcname (fd->name) << ";";
+      for (map<string,functiondecl*>::iterator it = session->functions.begin(); it != session->functions.end(); it++)
+        if (!is_framed (it->second))
+          o->newline() << "struct " << c_funcname (it->first) << "_locals "
+                       << c_funcname (it->first) << ";";
+      o->newline(-1) << "} locals [MAXNESTING+1];";
     }
-  o->newline(-1) << "} locals [MAXNESTING+1];"; 
 
   // NB: The +1 above for extra room for outgoing arguments of next nested function.
   // If MAXNESTING is set too small, the args will be written, but the MAXNESTING
@@ -1447,7 +1545,7 @@ c_unparser::emit_compiled_printfs ()
 void
 c_unparser::emit_global_param (vardecl *v)
 {
-  string vn = c_globalname (v->name);
+  string vn = getvar (v).value();
 
   // NB: systemtap globals can collide with linux macros,
   // e.g. VM_FAULT_MAJOR.  We want the parameter name anyway.  This
@@ -1460,14 +1558,13 @@ c_unparser::emit_global_param (vardecl *v)
   if (v->arity == 0 && v->type == pe_long)
     {
       o->newline() << "module_param_named (" << v->name << ", "
-                   << "global." << vn << ", int64_t, 0);";
+                   << vn << ", int64_t, 0);";
     }
   else if (v->arity == 0 && v->type == pe_string)
     {
       // NB: no special copying is needed.
       o->newline() << "module_param_string (" << v->name << ", "
-                   << "global." << vn
-                   << ", MAXSTRINGLEN, 0);";
+                   << vn << ", MAXSTRINGLEN, 0);";
     }
 }
 
@@ -1478,14 +1575,22 @@ c_unparser::emit_global (vardecl *v)
   string vn = c_globalname (v->name);
 
   if (v->arity == 0)
-    o->newline() << c_typename (v->type) << " " << vn << ";";
-  else if (v->type == pe_stats)
+    {
+      if (!v->read_mostly) // see emit_read_mostly_global
+        o->newline() << c_typename (v->type) << " " << vn << ";";
+    }
+  else if (v->type == pe_stats || v->percpu_counter)
     o->newline() << "PMAP " << vn << ";";
   else
     o->newline() << "MAP " << vn << ";";
+  if (v->arity == 0 && v->percpu_counter) // what's been added on each cpu, on top of vn
+    o->newline() << "int64_t *" << vn << "_pcpu;";
+  if (v->seqlock) // taken around stores, read without locking
+    o->newline() << "seqlock_t " << vn << "_seq;";
   o->newline() << "rwlock_t " << vn << "_lock;";
   o->newline() << "#ifdef STP_TIMING";
   o->newline() << "atomic_t " << vn << "_lock_skip_count;";
+  o->newline() << "atomic_t " << vn << "_lock_contention_count;";
   o->newline() << "#endif\n";
 }
 
@@ -1495,7 +1600,7 @@ c_unparser::emit_global_init (vardecl *v)
 {
   string vn = c_globalname (v->name);
 
-  if (v->arity == 0) // can only statically initialize some scalars
+  if (v->arity == 0 && !v->read_mostly) // can only statically initialize some scalars
     {
       if (v->init)
 	{
@@ -1506,11 +1611,28 @@ c_unparser::emit_global_init (vardecl *v)
     }
   o->newline() << "#ifdef STP_TIMING";
   o->newline() << "." << vn << "_lock_skip_count = ATOMIC_INIT(0),";
+  o->newline() << "." << vn << "_lock_contention_count = ATOMIC_INIT(0),";
   o->newline() << "#endif";
 }
 
 
 
+// Globals that only begin probes write, or only -G sets, live on their
+// own, so they share no cache lines with what probes keep writing.
+void
+c_unparser::emit_read_mostly_global (vardecl *v)
+{
+  o->newline() << "static " << c_typename (v->type) << " "
+               << c_globalname (v->name) << " __read_mostly";
+  if (v->init)
+    {
+      o->line() << " = ";
+      v->init->visit(this);
+    }
+  o->line() << ";";
+}
+
+
 void
 c_unparser::emit_functionsig (functiondecl* v)
 {
@@ -1519,6 +1641,132 @@ c_unparser::emit_functionsig (functiondecl* v)
 }
 
 
+// With STP_TIMING, a "timing" file in the module's debugfs directory
+// shows the statistics that systemtap_module_exit prints, while the
+// session is still running.  There is one line per record: the record
+// kind, then space separated key=value pairs, where a string value
+// comes last and runs to the end of the line.
+//
+//   probe 3 hits=120 min=410 avg=600 max=9120 hist=256:7,512:113 pp=...
+//   global 0 skipped=0 contention=12 name=counts
+//   skipped total=0 lowstack=0 reentrant=0 uprobe_reg=0 uprobe_unreg=0
+//
+// The hist buckets are keyed by the lowest cycle count they hold.  They
+// are only filled in with -DSTP_TIMING_HISTOGRAM.
+void
+c_unparser::emit_timing_file ()
+{
+  o->newline() << "#ifdef STP_TIMING";
+  o->newline() << "static struct dentry *stp_timing_file = NULL;";
+  o->newline() << "static DEFINE_MUTEX(stp_timing_mutex);";
+
+  o->newline() << "static int stp_timing_show (struct seq_file *m, void *v) {";
+  o->newline(1) << "unsigned i;";
+  o->newline() << "#ifdef STP_TIMING_HISTOGRAM";
+  o->newline() << "int b;";
+  o->newline() << "#endif";
+  o->newline() << "stat *stats = _stp_kmalloc (sizeof(stat) + HIST_LOG_BUCKETS * sizeof(int64_t));";
+  o->newline() << "if (stats == NULL)";
+  o->newline(1) << "return -ENOMEM;";
+  o->indent(-1);
+  // The mutex keeps systemtap_module_exit from freeing the Stats
+  // while they are read here.
+  o->newline() << "mutex_lock (&stp_timing_mutex);";
+  o->newline() << "if (stp_timing_file == NULL)";
+  o->newline(1) << "goto out;";
+  o->indent(-1);
+  o->newline() << "for (i = 0; i < ARRAY_SIZE(stap_probes); ++i) {";
+  o->newline(1) << "struct stap_probe *const p = &stap_probes[i];";
+  o->newline() << "#ifdef STP_TIMING_HISTOGRAM";
+  o->newline() << "const char *sep = \"\";";
+  o->newline() << "#endif";
+  o->newline() << "if (unlikely (p->timing == NULL))";
+  o->newline(1) << "continue;";
+  o->indent(-1);
+  o->newline() << "_stp_stat_copy (p->timing, stats);";
+  o->newline() << "seq_printf (m, \"probe %u hits=%lld min=%lld avg=%lld max=%lld hist=\", i,";
+  o->newline(1) << "(long long) stats->count, (long long) stats->min,";
+  o->newline() << "(long long) (stats->count ? _stp_div64 (NULL, stats->sum, stats->count) : 0),";
+  o->newline() << "(long long) stats->max);";
+  o->newline(-1) << "#ifdef STP_TIMING_HISTOGRAM";
+  o->newline() << "for (b = 0; b < HIST_LOG_BUCKETS; b++) {";
+  o->newline(1) << "if (stats->histogram[b] == 0)";
+  o->newline(1) << "continue;";
+  o->newline(-1) << "seq_printf (m, \"%s%lld:%lld\", sep, (long long) _stp_bucket_to_val (b),";
+  o->newline(1) << "(long long) stats->histogram[b]);";
+  o->newline(-1) << "sep = \",\";";
+  o->newline(-1) << "}";
+  o->newline() << "#endif";
+  o->newline() << "seq_printf (m, \" pp=%s\\n\", p->pp);";
+  o->newline(-1) << "}";
+  for (unsigned i=0; i<session->globals.size(); i++)
+    {
+      string orig_vn = session->globals[i]->name;
+      string vn = c_globalname (orig_vn);
+      o->newline() << "seq_printf (m, \"global " << i << " skipped=%d contention=%d name=%s\\n\",";
+      o->newline(1) << "atomic_read (& global." << vn << "_lock_skip_count),";
+      o->newline() << "atomic_read (& global." << vn << "_lock_contention_count),";
+      o->newline() << lex_cast_qstring (orig_vn) << ");";
+      o->indent(-1);
+    }
+  o->newline() << "seq_printf (m, \"skipped total=%d lowstack=%d reentrant=%d \"";
+  o->newline(1) << "\"uprobe_reg=%d uprobe_unreg=%d\\n\",";
+  o->newline() << "atomic_read (& skipped_count),";
+  o->newline() << "atomic_read (& skipped_count_lowstack),";
+  o->newline() << "atomic_read (& skipped_count_reentrant),";
+  o->newline() << "atomic_read (& skipped_count_uprobe_reg),";
+  o->newline() << "atomic_read (& skipped_count_uprobe_unreg));";
+  o->newline(-1) << "out:";
+  o->newline() << "mutex_unlock (&stp_timing_mutex);";
+  o->newline() << "_stp_kfree (stats);";
+  o->newline() << "return 0;";
+  o->newline(-1) << "}";
+
+  o->newline() << "static int stp_timing_open (struct inode *inode, struct file *filp) {";
+  o->newline(1) << "return single_open (filp, stp_timing_show, NULL);";
+  o->newline(-1) << "}";
+
+  o->newline() << "static struct file_operations stp_timing_fops = {";
+  o->newline(1) << ".owner = THIS_MODULE,";
+  o->newline() << ".open = stp_timing_open,";
+  o->newline() << ".read = seq_read,";
+  o->newline() << ".llseek = seq_lseek,";
+  o->newline() << ".release = single_release,";
+  o->newline(-1) << "};";
+
+  // Old relayfs transports have no debugfs directory to put it in.
+  o->newline() << "static void stp_timing_file_init (void) {";
+  o->newline(1) << "#if STP_TRANSPORT_VERSION != 1";
+  o->newline() << "struct dentry *file = debugfs_create_file (\"timing\", 0400,";
+  o->newline(1) << "_stp_get_module_dir (), NULL, &stp_timing_fops);";
+  o->newline(-1) << "if (file == NULL || IS_ERR (file)) {";
+  o->newline(1) << "_stp_warn (\"Could not create debugfs 'timing' entry\\n\");";
+  o->newline() << "return;";
+  o->newline(-1) << "}";
+  o->newline() << "file->d_inode->i_uid = _stp_uid;";
+  o->newline() << "file->d_inode->i_gid = _stp_gid;";
+  o->newline() << "mutex_lock (&stp_timing_mutex);";
+  o->newline() << "stp_timing_file = file;";
+  o->newline() << "mutex_unlock (&stp_timing_mutex);";
+  o->newline() << "#endif";
+  o->newline(-1) << "}";
+
+  // Readers see the NULL and stop touching the Stats, so it is safe
+  // to free them after this.  The removal itself happens outside the
+  // mutex, since it may wait for those readers.
+  o->newline() << "static void stp_timing_file_close (void) {";
+  o->newline(1) << "struct dentry *file;";
+  o->newline() << "mutex_lock (&stp_timing_mutex);";
+  o->newline() << "file = stp_timing_file;";
+  o->newline() << "stp_timing_file = NULL;";
+  o->newline() << "mutex_unlock (&stp_timing_mutex);";
+  o->newline() << "if (file)";
+  o->newline(1) << "debugfs_remove (file);";
+  o->newline(-2) << "}";
+  o->newline() << "#endif\n"; // STP_TIMING
+}
+
+
 void
 c_unparser::emit_module_init ()
 {
@@ -1529,6 +1777,8 @@ c_unparser::emit_module_init ()
       o->assert_0_indent(); 
     }
 
+  emit_timing_file ();
+
   o->newline();
   o->newline() << "static int systemtap_module_init (void) {";
   o->newline(1) << "int rc = 0;";
@@ -1650,6 +1900,12 @@ c_unparser::emit_module_init ()
 	o->newline() << getmap (v).init();
       else
 	o->newline() << getvar (v).init();
+      if (v->arity == 0 && v->percpu_counter)
+        {
+          string vn = c_globalname (v->name);
+          o->newline() << "global." << vn << "_pcpu = _stp_alloc_percpu (sizeof (int64_t));";
+          o->newline() << "if (global." << vn << "_pcpu == NULL) rc = -ENOMEM;";
+        }
       // NB: in case of failure of allocation, "rc" will be set to non-zero.
       // Allocation can in general continue.
 
@@ -1659,15 +1915,28 @@ c_unparser::emit_module_init ()
       o->newline(-1) << "}";
 
       o->newline() << "rwlock_init (& global." << c_globalname (v->name) << "_lock);";
+      if (v->seqlock)
+        o->newline() << "seqlock_init (& global." << c_globalname (v->name) << "_seq);";
     }
 
   // initialize each Stat used for timing information
+  // The histograms take HIST_LOG_BUCKETS counters per probe and cpu, so
+  // they are only kept on request.
   o->newline() << "#ifdef STP_TIMING";
-  o->newline() << "for (i = 0; i < ARRAY_SIZE(stap_probes); ++i)";
-  o->newline(1) << "stap_probes[i].timing = _stp_stat_init (HIST_NONE);";
-  // NB: we don't check for null return here, but instead at
-  // passage to probe handlers and at final printing.
-  o->newline(-1) << "#endif";
+  o->newline() << "for (i = 0; i < ARRAY_SIZE(stap_probes); ++i) {";
+  o->newline(1) << "#ifdef STP_TIMING_HISTOGRAM";
+  o->newline() << "stap_probes[i].timing = _stp_stat_init (HIST_LOG);";
+  o->newline() << "#else";
+  o->newline() << "stap_probes[i].timing = _stp_stat_init (HIST_NONE);";
+  o->newline() << "#endif";
+  o->newline() << "if (stap_probes[i].timing == NULL) {";
+  o->newline(1) << "_stp_error (\"probe timing allocation failed\");";
+  o->newline() << "rc = -ENOMEM;";
+  o->newline() << "goto out;";
+  o->newline(-1) << "}";
+  o->newline(-1) << "}";
+  o->newline() << "stp_timing_file_init ();";
+  o->newline() << "#endif";
 
   // Print a message to the kernel log about this module.  This is
   // intended to help debug problems with systemtap modules.
@@ -1722,8 +1991,24 @@ c_unparser::emit_module_init ()
 	o->newline() << getmap (v).fini();
       else
 	o->newline() << getvar (v).fini();
+      if (v->arity == 0 && v->percpu_counter)
+        {
+          string vn = c_globalname (v->name);
+          o->newline() << "if (global." << vn << "_pcpu != NULL)";
+          o->newline(1) << "_stp_free_percpu (global." << vn << "_pcpu);";
+          o->indent(-1);
+        }
     }
 
+  o->newline() << "#ifdef STP_TIMING";
+  o->newline() << "stp_timing_file_close ();";
+  o->newline() << "for (i = 0; i < ARRAY_SIZE(stap_probes); ++i) {";
+  o->newline(1) << "if (stap_probes[i].timing)";
+  o->newline(1) << "_stp_stat_del (stap_probes[i].timing);";
+  o->newline(-1) << "stap_probes[i].timing = NULL;";
+  o->newline(-1) << "}";
+  o->newline() << "#endif";
+
   // For any partially registered/unregistered kernel facilities.
   o->newline() << "atomic_set (&session_state, STAP_SESSION_STOPPED);";
   o->newline() << "#ifdef STAPCONF_SYNCHRONIZE_SCHED";
@@ -1873,6 +2158,13 @@ c_unparser::emit_module_exit ()
 	o->newline() << getmap (v).fini();
       else
 	o->newline() << getvar (v).fini();
+      if (v->arity == 0 && v->percpu_counter)
+        {
+          string vn = c_globalname (v->name);
+          o->newline() << "if (global." << vn << "_pcpu != NULL)";
+          o->newline(1) << "_stp_free_percpu (global." << vn << "_pcpu);";
+          o->indent(-1);
+        }
     }
 
   o->newline() << "for_each_possible_cpu(cpu) {";
@@ -1889,6 +2181,11 @@ c_unparser::emit_module_exit ()
   o->newline() << " _stp_kill_time();";  // Go to a beach.  Drink a beer.
   o->newline() << "#endif";
 
+  // No more live timing reads, since the Stats are freed below.
+  o->newline() << "#ifdef STP_TIMING";
+  o->newline() << "stp_timing_file_close ();";
+  o->newline() << "#endif";
+
   // NB: PR13386 points out that _stp_printf may be called from contexts
   // without already active preempt disabling, which breaks various uses
   // of smp_processor_id().  So we temporary block preemption around this
@@ -1920,6 +2217,9 @@ c_unparser::emit_module_exit ()
   o->newline(-1) << "}";
   o->newline() << "#endif"; // STP_TIMING
   o->newline(-1) << "}";
+  o->newline() << "#if defined(STP_TIMING) && defined(STP_USE_DWARF_UNWINDER)";
+  o->newline() << "_stp_unwind_cache_report();";
+  o->newline() << "#endif";
   o->newline() << "_stp_print_flush();";
   o->newline() << "#endif";
 
@@ -1972,12 +2272,13 @@ c_unparser::emit_function (functiondecl* v)
   this->current_function = v;
   this->tmpvar_counter = 0;
   this->action_counter = 0;
+  this->unchecked_actions = 0;
 
   o->newline() << "__label__ out;";
   o->newline()
     << "struct " << c_funcname (v->name) << "_locals * "
     << " __restrict__ l = "
-    << "& c->locals[c->nesting+1]." << c_funcname (v->name) // NB: nesting+1
+    << "& " << c_funclocals (v) // NB: nesting+1, unless framed
     << ";";
   o->newline() << "(void) l;"; // make sure "l" is marked used
   o->newline() << "#define CONTEXT c";
@@ -1997,7 +2298,8 @@ c_unparser::emit_function (functiondecl* v)
   // check/increment nesting level
   // NB: incoming c->nesting level will be -1 (if we're called directly from a probe),
   // or 0...N (if we're called from another function).  Incoming parameters are already
-  // stored in c->locals[c->nesting+1].  See also ::emit_common_header() for more.
+  // stored in c->locals[c->nesting+1], or in the function's frame.  See also
+  // ::emit_common_header() for more.
 
   o->newline() << "if (unlikely (c->nesting+1 >= MAXNESTING)) {";
   o->newline(1) << "c->last_error = ";
@@ -2025,6 +2327,10 @@ c_unparser::emit_function (functiondecl* v)
       o->newline() << retvalue.init();
     }
 
+  // Count the call, and check in case of recursion.
+  if (session->amortize_actions)
+    record_actions(1, v->tok, true, true);
+
   o->newline() << "#define return goto out"; // redirect embedded-C return
   v->body->visit (this);
   o->newline() << "#undef return";
@@ -2064,6 +2370,7 @@ c_unparser::emit_probe (derived_probe* v)
   this->current_probe = v;
   this->tmpvar_counter = 0;
   this->action_counter = 0;
+  this->unchecked_actions = 0;
 
   // If we about to emit a probe that is exactly the same as another
   // probe previously emitted, make the second probe just call the
@@ -2189,6 +2496,8 @@ c_unparser::emit_probe (derived_probe* v)
       // someday be local
 
       o->indent(1);
+      if (session->striped_locks)
+        o->newline() << "_stp_map_unlock_stripe (c);";
       if (v->needs_global_locks ())
 	emit_unlocks (vut);
 
@@ -2203,11 +2512,41 @@ c_unparser::emit_probe (derived_probe* v)
 }
 
 
+// Find the global arrays that a probe iterates over or deletes as a
+// whole.  With --striped-locks, these still need exclusive locking.
+struct whole_array_collecting_visitor: public functioncall_traversing_visitor
+{
+  set<vardecl*> arrays;
+
+  void visit_foreach_loop (foreach_loop* s)
+  {
+    symbol *array = NULL;
+    hist_op *hist = NULL;
+    classify_indexable (s->base, array, hist);
+    if (array)
+      arrays.insert (array->referent);
+    functioncall_traversing_visitor::visit_foreach_loop (s);
+  }
+
+  void visit_delete_statement (delete_statement* s)
+  {
+    symbol *sym = dynamic_cast<symbol *>(s->value);
+    if (sym && sym->referent->arity > 0)
+      arrays.insert (sym->referent);
+    functioncall_traversing_visitor::visit_delete_statement (s);
+  }
+};
+
+
 void
 c_unparser::emit_lock_decls(const varuse_collecting_visitor& vut)
 {
   unsigned numvars = 0;
 
+  whole_array_collecting_visitor wacv;
+  if (session->striped_locks)
+    current_probe->body->visit (& wacv);
+
   if (session->verbose > 1)
     clog << "probe " << *current_probe->sole_location() << " locks ";
 
@@ -2221,7 +2560,16 @@ c_unparser::emit_lock_decls(const varuse_collecting_visitor& vut)
       bool write_p = vut.written.find(v) != vut.written.end();
       if (!read_p && !write_p) continue;
 
-      if (v->type == pe_stats) // read and write locks are flipped
+      // Per-cpu counters are only added to or read, and don't need
+      // locking for either.
+      if (v->arity == 0 && v->percpu_counter) continue;
+
+      // Neither does reading seqlock globals.
+      if (v->seqlock && !write_p) continue;
+
+      // Per-cpu counting arrays are added to per-cpu and aggregated
+      // on reads, just like stats.
+      if (v->type == pe_stats || v->percpu_counter) // read and write locks are flipped
         // Specifically, a "<<<" to a stats object is considered a
         // "shared-lock" operation, since it's implicitly done
         // per-cpu.  But a "@op(x)" extraction is an "exclusive-lock"
@@ -2232,6 +2580,16 @@ c_unparser::emit_lock_decls(const varuse_collecting_visitor& vut)
           else if (read_p && !write_p) { read_p = false; write_p = true; }
         }
 
+      // Striped arrays are only locked exclusively for whole-array
+      // operations, since element accesses lock their own stripe.
+      if (is_striped (v))
+        {
+          if (wacv.arrays.find(v) != wacv.arrays.end())
+            write_p = true;
+          else if (write_p)
+            { read_p = true; write_p = false; }
+        }
+
       // We don't need to read lock "read-mostly" global variables.  A
       // "read-mostly" global variable is only written to within
       // probes that don't need global variable locking (such as
@@ -2250,6 +2608,7 @@ c_unparser::emit_lock_decls(const varuse_collecting_visitor& vut)
       o->newline() << ".write_p = " << (write_p ? 1 : 0) << ",";
       o->newline() << "#ifdef STP_TIMING";
       o->newline() << ".skipped = &global." << c_globalname (v->name) << "_lock_skip_count,";
+      o->newline() << ".contention = &global." << c_globalname (v->name) << "_lock_contention_count,";
       o->newline() << "#endif";
       o->newline(-1) << "},";
 
@@ -2361,19 +2720,29 @@ c_unparser::emit_map_type_instantiations ()
   for (map<string,functiondecl*>::iterator it = session->functions.begin(); it != session->functions.end(); it++)
     collect_map_index_types(it->second->locals, types);
 
+  // Per-cpu counting arrays need the pmap flavor of their type too.
+  set< pair<vector<exp_type>, exp_type> > parallel_types;
+  for (unsigned i = 0; i < session->globals.size(); ++i)
+    {
+      vardecl *v = session->globals[i];
+      if (v->arity > 0 && (v->type == pe_stats || v->percpu_counter))
+	parallel_types.insert(make_pair(v->index_types, v->type));
+    }
+
   if (!types.empty())
     o->newline() << "#include \"alloc.c\"";
 
   for (set< pair<vector<exp_type>, exp_type> >::const_iterator i = types.begin();
        i != types.end(); ++i)
     {
+      bool parallel = (i->second == pe_stats || parallel_types.count(*i));
       o->newline() << "#define VALUE_TYPE " << mapvar::value_typename(i->second);
       for (unsigned j = 0; j < i->first.size(); ++j)
 	{
 	  string ktype = mapvar::key_typename(i->first.at(j));
 	  o->newline() << "#define KEY" << (j+1) << "_TYPE " << ktype;
 	}
-      if (i->second == pe_stats)
+      if (parallel)
 	o->newline() << "#include \"pmap-gen.c\"";
       else
 	o->newline() << "#include \"map-gen.c\"";
@@ -2388,7 +2757,7 @@ c_unparser::emit_map_type_instantiations ()
        * the aggregated map.  The better way to handle this is for pmap-gen.c to make
        * this include, but that's impossible with the way they are set up now.
        */
-      if (i->second == pe_stats)
+      if (parallel)
 	{
 	  o->newline() << "#define VALUE_TYPE " << mapvar::value_typename(i->second);
 	  for (unsigned j = 0; j < i->first.size(); ++j)
@@ -2466,6 +2835,24 @@ c_unparser::c_funcname (const string& e)
 }
 
 
+bool
+c_unparser::is_framed (functiondecl* fd)
+{
+  return find (framed_functions.begin(), framed_functions.end(), fd)
+    != framed_functions.end();
+}
+
+
+string
+c_unparser::c_funclocals (functiondecl* fd)
+{
+  string fn = c_funcname (fd->name);
+  if (is_framed (fd))
+    return "(*(struct " + fn + "_locals *) &c->frames[stp_frame_" + fn + "])";
+  return "c->locals[c->nesting+1]." + fn;
+}
+
+
 string
 c_unparser::c_arg_define (const string& e)
 {
@@ -2808,7 +3195,10 @@ c_unparser::getvar(vardecl *v, token const *tok)
       i = session->stat_decls.find(v->name);
       if (i != session->stat_decls.end())
 	sd = i->second;
-      return var (this, loc, v->type, sd, v->name);
+      var gv (this, loc, v->type, sd, v->name);
+      if (v->read_mostly)
+        gv.set_read_mostly ();
+      return gv;
     }
 }
 
@@ -2824,7 +3214,20 @@ c_unparser::getmap(vardecl *v, token const *tok)
   if (i != session->stat_decls.end())
     sd = i->second;
   return mapvar (this, is_local (v, tok), v->type, sd,
-      v->name, v->index_types, v->maxsize, v->wrap);
+      v->name, v->index_types, v->maxsize, v->wrap, v->percpu_counter,
+      is_striped (v));
+}
+
+
+// With --striped-locks, element accesses to global arrays lock the hash
+// stripe of their key, and probes only need the array's lock shared for
+// them.  Wrapping arrays evict entries from other stripes, and parallel
+// arrays are accessed per-cpu anyway, so those keep the global lock.
+bool
+c_unparser::is_striped (vardecl *v)
+{
+  return (session->striped_locks && v->arity > 0 && !v->wrap
+          && v->type != pe_stats && !v->percpu_counter);
 }
 
 
@@ -2838,16 +3241,40 @@ c_unparser::getiter(symbol *s)
 // Queue up some actions to remove from actionremaining.  Set update=true at
 // the end of basic blocks to actually update actionremaining and check it
 // against MAXACTION.
+//
+// With --amortize-actions, an update only subtracts the queued actions.
+// The check is left to the places where code can run again, which pass
+// check=true: loop back-edges, function entries and catch handlers.
+// Straight-line code only runs once, so its actions just need to be
+// counted, but after max_unchecked_actions of them in a row a check
+// still follows, to bound how far past MAXACTION a handler can get.
 void
-c_unparser::record_actions (unsigned actions, const token* tok, bool update)
+c_unparser::record_actions (unsigned actions, const token* tok, bool update,
+                            bool check)
 {
+  const unsigned max_unchecked_actions = 100;
+
   action_counter += actions;
 
+  if (session->amortize_actions
+      && !check && unchecked_actions + action_counter < max_unchecked_actions)
+    {
+      if (update && action_counter > 0)
+        {
+          o->newline() << "c->actionremaining -= " << action_counter << ";";
+          unchecked_actions += action_counter;
+          action_counter = 0;
+        }
+      return;
+    }
+
   // Update if needed, or after queueing up a few actions, in case of very
   // large code sequences.
-  if ((update && action_counter > 0) || action_counter >= 10/*<-arbitrary*/)
+  if ((update && action_counter > 0) || action_counter >= 10/*<-arbitrary*/
+      || session->amortize_actions)
     {
-      o->newline() << "c->actionremaining -= " << action_counter << ";";
+      if (action_counter > 0)
+        o->newline() << "c->actionremaining -= " << action_counter << ";";
       o->newline() << "if (unlikely (c->actionremaining <= 0)) {";
       o->newline(1) << "c->last_error = ";
       o->line() << STAP_T_04;
@@ -2860,6 +3287,7 @@ c_unparser::record_actions (unsigned actions, const token* tok, bool update)
       o->newline() << "goto out;";
       o->newline(-1) << "}";
       action_counter = 0;
+      unchecked_actions = 0;
     }
 }
 
@@ -2905,6 +3333,8 @@ void c_unparser::visit_try_block (try_block *s)
 
   o->newline() << "if (0) goto out;"; // to prevent 'unused label' warnings
   o->newline() << "out:";
+  if (session->striped_locks)
+    o->newline() << "_stp_map_unlock_stripe (c);";
   o->newline() << ";"; // to have _some_ statement
 
   // Close the scope of the above nested 'out' label, to make sure
@@ -2923,7 +3353,7 @@ void c_unparser::visit_try_block (try_block *s)
 
   // Prevent the catch{} handler from even starting if MAXACTIONS have
   // already been used up.  Add one for the act of catching too.
-  record_actions(1, s->tok, true);
+  record_actions(1, s->tok, true, true);
 
   if (s->catch_block)
     {
@@ -3063,7 +3493,7 @@ c_unparser::visit_for_loop (for_loop *s)
   loop_break_labels.push_back (breaklabel);
   loop_continue_labels.push_back (contlabel);
   s->block->visit (this);
-  record_actions(0, s->block->tok, true);
+  record_actions(0, s->block->tok, true, true);
   loop_break_labels.pop_back ();
   loop_continue_labels.pop_back ();
 
@@ -3275,7 +3705,7 @@ c_unparser::visit_foreach_loop (foreach_loop *s)
 	      // If the user wanted us to sort by value, we'll sort by
 	      // @count instead for aggregates.  '-5' tells the
 	      // runtime to sort by count.
-	      if (s->sort_column == 0)
+	      if (s->sort_column == 0 && mv.type() == pe_stats)
 		sort_column = -5; /* runtime/map.c SORT_COUNT */
 	      else
 		sort_column = s->sort_column;
@@ -3376,7 +3806,7 @@ c_unparser::visit_foreach_loop (foreach_loop *s)
         }
 
       visit_foreach_loop_value(this, s, iv.get_value(array->type));
-      record_actions(0, s->block->tok, true);
+      record_actions(0, s->block->tok, true, true);
       o->newline(-1) << "}";
       loop_break_labels.pop_back ();
       loop_continue_labels.pop_back ();
@@ -3444,7 +3874,7 @@ c_unparser::visit_foreach_loop (foreach_loop *s)
         }
 
       visit_foreach_loop_value(this, s, agg.get_hist(bucketvar));
-      record_actions(1, s->block->tok, true);
+      record_actions(1, s->block->tok, true, true);
 
       o->newline(-1) << contlabel << ":";
       o->newline(1) << "continue;";
@@ -3536,7 +3966,14 @@ delete_statement_operand_visitor::visit_symbol (symbol* e)
 	  parent->o->newline() << "_stp_stat_clear (" << v.value() << ");";
 	  break;
 	case pe_long:
-	  parent->o->newline() << v.value() << " = 0;";
+	  if (e->referent->seqlock && !v.is_local())
+	    {
+	      parent->o->newline() << "write_seqlock (&" << v << "_seq);";
+	      parent->o->newline() << v.value() << " = 0;";
+	      parent->o->newline() << "write_sequnlock (&" << v << "_seq);";
+	    }
+	  else
+	    parent->o->newline() << v.value() << " = 0;";
 	  break;
 	case pe_string:
 	  parent->o->newline() << v.value() << "[0] = '\\0';";
@@ -3588,7 +4025,11 @@ delete_statement_operand_visitor::visit_arrayindex (arrayindex* e)
 
       {
 	mapvar mvar = parent->getmap (array->referent, e->tok);
+	if (mvar.striped)
+	  parent->o->newline() << mvar.lock_stripe(idx) << ";";
 	parent->o->newline() << mvar.del (idx) << ";";
+	if (mvar.striped)
+	  parent->o->newline() << mvar.unlock_stripe() << ";";
       }
     }
   else
@@ -3632,7 +4073,7 @@ c_unparser::visit_continue_statement (continue_statement* s)
   if (loop_continue_labels.empty())
     throw semantic_error (_("cannot 'continue' outside loop"), s->tok);
 
-  record_actions(1, s->tok, true);
+  record_actions(1, s->tok, true, true);
   o->newline() << "goto " << loop_continue_labels.back() << ";";
 }
 
@@ -3900,7 +4341,11 @@ c_unparser::visit_array_in (array_in* e)
 
       tmpvar res = gensym (pe_long);
       mapvar mvar = getmap (array->referent, e->tok);
+      if (mvar.striped)
+        o->newline() << mvar.lock_stripe(idx) << ";";
       c_assign (res, mvar.exists(idx), e->tok);
+      if (mvar.striped)
+        o->newline() << mvar.unlock_stripe() << ";";
 
       o->newline() << res << ";";
     }
@@ -4117,7 +4562,12 @@ c_unparser::visit_symbol (symbol* e)
     throw semantic_error (_("invalid reference to array"), e->tok);
 
   var v = getvar(r, e->tok);
-  o->line() << v;
+  if (r->percpu_counter && !v.is_local())
+    o->line() << "_stp_counter_read (&" << v << ", " << v << "_pcpu)";
+  else if (r->seqlock && !v.is_local())
+    o->line() << "_stp_seqlock_read (&" << v << ", &" << v << "_seq)";
+  else
+    o->line() << v;
 }
 
 
@@ -4230,7 +4680,35 @@ c_unparser_assignment::visit_symbol (symbol *e)
   prepare_rvalue (op, rval, e->tok);
 
   var lvar = parent->getvar (e->referent, e->tok);
-  c_assignop (res, lvar, rval, e->tok);
+  if (e->referent->percpu_counter && !lvar.is_local())
+    {
+      // Only ever a statement of its own, see percpu_counter_collector,
+      // so its value doesn't matter.
+      translator_output* o = parent->o;
+      if (op == "=")
+        o->newline() << "_stp_counter_set (&" << lvar << ", "
+                     << lvar << "_pcpu, " << rval << ");";
+      else if (op == "++" || op == "+=")
+        o->newline() << "_stp_counter_add (" << lvar << "_pcpu, "
+                     << rval << ");";
+      else if (op == "--" || op == "-=")
+        o->newline() << "_stp_counter_add (" << lvar << "_pcpu, -("
+                     << rval << "));";
+      else
+        throw semantic_error (_("unexpected per-cpu counter operator"), e->tok);
+      o->newline() << "0;";
+      return;
+    }
+  if (e->referent->seqlock && !lvar.is_local())
+    {
+      // No division, so no jumping out in between, see
+      // semantic_pass_seqlocks.
+      parent->o->newline() << "write_seqlock (&" << lvar << "_seq);";
+      c_assignop (res, lvar, rval, e->tok);
+      parent->o->newline() << "write_sequnlock (&" << lvar << "_seq);";
+    }
+  else
+    c_assignop (res, lvar, rval, e->tok);
 
   parent->o->newline() << res << ";";
 }
@@ -4520,7 +4998,12 @@ c_unparser::visit_arrayindex (arrayindex* e)
 
       mapvar mvar = getmap (array->referent, e->tok);
       // o->newline() << "c->last_stmt = " << lex_cast_qstring(*e->tok) << ";";
-      c_assign (res, mvar.get(idx), e->tok);
+      bool pre_agg = (aggregations_active.count(mvar.value()) > 0);
+      if (mvar.striped)
+        o->newline() << mvar.lock_stripe(idx) << ";";
+      c_assign (res, mvar.get(idx, pre_agg), e->tok);
+      if (mvar.striped)
+        o->newline() << mvar.unlock_stripe() << ";";
 
       o->newline() << res << ";";
     }
@@ -4677,14 +5160,35 @@ c_unparser_assignment::visit_arrayindex (arrayindex *e)
 	  // o->newline() << lvar << " = " << rvar << ";";
 	  // o->newline() << res << " = " << rvar << ";";
 	}
+      else if (array->referent->percpu_counter)
+	{
+	  // Only ever a statement of its own, see percpu_counter_collector,
+	  // so this just adds to the current cpu's map.
+	  mapvar mvar = parent->getmap (array->referent, e->tok);
+	  o->newline() << "c->last_stmt = " << lex_cast_qstring(*e->tok) << ";";
+	  if (op == "++" || op == "+=")
+	    o->newline() << lvar << " = " << rvar << ";";
+	  else if (op == "--" || op == "-=")
+	    o->newline() << lvar << " = -(" << rvar << ");";
+	  else
+	    throw semantic_error (_("unexpected per-cpu counter operator"), e->tok);
+	  o->newline() << mvar.add (idx, lvar) << ";";
+	  res = lvar;
+	}
       else
 	{
 	  mapvar mvar = parent->getmap (array->referent, e->tok);
 	  o->newline() << "c->last_stmt = " << lex_cast_qstring(*e->tok) << ";";
+	  // NB: errors in between jump out with the stripe still locked,
+	  // the out: labels release it.
+	  if (mvar.striped)
+	    o->newline() << mvar.lock_stripe(idx) << ";";
 	  if (op != "=") // don't bother fetch slot if we will just overwrite it
 	    parent->c_assign (lvar, mvar.get(idx), e->tok);
 	  c_assignop (res, lvar, rvar, e->tok);
 	  o->newline() << mvar.set (idx, lvar) << ";";
+	  if (mvar.striped)
+	    o->newline() << mvar.unlock_stripe() << ";";
 	}
 
       o->newline() << res << ";";
@@ -4759,8 +5263,7 @@ c_unparser::visit_functioncall (functioncall* e)
 	throw semantic_error (_("function argument type mismatch"),
 			      e->args[i]->tok, r->formal_args[i]->tok);
 
-      c_assign ("c->locals[c->nesting+1]." +
-		c_funcname (r->name) + "." +
+      c_assign (c_funclocals (r) + "." +
                 c_localname (r->formal_args[i]->name),
                 tmp[i].value(),
                 e->args[i]->type,
@@ -4777,9 +5280,7 @@ c_unparser::visit_functioncall (functioncall* e)
     // If we passed typechecking, then nothing will use this return value
     o->newline() << "(void) 0;";
   else
-    o->newline() << "c->locals[c->nesting+1]"
-                 << "." << c_funcname (r->name)
-                 << ".__retvalue;";
+    o->newline() << c_funclocals (r) << ".__retvalue;";
 }
 
 
@@ -5263,10 +5764,59 @@ struct unwindsym_dump_context
   size_t eh_frame_hdr_len;
   Dwarf_Addr eh_addr;
   Dwarf_Addr eh_frame_hdr_addr;
+  void *eh_frame_idx;
+  size_t eh_frame_idx_len;
 
   set<string> undone_unwindsym_modules;
 };
 
+// Writes the compact FDE index that the runtime searches in
+// _stp_search_unwind_index(), see struct _stp_unwind_index in
+// runtime/unwind/unwind.h.  Start addresses are stored as 32-bit
+// deltas from the lowest one, next to the 32-bit offset of the FDE in
+// its unwind section, sorted by address.  That is half the size of
+// an absptr search table on 64-bit.  Returns false if the addresses or
+// offsets don't fit in 32 bits.
+static bool create_unwind_index (const set< pair<Dwarf_Addr, Dwarf_Off> >& fdes,
+				 void **index, size_t *index_len)
+{
+  set< pair<Dwarf_Addr, Dwarf_Off> >::const_iterator it;
+
+  *index = NULL;
+  *index_len = 0;
+  if (fdes.empty())
+    return false;
+
+  uint64_t base = fdes.begin()->first;
+  for (it = fdes.begin(); it != fdes.end(); it++)
+    if (it->first - base > 0xffffffffULL || it->second > 0xffffffffULL)
+      return false;
+
+  // Header: version (2, eh_frame_hdr has 1), 3 bytes padding,
+  // 32-bit number of entries, 64-bit base address.
+  size_t total_size = 16 + 8 * fdes.size();
+  uint8_t *idx = (uint8_t *) calloc(1, total_size);
+  if (idx == NULL)
+    return false;
+  uint32_t num = fdes.size();
+  idx[0] = 2;
+  memcpy(idx + 4, &num, sizeof(num));
+  memcpy(idx + 8, &base, sizeof(base));
+
+  uint8_t *entry = idx + 16;
+  for (it = fdes.begin(); it != fdes.end(); it++, entry += 8)
+    {
+      uint32_t start = it->first - base;
+      uint32_t off = it->second;
+      memcpy(entry, &start, sizeof(start));
+      memcpy(entry + 4, &off, sizeof(off));
+    }
+
+  *index = idx;
+  *index_len = total_size;
+  return true;
+}
+
 static void create_debug_frame_hdr (const unsigned char e_ident[],
 				    Elf_Data *debug_frame,
 				    void **debug_frame_hdr,
@@ -5338,6 +5888,10 @@ static void create_debug_frame_hdr (const unsigned char e_ident[],
       *debug_frame_off = (*it).first - first_addr;
     }
 
+  if (create_unwind_index (fdes, debug_frame_hdr, debug_frame_hdr_len))
+    return;
+
+  // Too big for the compact index, use an eh_frame_hdr like table.
   size_t total_size = 4 + (2 * size) + (2 * size * fdes.size());
   uint8_t *hdr = (uint8_t *) malloc(total_size);
   *debug_frame_hdr = hdr;
@@ -5371,6 +5925,148 @@ static void create_debug_frame_hdr (const unsigned char e_ident[],
     }
 }
 
+// Size of a pointer with the given DW_EH_PE encoding, 0 for the
+// variable length ones.
+static size_t eh_pointer_size (uint8_t enc, int size)
+{
+  switch (enc & 0x0f)
+    {
+    case DW_EH_PE_absptr: return size;
+    case DW_EH_PE_udata2: case DW_EH_PE_sdata2: return 2;
+    case DW_EH_PE_udata4: case DW_EH_PE_sdata4: return 4;
+    case DW_EH_PE_udata8: case DW_EH_PE_sdata8: return 8;
+    default: return 0;
+    }
+}
+
+// Reads an FDE initial location with the given pointer encoding from
+// p, which is at address field_addr.  Only handles the encodings that
+// compilers use for that, returns false for the others.
+static bool read_eh_pointer (const uint8_t *p, const uint8_t *end,
+			     uint8_t enc, int size, Dwarf_Addr field_addr,
+			     Dwarf_Addr *res)
+{
+  Dwarf_Addr val;
+  size_t len = eh_pointer_size (enc, size);
+
+  if (enc == DW_EH_PE_omit || (enc & DW_EH_PE_indirect)
+      || len == 0 || p + len > end)
+    return false;
+
+  switch (enc & 0x0f)
+    {
+    case DW_EH_PE_absptr:
+      if (size == 4)
+	val = *((uint32_t *) p);
+      else
+	val = *((uint64_t *) p);
+      break;
+    case DW_EH_PE_udata2: val = *((uint16_t *) p); break;
+    case DW_EH_PE_sdata2: val = (Dwarf_Addr) *((int16_t *) p); break;
+    case DW_EH_PE_udata4: val = *((uint32_t *) p); break;
+    case DW_EH_PE_sdata4: val = (Dwarf_Addr) *((int32_t *) p); break;
+    default: val = *((uint64_t *) p); break;
+    }
+
+  switch (enc & 0x70)
+    {
+    case DW_EH_PE_absptr: break;
+    case DW_EH_PE_pcrel: val += field_addr; break;
+    default: return false;
+    }
+  if (size == 4)
+    val &= 0xffffffff;
+  *res = val;
+  return true;
+}
+
+// Synthesizes a compact FDE index for .eh_frame, at sh_addr in the
+// file, so the runtime can binary search it like the debug_frame.
+// Start addresses are made relative like eh_addr (see get_unwind_data)
+// for the runtime to adjust them to the load address.  Returns false,
+// leaving the .eh_frame_hdr to be used, if any FDE couldn't be decoded.
+static bool create_eh_frame_index (const unsigned char e_ident[],
+				   Elf_Data *eh_frame,
+				   Dwarf_Addr sh_addr, Dwarf_Addr eh_addr,
+				   void **index, size_t *index_len)
+{
+  map<Dwarf_Off, uint8_t> cie_enc; // FDE pointer encoding per CIE
+  set< pair<Dwarf_Addr, Dwarf_Off> > fdes;
+  vector<pair<Dwarf_Off, Dwarf_CFI_Entry> > fde_entries;
+  int size = (e_ident[EI_CLASS] == ELFCLASS32) ? 4 : 8;
+  Dwarf_Off off = 0;
+  Dwarf_CFI_Entry entry;
+  int res = 0;
+
+  *index = NULL;
+  *index_len = 0;
+
+  while (res != 1)
+    {
+      Dwarf_Off next_off;
+      res = dwarf_next_cfi (e_ident, eh_frame, true, off, &next_off, &entry);
+      if (res < 0)
+	return false;
+      if (res == 0)
+	{
+	  if (entry.CIE_id == DW_CIE_ID_64)
+	    {
+	      // Find the 'R' augmentation, the FDE pointer encoding.
+	      uint8_t enc = DW_EH_PE_absptr;
+	      const char *aug = entry.cie.augmentation;
+	      const uint8_t *data = entry.cie.augmentation_data;
+	      const uint8_t *data_end = data + entry.cie.augmentation_data_size;
+	      if (aug[0] == 'z')
+		for (aug++; *aug != '\0'; aug++)
+		  {
+		    if (*aug == 'R' && data < data_end)
+		      {
+			enc = *data;
+			break;
+		      }
+		    else if (*aug == 'L' && data < data_end)
+		      data++;
+		    else if (*aug == 'P' && data < data_end)
+		      {
+			// Personality routine pointer, skip it.
+			size_t len = eh_pointer_size (*data++, size);
+			if (len == 0)
+			  return false;
+			data += len;
+		      }
+		    else if (*aug != 'S' && *aug != 'B')
+		      return false;
+		  }
+	      else if (aug[0] != '\0')
+		return false;
+	      cie_enc[off] = enc;
+	    }
+	  else
+	    fde_entries.push_back(make_pair(off, entry));
+	}
+      off = next_off;
+    }
+
+  for (unsigned i = 0; i < fde_entries.size(); i++)
+    {
+      Dwarf_Off fde_off = fde_entries[i].first;
+      Dwarf_CFI_Entry& fde = fde_entries[i].second;
+      map<Dwarf_Off, uint8_t>::iterator ci = cie_enc.find(fde.fde.CIE_pointer);
+      if (ci == cie_enc.end())
+	return false;
+
+      const uint8_t *start = fde.fde.start;
+      Dwarf_Addr field_addr = sh_addr + (start - (const uint8_t *) eh_frame->d_buf);
+      Dwarf_Addr addr;
+      if (! read_eh_pointer (start, fde.fde.end, ci->second, size,
+			     field_addr, &addr))
+	return false;
+      fdes.insert(make_pair(addr - sh_addr + eh_addr, fde_off));
+    }
+
+  return create_unwind_index (fdes, index, index_len);
+}
+
 // Get the .debug_frame end .eh_frame sections for the given module.
 // Also returns the lenght of both sections when found, plus the section
 // address (offset) of the eh_frame data. If a debug_frame is found, a
@@ -5384,8 +6080,11 @@ static void get_unwind_data (Dwfl_Module *m,
 			     size_t *debug_frame_hdr_len,
 			     Dwarf_Addr *debug_frame_off,
 			     Dwarf_Addr *eh_frame_hdr_addr,
+			     void **eh_frame_idx, size_t *eh_frame_idx_len,
 			     systemtap_session& session)
 {
+  Elf_Data *eh_data = NULL;
+  Dwarf_Addr eh_sh_addr = 0;
   Dwarf_Addr start, bias = 0;
   GElf_Ehdr *ehdr, ehdr_mem;
   GElf_Shdr *shdr, shdr_mem;
@@ -5411,6 +6110,8 @@ static void get_unwind_data (Dwfl_Module *m,
 	  data = elf_rawdata(scn, NULL);
 	  *eh_frame = data->d_buf;
 	  *eh_len = data->d_size;
+	  eh_data = data;
+	  eh_sh_addr = shdr->sh_addr;
 	  // For ".dynamic" sections we want the offset, not absolute addr.
 	  // Note we don't trust dwfl_module_relocations() for ET_EXEC.
 	  if (ehdr->e_type != ET_EXEC && dwfl_module_relocations (m) > 0)
@@ -5436,6 +6137,12 @@ static void get_unwind_data (Dwfl_Module *m,
         break;
     }
 
+  // Kernel modules (ET_REL) have unrelocated FDE addresses, for them
+  // the runtime has to make do with the .eh_frame_hdr, if any.
+  if (eh_data != NULL && eh_data->d_size > 0 && ehdr->e_type != ET_REL)
+    create_eh_frame_index (ehdr->e_ident, eh_data, eh_sh_addr, *eh_addr,
+			   eh_frame_idx, eh_frame_idx_len);
+
   // fetch .debug_frame info preferably from dwarf debuginfo file.
   elf = (dwarf_getelf (dwfl_module_getdwarf (m, &bias))
 	 ?: dwfl_module_getelf (m, &bias));
@@ -5844,10 +6551,108 @@ dump_unwind_tables (Dwfl_Module *m,
 		   &c->eh_addr, &c->eh_frame_hdr, &c->eh_frame_hdr_len,
 		   &c->debug_frame_hdr, &c->debug_frame_hdr_len,
 		   &c->debug_frame_off, &c->eh_frame_hdr_addr,
+		   &c->eh_frame_idx, &c->eh_frame_idx_len,
                    c->session);
   return DWARF_CB_OK;
 }
 
+// Symbols per restart point of the compact symbol tables, see
+// runtime/sym.h.  Must match STP_SYMTAB_RESTART there.
+#define SYMTAB_RESTART 16
+
+static void
+put_uleb128 (vector<uint8_t>& out, uint64_t val)
+{
+  do
+    {
+      uint8_t b = val & 0x7f;
+      val >>= 7;
+      if (val != 0)
+        b |= 0x80;
+      out.push_back (b);
+    }
+  while (val != 0);
+}
+
+// Write out the symbols of one section as a compact table: one uleb128
+// address delta plus uleb128 name offset per symbol, a restart point
+// with the absolute address every SYMTAB_RESTART symbols so the runtime
+// can still binary search, and a string blob in which every distinct
+// name is stored only once.  Returns the number of symbols written.
+static unsigned
+dump_symbol_table (unwindsym_dump_context *c, unsigned stpmod_idx,
+                   unsigned secidx, Dwarf_Addr extra_offset)
+{
+  vector<uint8_t> symtab;
+  vector<pair<Dwarf_Addr, size_t> > restarts;
+  map<string, size_t> stroffs;
+  vector<const char *> strs;
+  size_t strlen_total = 0;
+  Dwarf_Addr prev = 0;
+  unsigned num = 0;
+
+  // We write out a *sorted* symbol table, so the runtime doesn't
+  // have to sort them later.
+  for (addrmap_t::iterator it = c->addrmap[secidx].begin();
+       it != c->addrmap[secidx].end(); it++)
+    {
+      // skip symbols that occur before our chosen base address
+      if (it->first < extra_offset)
+        continue;
+
+      Dwarf_Addr addr = it->first - extra_offset;
+      if (num % SYMTAB_RESTART == 0)
+        {
+          restarts.push_back (make_pair (addr, symtab.size ()));
+          prev = addr;
+        }
+
+      string name = it->second;
+      map<string, size_t>::iterator s = stroffs.find (name);
+      if (s == stroffs.end ())
+        {
+          s = stroffs.insert (make_pair (name, strlen_total)).first;
+          strs.push_back (it->second);
+          strlen_total += name.size () + 1;
+        }
+
+      put_uleb128 (symtab, addr - prev);
+      put_uleb128 (symtab, s->second);
+      prev = addr;
+      num++;
+    }
+
+  if (num == 0)
+    return 0;
+
+  c->output << "static const uint8_t "
+            << "_stp_module_" << stpmod_idx << "_symtab_" << secidx << "[] = {\n ";
+  for (size_t i = 0; i < symtab.size (); i++)
+    {
+      c->output << (int) symtab[i] << ","; // decimal is less wordy than hex
+      if ((i + 1) % 16 == 0)
+        c->output << "\n ";
+    }
+  c->output << "};\n";
+
+  c->output << "static const struct _stp_symtab_restart "
+            << "_stp_module_" << stpmod_idx << "_symtab_restarts_" << secidx
+            << "[] = {\n";
+  for (size_t i = 0; i < restarts.size (); i++)
+    c->output << "  { 0x" << hex << restarts[i].first << dec
+              << ", " << restarts[i].second << " },\n";
+  c->output << "};\n";
+
+  // One string literal per name, the "\0" ends up between them.
+  c->output << "static const char "
+            << "_stp_module_" << stpmod_idx << "_symstr_" << secidx << "[] =\n";
+  for (size_t i = 0; i < strs.size (); i++)
+    c->output << "  " << lex_cast_qstring (strs[i]) << " \"\\0\"\n";
+  c->output << "  ;\n";
+
+  return num;
+}
+
 static int
 dump_unwindsym_cxt (Dwfl_Module *m,
 		    unwindsym_dump_context *c,
@@ -5867,6 +6672,13 @@ dump_unwindsym_cxt (Dwfl_Module *m,
   Dwarf_Addr eh_addr = c->eh_addr;
   Dwarf_Addr eh_frame_hdr_addr = c->eh_frame_hdr_addr;
 
+  // Our own index replaces the .eh_frame_hdr search table.
+  if (c->eh_frame_idx != NULL)
+    {
+      eh_frame_hdr = c->eh_frame_idx;
+      eh_frame_hdr_len = c->eh_frame_idx_len;
+    }
+
   if (debug_frame != NULL && debug_len > 0)
     {
       c->output << "#if defined(STP_USE_DWARF_UNWINDER) && defined(STP_NEED_UNWIND_DATA)\n";
@@ -5917,7 +6729,7 @@ dump_unwindsym_cxt (Dwfl_Module *m,
     {
       c->output << "#if defined(STP_USE_DWARF_UNWINDER) && defined(STP_NEED_UNWIND_DATA)\n";
       c->output << "static uint8_t _stp_module_" << stpmod_idx
-		<< "_eh_frame_hdr[] = \n";
+		<< "_eh_frame_hdr[] __attribute__ ((aligned (8))) = \n";
       c->output << "  {";
       if (eh_frame_hdr_len > MAX_UNWIND_TABLE_SIZE)
         {
@@ -5948,36 +6760,17 @@ dump_unwindsym_cxt (Dwfl_Module *m,
 				  + ", " + dwfl_errmsg (-1));
     }
 
+  vector<unsigned> num_symbols (c->seclist.size (), 0);
   for (unsigned secidx = 0; secidx < c->seclist.size(); secidx++)
     {
-      c->output << "static struct _stp_symbol "
-                << "_stp_module_" << stpmod_idx<< "_symbols_" << secidx << "[] = {\n";
-
       string secname = c->seclist[secidx].first;
       Dwarf_Addr extra_offset;
       extra_offset = (secname == "_stext") ? c->stext_offset : 0;
 
       // Only include symbols if they will be used
       if (c->session.need_symbols)
-	{
-	  // We write out a *sorted* symbol table, so the runtime doesn't
-	  // have to sort them later.
-	  for (addrmap_t::iterator it = c->addrmap[secidx].begin();
-	       it != c->addrmap[secidx].end(); it++)
-	    {
-	      // skip symbols that occur before our chosen base address
-	      if (it->first < extra_offset)
-		continue;
-
-	      c->output << "  { 0x" << hex << it->first-extra_offset << dec
-			<< ", " << lex_cast_qstring (it->second) << " },\n";
-              // XXX: these literal strings all suffer ELF relocation bloat too.
-              // See if the tapsets.cxx:dwarf_derived_probe_group::emit_module_decls
-              // CALCIT hack could work here.
-	    }
-	}
-
-      c->output << "};\n";
+        num_symbols[secidx] = dump_symbol_table (c, stpmod_idx, secidx,
+                                                 extra_offset);
 
       /* For now output debug_frame index only in "magic" sections. */
       if (secname == ".dynamic" || secname == ".absolute"
@@ -5988,7 +6781,8 @@ dump_unwindsym_cxt (Dwfl_Module *m,
 	      c->output << "#if defined(STP_USE_DWARF_UNWINDER)"
 			<< " && defined(STP_NEED_UNWIND_DATA)\n";
 	      c->output << "static uint8_t _stp_module_" << stpmod_idx
-			<< "_debug_frame_hdr_" << secidx << "[] = \n";
+			<< "_debug_frame_hdr_" << secidx
+			<< "[] __attribute__ ((aligned (8))) = \n";
 	      c->output << "  {";
 	      if (debug_frame_hdr_len > MAX_UNWIND_TABLE_SIZE)
 		{
@@ -6022,8 +6816,12 @@ dump_unwindsym_cxt (Dwfl_Module *m,
       c->output << "{\n"
                 << ".name = " << lex_cast_qstring(c->seclist[secidx].first) << ",\n"
                 << ".size = 0x" << hex << c->seclist[secidx].second << dec << ",\n"
-                << ".symbols = _stp_module_" << stpmod_idx << "_symbols_" << secidx << ",\n"
-                << ".num_symbols = " << c->addrmap[secidx].size() << ",\n";
+                << ".num_symbols = " << num_symbols[secidx] << ",\n";
+      if (num_symbols[secidx] > 0)
+        c->output << ".symtab = _stp_module_" << stpmod_idx << "_symtab_" << secidx << ",\n"
+                  << ".symtab_restarts = _stp_module_" << stpmod_idx
+                  << "_symtab_restarts_" << secidx << ",\n"
+                  << ".symstr = _stp_module_" << stpmod_idx << "_symstr_" << secidx << ",\n";
 
       /* For now output debug_frame index only in "magic" sections. */
       string secname = c->seclist[secidx].first;
@@ -6171,7 +6969,9 @@ dump_unwindsym_cxt (Dwfl_Module *m,
   c->undone_unwindsym_modules.erase (modname);
 
   // release various malloc'd tables
-  // if (eh_frame_hdr) free (eh_frame_hdr); -- nope, this one comes from the elf image in memory
+  // Unless it's our own index, the eh_frame_hdr comes from the elf
+  // image in memory.
+  if (c->eh_frame_idx) free (c->eh_frame_idx);
   if (debug_frame_hdr) free (debug_frame_hdr);
 
   return DWARF_CB_OK;
@@ -6222,9 +7022,13 @@ dump_unwindsyms (Dwfl_Module *m,
   // We always need to check the symbols of the kernel if we use it,
   // for the extra_offset (also used for build_ids) and possibly
   // stp_kretprobe_trampoline_addr for the dwarf unwinder.
+  // With --defer-symbols, stapio looks up user-space symbols itself,
+  // so those symbol tables are left out of the module.
+  bool want_symbols = (c->session.need_symbols
+		       && ! (c->session.defer_symbols && name[0] == '/'));
   c->addrmap.clear();
   if (res == DWARF_CB_OK
-      && (c->session.need_symbols || ! strcmp(name, "kernel")))
+      && (want_symbols || ! strcmp(name, "kernel")))
     res = dump_symbol_tables (m, c, name, base);
 
   c->debug_frame = NULL;
@@ -6238,6 +7042,8 @@ dump_unwindsyms (Dwfl_Module *m,
   c->eh_frame_hdr_len = 0;
   c->eh_addr = 0;
   c->eh_frame_hdr_addr = 0;
+  c->eh_frame_idx = NULL;
+  c->eh_frame_idx_len = 0;
   if (res == DWARF_CB_OK && c->session.need_unwind)
     res = dump_unwind_tables (m, c, name, base);
 
@@ -6393,6 +7199,8 @@ emit_symbol_data (systemtap_session& s)
 				 0, /* eh_frame_hdr_len */
 				 0, /* eh_addr */
 				 0, /* eh_frame_hdr_addr */
+				 NULL, /* eh_frame_idx */
+				 0, /* eh_frame_idx_len */
 				 s.unwindsym_modules };
 
   // Micro optimization, mainly to speed up tiny regression tests
@@ -6497,15 +7305,24 @@ emit_symbol_data_done (unwindsym_dump_context *ctx, systemtap_session& s)
 
 struct recursion_info: public traversing_visitor
 {
-  recursion_info (systemtap_session& s): sess(s), nesting_max(0), recursive(false) {}
+  recursion_info (systemtap_session& s): sess(s), nesting_max(0), recursive(false),
+                                         current_function(0) {}
   systemtap_session& sess;
   unsigned nesting_max;
   bool recursive;
   std::vector <functiondecl *> current_nesting;
+  functiondecl *current_function; // whose body the traversal started from
+  set <functiondecl *> recursive_functions;
+  map <functiondecl *, set <functiondecl *> > callees;
 
   void visit_functioncall (functioncall* e) {
     traversing_visitor::visit_functioncall (e); // for arguments
 
+    functiondecl *caller = current_nesting.empty() ? current_function
+                                                   : current_nesting.back();
+    if (caller)
+      callees[caller].insert (e->referent);
+
     // check for nesting level
     unsigned nesting_depth = current_nesting.size() + 1;
     if (nesting_max < nesting_depth)
@@ -6521,6 +7338,8 @@ struct recursion_info: public traversing_visitor
       if (current_nesting[j] == e->referent)
         {
           recursive = true;
+          recursive_functions.insert (current_nesting.begin() + j,
+                                      current_nesting.end());
           if (sess.verbose > 3)
             clog << _F("identified recursive function: %s", e->referent->name.c_str()) << endl;
           return;
@@ -6531,6 +7350,40 @@ struct recursion_info: public traversing_visitor
     e->referent->body->visit (this);
     current_nesting.pop_back ();
   }
+
+  // List the functions that aren't recursive, and aren't called
+  // (indirectly) from a recursive function either, callers first.
+  // Their call depth is bounded, so their frames can be laid out
+  // statically; see c_unparser::emit_common_header.
+  void framed_functions (vector <functiondecl *>& framed) {
+    vector <functiondecl *> work (recursive_functions.begin(),
+                                  recursive_functions.end());
+    while (!work.empty())
+      {
+        functiondecl *fd = work.back();
+        work.pop_back();
+        set <functiondecl *>& c = callees[fd];
+        for (set <functiondecl *>::iterator it = c.begin(); it != c.end(); ++it)
+          if (recursive_functions.insert (*it).second)
+            work.push_back (*it);
+      }
+
+    set <functiondecl *> visited;
+    for (map<string,functiondecl*>::iterator it = sess.functions.begin();
+         it != sess.functions.end(); it++)
+      postorder (it->second, visited, framed);
+    reverse (framed.begin(), framed.end());
+  }
+
+  void postorder (functiondecl *fd, set <functiondecl *>& visited,
+                  vector <functiondecl *>& order) {
+    if (recursive_functions.count (fd) || !visited.insert (fd).second)
+      return;
+    set <functiondecl *>& c = callees[fd];
+    for (set <functiondecl *>::iterator it = c.begin(); it != c.end(); ++it)
+      postorder (*it, visited, order);
+    order.push_back (fd);
+  }
 };
 
 
@@ -6612,12 +7465,16 @@ translate_pass (systemtap_session& s)
       for (map<string,functiondecl*>::iterator it = s.functions.begin(); it != s.functions.end(); it++)
 	{
           functiondecl *fd = it->second;
+          ri.current_function = fd;
           fd->body->visit (& ri);
 	}
+      ri.framed_functions (cup.framed_functions);
+      cup.function_callees = ri.callees;
 
       if (s.verbose > 1)
-        clog << _F("function recursion-analysis: max-nesting %d %s", ri.nesting_max,
-                  (ri.recursive ? _(" recursive") : _(" non-recursive"))) << endl;
+        clog << _F("function recursion-analysis: max-nesting %d %s, %zu of %zu functions framed",
+                   ri.nesting_max, (ri.recursive ? _(" recursive") : _(" non-recursive")),
+                   cup.framed_functions.size(), s.functions.size()) << endl;
       unsigned nesting = ri.nesting_max + 1; /* to account for initial probe->function call */
       if (ri.recursive) nesting += 10;
 
@@ -6649,6 +7506,18 @@ translate_pass (systemtap_session& s)
       if (s.timing)
 	s.op->newline() << "#define STP_TIMING";
 
+      if (s.defer_symbols)
+	{
+	  s.op->newline() << "#define STP_DEFER_SYMBOLS 1";
+	  // stapio only replaces the tokens in output that it merges.
+	  s.op->newline() << "#ifndef STP_RELAY_PERCPU_STREAM";
+	  s.op->newline() << "#define STP_RELAY_PERCPU_STREAM 1";
+	  s.op->newline() << "#endif";
+	}
+
+      if (s.striped_locks)
+	s.op->newline() << "#define STP_STRIPED_LOCKS 1";
+
       if (s.need_unwind)
 	s.op->newline() << "#define STP_NEED_UNWIND_DATA 1";
 
@@ -6668,6 +7537,10 @@ translate_pass (systemtap_session& s)
 
       s.op->newline() << "#include \"probe_lock.h\" ";
 
+      for (unsigned i=0; i<s.globals.size(); i++)
+        if (s.globals[i]->read_mostly)
+          s.up->emit_read_mostly_global (s.globals[i]);
+
       if (s.globals.size()>0) {
         s.op->newline() << "static struct {";
         s.op->indent(1);
@@ -68,6 +68,9 @@ struct unparser
   //   ...
   // } context [MAXCONCURRENCY];
 
+  virtual void emit_read_mostly_global (vardecl* v) = 0;
+  // static TYPE s_NAME __read_mostly = INIT;
+
   // struct {
   virtual void emit_global (vardecl* v) = 0;
   // TYPE s_NAME;  // NAME is prefixed with "s_" to avoid kernel id collisions